@@ -0,0 +1,402 @@
+//
+//  voronoi_bench.cpp
+//  bench
+//
+//  Headless timing of the public Voronoi and PointCloudHalfSpace2D operations.
+//  Prints one JSON document to stdout. Built with CXXFLAGS=-DVORONOI_STATS=1 each
+//  result also has the library's counters and latency percentiles for the operation.
+//
+//  usage: voronoi_bench [--sizes=1000,10000,100000] [--queries=100000] [--seed=1]
+//                       [--dataset=uniform] [--raster=1024] [--halfspace-max=10000]
+//
+
+#include <sys/resource.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "Vec2f.h"
+#include "voronoi.h"
+#include "closest_point.h"
+#include "datasets.h"
+#include "stats.h"
+
+using namespace std;
+
+// Every heap allocation in the process, so each result can show how many its op made.
+// Not inlined, or GCC takes the free() below for a mismatch with new.
+static std::atomic<uint64_t> allocations(0);
+
+__attribute__((noinline)) void *operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if(void *p = malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept {
+    free(p);
+}
+
+namespace {
+struct Options {
+    Options()
+    : queries(100000),
+      seed(1),
+      dataset(kDatasetUniform),
+      raster(1024),
+      halfspace_max(10000) {
+        sizes.push_back(1000);
+        sizes.push_back(10000);
+        sizes.push_back(100000);
+    }
+
+    vector<size_t> sizes;
+    size_t queries;
+    uint32_t seed;
+    // Of the sites, queries are always uniform
+    DatasetKind dataset;
+    uint32_t raster;
+    // PointCloudHalfSpace2D is skipped above this many points
+    size_t halfspace_max;
+};
+
+bool ParseOptions(int argc, char **argv, Options &options) {
+    for(int i=1;i<argc;++i) {
+        const char *arg = argv[i];
+        if(!strncmp(arg, "--sizes=", 8)) {
+            options.sizes.clear();
+            for(const char *s = arg + 8;*s;) {
+                char *end;
+                options.sizes.push_back(strtoul(s, &end, 10));
+                if(end == s)
+                    return false;
+                s = (*end == ',') ? end + 1 : end;
+            }
+        } else if(!strncmp(arg, "--queries=", 10)) {
+            options.queries = strtoul(arg + 10, NULL, 10);
+        } else if(!strncmp(arg, "--seed=", 7)) {
+            options.seed = uint32_t(strtoul(arg + 7, NULL, 10));
+        } else if(!strncmp(arg, "--dataset=", 10)) {
+            if(!DatasetFromName(arg + 10, options.dataset))
+                return false;
+        } else if(!strncmp(arg, "--raster=", 9)) {
+            options.raster = uint32_t(strtoul(arg + 9, NULL, 10));
+        } else if(!strncmp(arg, "--halfspace-max=", 16)) {
+            options.halfspace_max = strtoul(arg + 16, NULL, 10);
+        } else {
+            return false;
+        }
+    }
+    return options.queries > 0;
+}
+
+// Peak resident set size of the process so far
+long PeakRssKb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#if defined __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+
+typedef std::chrono::steady_clock Clock;
+
+class Report {
+public:
+    Report() : first_(true), start_allocations_(0) { }
+
+    // Call right before the timed operations
+    Clock::time_point Start() {
+        start_allocations_ = allocations.load(std::memory_order_relaxed);
+        return Clock::now();
+    }
+
+    // ops operations took from start until now
+    void Add(char const*op, size_t n, size_t ops, Clock::time_point start) {
+        const double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+        const uint64_t allocs = allocations.load(std::memory_order_relaxed) - start_allocations_;
+        printf("%s\n    {\"op\": \"%s\", \"n\": %zu, \"ops\": %zu, \"ns_per_op\": %.1f, "
+               "\"ops_per_sec\": %.1f, \"allocs_per_op\": %.3f, \"peak_rss_kb\": %ld",
+               first_ ? "" : ",", op, n, ops, ns / double(ops),
+               double(ops) * 1e9 / std::max(ns, 1.0), double(allocs) / double(ops), PeakRssKb());
+#if VORONOI_STATS
+        // Counted since the previous result, which includes setting up this one
+        const StatsSnapshot stats = GetStats();
+        printf(", \"stats\": {");
+        const char *separator = "";
+        for(int i=0;i<kNumStatCounters;++i, separator = ", ")
+            printf("%s\"%s\": %llu", separator, StatCounterName(StatCounter(i)), (unsigned long long)stats.counters[i]);
+        for(int i=0;i<kNumStatMaxima;++i)
+            printf(", \"max_%s\": %llu", StatMaximumName(StatMaximum(i)), (unsigned long long)stats.maxima[i]);
+        printf("}, \"latency_ns\": {");
+        separator = "";
+        for(int i=0;i<kNumStatTimers;++i) {
+            const LatencyHistogram latency = GetLatency(StatTimer(i));
+            if(!latency.Count())
+                continue;
+            printf("%s\"%s\": {\"p50\": %llu, \"p99\": %llu, \"p999\": %llu}", separator, StatTimerName(StatTimer(i)),
+                   (unsigned long long)latency.Percentile(0.5), (unsigned long long)latency.Percentile(0.99),
+                   (unsigned long long)latency.Percentile(0.999));
+            separator = ", ";
+        }
+        printf("}");
+        ResetStats();
+#endif
+        printf("}");
+        fflush(stdout);
+        first_ = false;
+    }
+
+private:
+    bool first_;
+    uint64_t start_allocations_;
+};
+
+// Keeps results alive, so the timed calls are not optimized away
+volatile uint64_t sink;
+
+void Run(Options const&options, size_t n, Report &report) {
+    vector<Vec2f> pts, queries;
+    GenerateDataset(options.dataset, n, options.seed, pts);
+    GenerateDataset(kDatasetUniform, options.queries, options.seed + 1, queries);
+    Clock::time_point start;
+
+    {
+        // Reserved, so that only the work of each insert is counted
+        Voronoi<> voronoi;
+        voronoi.Reserve(n);
+        start = report.Start();
+        for(Vec2f const&pt : pts)
+            voronoi.Add(pt);
+        report.Add("Add", n, n, start);
+    }
+
+    Voronoi<> voronoi;
+    start = report.Start();
+    voronoi.AddRange(pts.begin(), pts.end());
+    report.Add("AddRange", n, n, start);
+
+    uint64_t sum = 0;
+    start = report.Start();
+    for(Vec2f const&q : queries)
+        sum += voronoi.Closest(q);
+    report.Add("Closest", n, queries.size(), start);
+
+    // O(n) each, so keep the total work bounded
+    const size_t brute_queries = std::max(size_t(1), std::min(queries.size(), size_t(100000000) / std::max(n, size_t(1))));
+    start = report.Start();
+    for(size_t i=0;i<brute_queries;++i)
+        sum += voronoi.BruteClosest(queries[i]);
+    report.Add("BruteClosest", n, brute_queries, start);
+
+    vector<Voronoi<>::Edge> edges;
+    start = report.Start();
+    for(size_t i=0;i<queries.size();++i) {
+        edges.clear();
+        voronoi.NeighboringEdges(Voronoi<>::SiteHandle(i % voronoi.NumSites()), edges);
+        sum += edges.size();
+    }
+    report.Add("NeighboringEdges", n, queries.size(), start);
+
+    const size_t affected_queries = std::min(queries.size(), size_t(10000));
+    start = report.Start();
+    for(size_t i=0;i<affected_queries;++i) {
+        edges.clear();
+        voronoi.EdgesAffectedByAdd(queries[i], edges);
+        sum += edges.size();
+    }
+    report.Add("EdgesAffectedByAdd", n, affected_queries, start);
+
+    {
+        Voronoi<>::AffectedEdges affected;
+        voronoi.EdgeView();
+        start = report.Start();
+        voronoi.EdgesAffectedByAddBatch(queries, affected);
+        report.Add("EdgesAffectedByAddBatch", n, queries.size(), start);
+        sum += affected.edges.size();
+    }
+
+    vector<Voronoi<>::SiteHandle> crossed;
+    const size_t line_queries = std::min(queries.size() / 2, size_t(10000));
+    start = report.Start();
+    for(size_t i=0;i<line_queries;++i) {
+        voronoi.CellsCrossingLine(queries[2 * i], queries[2 * i + 1] - queries[2 * i], crossed);
+        sum += crossed.size();
+    }
+    report.Add("CellsCrossingLine", n, std::max(line_queries, size_t(1)), start);
+    start = report.Start();
+    for(size_t i=0;i<line_queries;++i) {
+        voronoi.CellsCrossingSegment(queries[2 * i], queries[2 * i + 1], crossed);
+        sum += crossed.size();
+    }
+    report.Add("CellsCrossingSegment", n, std::max(line_queries, size_t(1)), start);
+
+    // Viewports of about 100 cells
+    const float view = std::sqrt(100.0f / float(n));
+    start = report.Start();
+    for(size_t i=0;i<line_queries;++i) {
+        voronoi.CellsInRegion(Extrema2f(queries[i], queries[i] + Vec2f(view, view)), crossed);
+        sum += crossed.size();
+    }
+    report.Add("CellsInRegion", n, std::max(line_queries, size_t(1)), start);
+
+    // The first pass fills the cache, the second reads it
+    const Extrema2f unit(Vec2f(0, 0), Vec2f(1, 1));
+    double area = 0;
+    for(int pass=0;pass<2;++pass) {
+        start = report.Start();
+        for(size_t s=0;s<voronoi.NumSites();++s)
+            area += voronoi.GetCellStats(Voronoi<>::SiteHandle(s), unit).area;
+        report.Add(pass ? "GetCellStats (cached)" : "GetCellStats", n, voronoi.NumSites(), start);
+    }
+    sum += uint64_t(area);
+
+    // Per site and iteration, on a copy so the queries above are not affected
+    {
+        static const unsigned kRelaxIterations = 5;
+        Voronoi<> relaxed = voronoi;
+        start = report.Start();
+        const unsigned iterations = relaxed.Relax(kRelaxIterations, unit);
+        report.Add("Relax", n, n * std::max(iterations, 1u), start);
+    }
+
+    // Every site a tenth of the spacing, which mostly keeps its neighbors, then jumps
+    // across the diagram, which take sites out and insert them again
+    {
+        Voronoi<> moved = voronoi;
+        const float step = 0.1f / std::sqrt(float(n));
+        start = report.Start();
+        for(size_t s=0;s<moved.NumSites();++s) {
+            const Voronoi<>::SiteHandle site = Voronoi<>::SiteHandle(s);
+            sum += moved.Move(site, moved.Position(site) + Vec2f(step, (s & 1) ? step : -step));
+        }
+        report.Add("Move (step)", n, std::max(moved.NumSites(), size_t(1)), start);
+        start = report.Start();
+        for(size_t i=0;i<line_queries;++i)
+            sum += moved.Move(Voronoi<>::SiteHandle(i % moved.NumSites()), queries[i]);
+        report.Add("Move (jump)", n, std::max(line_queries, size_t(1)), start);
+    }
+
+    // The same steps with the change feed on, each one read back before the next. A consumer
+    // diffing the diagram instead pays GetEdges (first) for every change.
+    {
+        Voronoi<> moved = voronoi;
+        Voronoi<>::ChangeRing ring(4096);
+        moved.SetChangeFeed(&ring);
+        const float step = 0.1f / std::sqrt(float(n));
+        Voronoi<>::Change change;
+        start = report.Start();
+        for(size_t s=0;s<moved.NumSites();++s) {
+            const Voronoi<>::SiteHandle site = Voronoi<>::SiteHandle(s);
+            moved.Move(site, moved.Position(site) + Vec2f(step, (s & 1) ? step : -step));
+            while(ring.TryPop(change))
+                sum += change.kind;
+        }
+        report.Add("Move (step) + feed", n, std::max(moved.NumSites(), size_t(1)), start);
+    }
+    
+    // Sliding window of n sites: each tick Advance() expires the batch added n sites before
+    // and a new batch comes in, so the size stays the same. An event is one add or one
+    // remove, and the target is 100k of them per second.
+    {
+        static const size_t kPerTick = 100;
+        const double window = double(std::max(n / kPerTick, size_t(1)));
+        vector<Vec2f> fresh;
+        GenerateDataset(kDatasetUniform, n, options.seed + 3, fresh);
+        Voronoi<> stream;
+        for(size_t i=0;i<n;++i)
+            stream.AddUntil(pts[i], double(i / kPerTick) + window);
+        size_t events = 0;
+        start = report.Start();
+        for(size_t i=0;i<n;i+=kPerTick) {
+            const double now = double(i / kPerTick) + window;
+            events += stream.Advance(now);
+            for(size_t j=i;j<std::min(n, i + kPerTick);++j, ++events)
+                stream.AddUntil(fresh[j], now + window);
+        }
+        report.Add("Advance + AddUntil", n, std::max(events, size_t(1)), start);
+        sum += stream.NumLiveSites();
+    }
+
+    // The first call after a change builds the edges, the rest copy them
+    static const size_t kGetEdgesReps = 10;
+    {
+        Voronoi<> fresh = voronoi;
+        fresh.Add(Vec2f(0.5f, 0.5f));
+        edges.clear();
+        start = report.Start();
+        fresh.GetEdges(edges);
+        report.Add("GetEdges (first)", n, 1, start);
+    }
+    start = report.Start();
+    for(size_t i=0;i<kGetEdgesReps;++i) {
+        edges.clear();
+        voronoi.GetEdges(edges);
+        sum += edges.size();
+    }
+    report.Add("GetEdges", n, kGetEdgesReps, start);
+
+    if(options.raster > 0) {
+        const Extrema2f bounds(Vec2f(0, 0), Vec2f(1, 1));
+        vector<uint32_t> ids(size_t(options.raster) * options.raster);
+        const size_t pixels = ids.size();
+        start = report.Start();
+        voronoi.RasterizeNearest(bounds, options.raster, options.raster, ids.data(), NULL);
+        report.Add("RasterizeNearest (pixels)", n, pixels, start);
+        start = report.Start();
+        voronoi.RasterizeCells(bounds, options.raster, options.raster, ids.data());
+        report.Add("RasterizeCells (pixels)", n, pixels, start);
+        start = report.Start();
+        voronoi.RasterizeQuadtree(bounds, options.raster, options.raster, ids.data());
+        report.Add("RasterizeQuadtree (pixels)", n, pixels, start);
+        sum += ids[pixels / 2];
+    }
+
+    // The constructor asserts on pairs of points above one another, so these follow a shallow curve
+    if(n <= options.halfspace_max) {
+        vector<Vec2f> jitter, above(n);
+        GenerateDataset(kDatasetUniform, n, options.seed + 2, jitter);
+        for(size_t i=0;i<n;++i) {
+            const float x = (float(i) + 0.5f) / float(n);
+            above[i] = Vec2f(x, 0.1f + 0.5f * x * x + (jitter[i].y - 0.5f) * 0.2f / float(n));
+        }
+        start = report.Start();
+        PointCloudHalfSpace2D half_space(Vec2f(0, 0), Vec2f(1, 0), above);
+        report.Add("PointCloudHalfSpace2D", n, 1, start);
+        vector<PointCloudHalfSpace2D::Arc> arcs;
+        half_space.GetArcs(arcs);
+        sum += arcs.size();
+    }
+
+    sink = sum;
+}
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    if(!ParseOptions(argc, argv, options)) {
+        fprintf(stderr, "usage: %s [--sizes=1000,10000,100000] [--queries=100000] [--seed=1] "
+                        "[--dataset=uniform] [--raster=1024] [--halfspace-max=10000]\n", argv[0]);
+        return 1;
+    }
+
+    printf("{\n  \"seed\": %u,\n  \"dataset\": \"%s\",\n  \"queries\": %zu,\n  \"raster\": %u,\n  \"results\": [",
+           options.seed, DatasetName(options.dataset), options.queries, options.raster);
+    Report report;
+    for(size_t n : options.sizes) {
+        if(n > 0)
+            Run(options, n, report);
+    }
+    printf("\n  ],\n  \"peak_rss_kb\": %ld\n}\n", PeakRssKb());
+    return 0;
+}
@@ -13,13 +13,10 @@
 #include <cstdlib>
 #include <cassert>
 #include <algorithm>
+#include <cstdint>
 
-#if defined __APPLE__
-
-typedef unsigned int		uint32;
-typedef unsigned long long	uint64;
-
-#endif
+typedef uint32_t		uint32;
+typedef uint64_t		uint64;
 
 #define PI						3.141592
 
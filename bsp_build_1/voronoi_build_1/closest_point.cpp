@@ -1,5 +1,6 @@
 
 #include "closest_point.h"
+#include "stats.h"
 #include <list>
 
 using namespace std;
@@ -36,50 +37,46 @@ int PointCloudHalfSpace2D::Arc::IsBetweenArcAndLine(Vec2f const&pt)const {
     return (dist_o < r) ? -1 : 1;
 }
 
-namespace {    
+namespace {
     inline bool line_intersection(Vec2f p1, Vec2f p2, Vec2f p3, Vec2f p4, Vec2f &out_pt) {
         // Store the values for fast access and easy
         // equations-to-code conversion
         float x1 = p1.x, x2 = p2.x, x3 = p3.x, x4 = p4.x;
         float y1 = p1.y, y2 = p2.y, y3 = p3.y, y4 = p4.y;
-        
+
         float d = (x1 - x2) * (y3 - y4) - (y1 - y2) * (x3 - x4);
         // If d is zero, there is no intersection
         if (::fabs(d) < 0.0001f) return false;
-        
+
         // Get the x and y
         float pre = (x1*y2 - y1*x2), post = (x3*y4 - y3*x4);
         float x = ( pre * (x3 - x4) - (x1 - x2) * post ) / d;
         float y = ( pre * (y3 - y4) - (y1 - y2) * post ) / d;
-        
+
         out_pt.x = x;
         out_pt.y = y;
         return true;
     }
-
-    Vec2f ClosestPointOnLine(Vec2f const&pt, Vec2f const&o, Vec2f const&d) {
-        const float t = (pt-o).Dot(d);
-        return o+d*t;
-    }
 }
 
 PointCloudHalfSpace2D::PointCloudHalfSpace2D(Vec2f const&div_o,
                                              Vec2f const&div_d,
                                              std::vector<Vec2f> const&points_unsorted)
   : div_o(div_o), div_d(div_d), sorter(div_o, div_d) {
+      STAT_TIMER(kStatTimeHalfSpace);
 
-      fprintf(stderr, "----\n");
+      TRACE_PRINTF("----\n");
       for(Vec2f const&pt : points_unsorted) {
-          fprintf(stderr, "\tpoints.push_back(Vec2f(%f,%f));\n", pt.x, pt.y);
+          TRACE_PRINTF("\tpoints.push_back(Vec2f(%f,%f));\n", pt.x, pt.y);
       }
-      fprintf(stderr, "\n");
-      
+      TRACE_PRINTF("\n");
+
     if(points_unsorted.size() >= 2) {
         std::vector<Vec2f> points_sorted_v(points_unsorted);
         std::sort(points_sorted_v.begin(), points_sorted_v.end(), sorter);
         std::list<Vec2f> points_sorted;
         std::copy(points_sorted_v.begin(), points_sorted_v.end(), std::back_inserter(points_sorted));
-        
+
         // First arc is a special case
         {
             mod_arc_start_pt_ = points_sorted.front();
@@ -87,7 +84,7 @@ PointCloudHalfSpace2D::PointCloudHalfSpace2D(Vec2f const&div_o,
             points_sorted.pop_front();
             points_sorted.pop_back();
         }
-        
+
         while(points_sorted.size() > 0) {
             Arc prev_arc = arcs_by_start_pt_[mod_arc_start_pt_];
             if (points_sorted.size() == 1) {
@@ -104,8 +101,6 @@ PointCloudHalfSpace2D::PointCloudHalfSpace2D(Vec2f const&div_o,
                 // Need to tie-break
                 Vec2f front_pt = points_sorted.front();
                 Vec2f back_pt = points_sorted.back();
-             //   const float front_d = (front_pt - ClosestPointOnLine(front_pt, div_o, div_d)).Length();
-               // const float back_d = (back_pt - ClosestPointOnLine(back_pt, div_o, div_d)).Length();
                 Arc front_arcs[2] = {
                     ArcForPoints(prev_arc.pt_a, front_pt),
                     ArcForPoints(front_pt, prev_arc.pt_b),
@@ -114,22 +109,22 @@ PointCloudHalfSpace2D::PointCloudHalfSpace2D(Vec2f const&div_o,
                     ArcForPoints(prev_arc.pt_a, back_pt),
                     ArcForPoints(back_pt, prev_arc.pt_b),
                 };
-                
+
                 // TODO: Handle vertically oriented points
                 // TODO: Handle points on same arc efficiently
-                
+
                 // TODO: Consider both arcs?
                 bool front_ruled_out = (prev_arc.IsBetweenArcAndLine(front_pt) > 0 ||
                                         back_arcs[0].IsBetweenArcAndLine(front_pt) > 0);
                 bool back_ruled_out = (prev_arc.IsBetweenArcAndLine(back_pt) > 0 ||
                                        front_arcs[1].IsBetweenArcAndLine(back_pt) > 0);
-                
+
                 if(front_ruled_out && back_ruled_out) {
                     points_sorted.pop_front();
                     points_sorted.pop_back();
                     continue;
                 }
-                
+
                 if(front_ruled_out) {
                     points_sorted.pop_front();
                     continue;
@@ -140,7 +135,7 @@ PointCloudHalfSpace2D::PointCloudHalfSpace2D(Vec2f const&div_o,
                     DeleteArcByStart(mod_arc_start_pt_);
                     // Need to tie-break
 //                    const bool front_first = front_d < back_d;
-                    
+
                     AddArc(front_arcs[0]);
                     AddArc(ArcForPoints(front_pt, back_pt));
                     mod_arc_start_pt_ = front_pt;
@@ -176,7 +171,7 @@ void PointCloudHalfSpace2D::DeleteArcByEnd(Vec2f const&end_pt) {
     Arc arc = arcs_by_end_pt_[end_pt];
     arcs_by_start_pt_.erase(arc.pt_a);
     arcs_by_end_pt_.erase(arc.pt_b);
-    
+
 }
 
 
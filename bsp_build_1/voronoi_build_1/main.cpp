@@ -11,11 +11,15 @@
 #include <stdio.h>
 #include <GLUT/glut.h>
 #include <cassert>
+#include <cmath>
 #include <cstdio>
+#include <chrono>
 #include <vector>
 
 #include "Vec2f.h"
 #include "voronoi.h"
+#include "stats.h"
+#include "datasets.h"
 
 #include "closest_point.h"
 
@@ -30,12 +34,12 @@ namespace {
 bool BruteIsBorder(Vec2f const&loc,
                    Vec2f const&div_o,
                    Vec2f const&div_d,
-                   Voronoi const&voronoi) {
-    Voronoi temp_v = voronoi;
-    temp_v.Add(loc);
-    vector<Voronoi::Edge> neighbor_edges;
-    temp_v.NeighboringEdges(loc, neighbor_edges);
-    for (Voronoi::Edge const&edge : neighbor_edges) {
+                   Voronoi<> const&voronoi) {
+    Voronoi<> temp_v = voronoi;
+    const Voronoi<>::SiteHandle loc_site = temp_v.Add(loc);
+    vector<Voronoi<>::Edge> neighbor_edges;
+    temp_v.NeighboringEdges(loc_site, neighbor_edges);
+    for (Voronoi<>::Edge const&edge : neighbor_edges) {
         if(edge.intersects_line(div_o, div_d))
             return true;
     }
@@ -47,9 +51,108 @@ bool OnPositiveSide(Vec2f const&loc,
                     Vec2f const&div_d) {
     return (loc - div_o).Dot(Vec2f(-div_d.y, div_d.x)) >= 0.0f;
 }
+
+// Sites which are on the border, either side of the line
+// A pixel at distance h from the line is border if some point q of the line is at least as
+// close to it as to every site, so it is border up to h = max over q of sqrt(d(q)^2 - |x - q|^2),
+// x being along the line and d(q) the distance to the closest site. Each column of pixels
+// across a horizontal line is border up to some row and not beyond, which QuadtreeRaster's
+// FillFromRow() fills exactly. Other lines are evaluated per pixel.
+// Only the pixels from (col_begin, row_begin) up to (col_end, row_end), the rest are kept
+void FillBorder(Voronoi<> const&pos_voronoi,
+                Voronoi<> const&neg_voronoi,
+                Extrema2f const&extents,
+                Vec2i const&resolution,
+                bool quadtree,
+                int col_begin, int row_begin,
+                int col_end, int row_end,
+                vector<uint8_t> &border) {
+    auto location = [&](uint32_t col, uint32_t row) {
+        const Vec2f loc_r(float(col) / float(resolution.width-1), float(row) / float(resolution.height-1));
+        return extents.mMin + loc_r * extents.GetSize();
+    };
+    auto eval = [&](uint32_t col, uint32_t row) -> uint8_t {
+        // Border point if it can be the closest point to anywhere on or beyond the line.
+        const Vec2f loc = location(col, row);
+        bool side = OnPositiveSide(loc, div_o, div_d);
+        Voronoi<> const&v = side ? pos_voronoi : neg_voronoi;
+        return BruteIsBorder(loc, div_o, div_d, v) ? 1 : 0;
+    };
+    if(quadtree && div_d.y == 0) {
+        // The first row on the other side from row 0
+        const bool first_side = OnPositiveSide(location(0, 0), div_o, div_d);
+        int split_row = 0;
+        while(split_row < resolution.height && OnPositiveSide(location(0, split_row), div_o, div_d) == first_side)
+            ++split_row;
+        QuadtreeRaster<uint8_t> raster(resolution.width, resolution.height, 1, border.data());
+        raster.FillFromRow(col_begin, row_begin, col_end, row_end, split_row, eval);
+    } else {
+        for(int row=row_begin;row<row_end;++row)
+            for(int col=col_begin;col<col_end;++col)
+                border[row * resolution.width + col] = eval(col, row);
+    }
+}
+
+void RasterizeBorder(Voronoi<> const&pos_voronoi,
+                     Voronoi<> const&neg_voronoi,
+                     Extrema2f const&extents,
+                     Vec2i const&resolution,
+                     bool quadtree,
+                     vector<uint8_t> &border) {
+    border.assign(resolution.width * resolution.height, 0);
+    FillBorder(pos_voronoi, neg_voronoi, extents, resolution, quadtree,
+               0, 0, resolution.width, resolution.height, border);
+}
+
+// Adds pt to the diagram of its side, and fills again the border pixels it can change.
+// Whether a pixel is border depends on the cell it would have, and the new site only cuts
+// into the cells of the pixels it would neighbor. Those are within the circles through the
+// site and the corners of its cell, or anywhere if the cell is unbounded.
+// Both fills are exact, so the result is the same as RasterizeBorder() of the whole diagram.
+void AddToBorder(Vec2f const&pt,
+                 Voronoi<> &pos_voronoi,
+                 Voronoi<> &neg_voronoi,
+                 Extrema2f const&extents,
+                 Vec2i const&resolution,
+                 bool quadtree,
+                 vector<uint8_t> &border) {
+    Voronoi<> &voronoi = OnPositiveSide(pt, div_o, div_d) ? pos_voronoi : neg_voronoi;
+    const Voronoi<>::SiteHandle site = voronoi.Add(pt);
+    vector<Voronoi<>::Edge> edges;
+    voronoi.NeighboringEdges(site, edges);
+    bool bounded = !edges.empty();
+    Extrema2f dirty(pt, pt);
+    for(Voronoi<>::Edge const&edge : edges) {
+        if(edge.extents.mMin[0] == -FLT_MAX || edge.extents.mMax[0] == FLT_MAX) {
+            bounded = false;
+            break;
+        }
+        const float ends[2] = { edge.extents.mMin[0], edge.extents.mMax[0] };
+        for(float t : ends) {
+            const Vec2f corner = edge.mid() + edge.dir() * t;
+            const float r = (corner - pt).Length();
+            dirty.DoEnclose(corner - Vec2f(r, r));
+            dirty.DoEnclose(corner + Vec2f(r, r));
+        }
+    }
+    if(!bounded) {
+        RasterizeBorder(pos_voronoi, neg_voronoi, extents, resolution, quadtree, border);
+        return;
+    }
+    // Pixel (col, row) is at col / (width - 1) of the way across, one pixel of slack for round off
+    const Vec2f scale(float(resolution.width - 1), float(resolution.height - 1));
+    const Vec2f lo = (dirty.mMin - extents.mMin) / extents.GetSize() * scale - Vec2f(1, 1);
+    const Vec2f hi = (dirty.mMax - extents.mMin) / extents.GetSize() * scale + Vec2f(1, 1);
+    FillBorder(pos_voronoi, neg_voronoi, extents, resolution, quadtree,
+               std::max(0, int(std::floor(lo.x))), std::max(0, int(std::floor(lo.y))),
+               std::min(resolution.width, int(std::ceil(hi.x)) + 1),
+               std::min(resolution.height, int(std::ceil(hi.y)) + 1), border);
+}
 }
 
 bool view_mode = false;
+// 'q' fills the border with QuadtreeRaster, which gives the same pixels with fewer evaluated
+bool quadtree_border = false;
 Vec2f selected_pt(0.4, 0.6);
 Vec2i resolution(200 * 0.5, 150 * 0.5);
 //Vec2i resolution(200  * 1.5, 150 * 1.5);
@@ -65,40 +168,23 @@ Vec2f int_test_a(0,0),
         int_test_b(0,0),
         int_test_c(0,0);
 
+// See CapturedDataset()
+size_t captured_dataset = 3;
+
+// Kept between frames. Init() starts them again, and points added after are put in one at a time.
+Voronoi<> pos_voronoi, neg_voronoi;
+vector<uint8_t> border;
+vector<PointCloudHalfSpace2D::Arc> arcs;
+bool scene_valid = false;
+// Points already in the diagrams
+size_t scene_points = 0;
+
 static void
 Init(void)
 {
+    scene_valid = false;
     points.clear();
-#if 0
-    points.push_back(Vec2f(-0.623333,0.023333));
-    points.push_back(Vec2f(0.213333,-0.296667));
-    points.push_back(Vec2f(0.790000,-0.490000));    // ruled out, removing removes problem. so it's an ordering issue
-    points.push_back(Vec2f(0.456667,0.043333));
-    points.push_back(Vec2f(0.303333, 0.170000));
-    points.push_back(Vec2f(1.056667,0.216667));
-#endif
-#if 0
-    points.push_back(Vec2f(-0.796667,-0.020000));
-    points.push_back(Vec2f(0.170000,-0.563333));
-    points.push_back(Vec2f(0.366667,0.256667));
-    points.push_back(Vec2f(0.653333,-0.490000));
-    points.push_back(Vec2f(-0.020000,-0.703333));
-    points.push_back(Vec2f(0.773333,0.483333));
-#endif
-#if 0
-    points.push_back(Vec2f(-0.906667,0.003333));
-    points.push_back(Vec2f(0.720000,-0.216667));
-    points.push_back(Vec2f(0.763333,0.113333));
-    points.push_back(Vec2f(0.153333,0.256667));
-    points.push_back(Vec2f(-0.426667,0.063333));
-#endif
-#if 1
-    points.push_back(Vec2f(-1.070000,0.400000));
-    points.push_back(Vec2f(-0.766667,0.143333));
-    points.push_back(Vec2f(-0.356667,-0.156667));
-    points.push_back(Vec2f(0.086667,-0.463333));    // Should be ruled out, but isn't
-    points.push_back(Vec2f(1.096667,0.203333));
-#endif
+    CapturedDataset(captured_dataset, points);
 }
 
 Extrema2f GetViewingExtents() {
@@ -107,12 +193,77 @@ Extrema2f GetViewingExtents() {
                      Vec2f( 1.0f * aspect,  1));
 }
 
+// Quadtree rasters against the per pixel loops, for the current points
+static void Benchmark() {
+    if(points.empty())
+        return;
+    typedef std::chrono::steady_clock Clock;
+    auto ms_since = [](Clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    };
+    const Extrema2f extents = GetViewingExtents();
+    
+    Voronoi<> voronoi, pos_voronoi, neg_voronoi;
+    for(Vec2f const&pt : points) {
+        voronoi.Add(pt);
+        if(OnPositiveSide(pt, div_o, div_d)) {
+            pos_voronoi.Add(pt);
+        } else {
+            neg_voronoi.Add(pt);
+        }
+    }
+    
+    // Nearest site, at a resolution where the difference shows
+    const Vec2i nearest_res(1600, 1200);
+    const Vec2f pixel = extents.GetSize() / Vec2f(float(nearest_res.width), float(nearest_res.height));
+    vector<uint32_t> brute_ids(nearest_res.width * nearest_res.height), quad_ids(brute_ids.size());
+    Clock::time_point start = Clock::now();
+    for(int row=0;row<nearest_res.height;++row) {
+        for(int col=0;col<nearest_res.width;++col) {
+            const Vec2f loc(extents.mMin.x + (col + 0.5f) * pixel.x,
+                            extents.mMin.y + (row + 0.5f) * pixel.y);
+            brute_ids[row * nearest_res.width + col] = voronoi.BruteClosest(loc);
+        }
+    }
+    const double brute_ms = ms_since(start);
+    start = Clock::now();
+    voronoi.RasterizeQuadtree(extents, nearest_res.width, nearest_res.height, quad_ids.data());
+    const double quad_ms = ms_since(start);
+    // Sites at the same distance may differ
+    size_t nearest_diffs = 0;
+    for(int row=0;row<nearest_res.height;++row) {
+        for(int col=0;col<nearest_res.width;++col) {
+            const Vec2f loc(extents.mMin.x + (col + 0.5f) * pixel.x,
+                            extents.mMin.y + (row + 0.5f) * pixel.y);
+            const size_t i = row * nearest_res.width + col;
+            if(brute_ids[i] != quad_ids[i] &&
+               (voronoi.Position(brute_ids[i]) - loc).Length() != (voronoi.Position(quad_ids[i]) - loc).Length())
+                ++nearest_diffs;
+        }
+    }
+    fprintf(stderr, "nearest %dx%d, %d sites: per pixel %.1f ms, quadtree %.1f ms, %d differ\n",
+            nearest_res.width, nearest_res.height, int(points.size()), brute_ms, quad_ms, int(nearest_diffs));
+    
+    vector<uint8_t> brute_border, quad_border;
+    start = Clock::now();
+    RasterizeBorder(pos_voronoi, neg_voronoi, extents, resolution, false, brute_border);
+    const double brute_border_ms = ms_since(start);
+    start = Clock::now();
+    RasterizeBorder(pos_voronoi, neg_voronoi, extents, resolution, true, quad_border);
+    const double quad_border_ms = ms_since(start);
+    size_t border_diffs = 0;
+    for(size_t i=0;i<brute_border.size();++i)
+        border_diffs += (brute_border[i] != quad_border[i]) ? 1 : 0;
+    fprintf(stderr, "border %dx%d: per pixel %.1f ms, quadtree %.1f ms, %d differ\n",
+            resolution.width, resolution.height, brute_border_ms, quad_border_ms, int(border_diffs));
+}
+
 static void Passive(int x, int y){
     const Extrema2f extents = GetViewingExtents();
     const Vec2f pt_here = extents.mMin +
         extents.GetSize() * (Vec2f(float(x), float(y)) / Vec2f(float(800), float(600)));
 
-    fprintf(stderr, "here %f %f\n", pt_here.x, pt_here.y);
+    TRACE_PRINTF("here %f %f\n", pt_here.x, pt_here.y);
 }
 
 /* ARGSUSED1 */
@@ -136,10 +287,25 @@ Key(unsigned char key, int x, int y)
             Init();
             glutPostRedisplay();
             break;
+        case 'd':
+            captured_dataset = (captured_dataset + 1) % NumCapturedDatasets();
+            fprintf(stderr, "captured dataset %d\n", int(captured_dataset));
+            Init();
+            glutPostRedisplay();
+            break;
         case 's':
             selected_pt = pt_here;
             glutPostRedisplay();
             break;
+        case 'b':
+            Benchmark();
+            break;
+        case 'q':
+            quadtree_border = !quadtree_border;
+            fprintf(stderr, "border %s\n", quadtree_border ? "quadtree" : "per pixel");
+            scene_valid = false;
+            glutPostRedisplay();
+            break;
         case 'a':
             points.push_back(pt_here);
             fprintf(stderr, "add %f %f\n", pt_here.x, pt_here.y);
@@ -170,7 +336,7 @@ void SetColorForPt(Vec2f const&pt, float b) {
               b);
 }
 
-void GetSaneEdgeVerts(Voronoi::Edge const&edge,
+void GetSaneEdgeVerts(Voronoi<>::Edge const&edge,
                       float const&max_dim,
                       Vec2f &min_pt,
                       Vec2f &max_pt) {
@@ -221,31 +387,35 @@ Draw(void)
     
     glMatrixMode(GL_MODELVIEW);
     
-    Voronoi pos_voronoi, neg_voronoi;
-    
-    for(Vec2f const&pt : points) {
-        if(OnPositiveSide(pt, div_o, div_d)) {
-            pos_voronoi.Add(pt);
-        } else {
-            neg_voronoi.Add(pt);
+    const bool points_changed = !scene_valid || scene_points != points.size();
+    if(!scene_valid) {
+        pos_voronoi = Voronoi<>();
+        neg_voronoi = Voronoi<>();
+        for(Vec2f const&pt : points) {
+            if(OnPositiveSide(pt, div_o, div_d)) {
+                pos_voronoi.Add(pt);
+            } else {
+                neg_voronoi.Add(pt);
+            }
         }
+        RasterizeBorder(pos_voronoi, neg_voronoi, extents_expanded, resolution, quadtree_border, border);
+        scene_valid = true;
+    } else {
+        for(size_t i=scene_points;i<points.size();++i)
+            AddToBorder(points[i], pos_voronoi, neg_voronoi, extents_expanded, resolution, quadtree_border, border);
     }
+    scene_points = points.size();
 
-    vector<Voronoi::Edge> pos_edges, neg_edges;
-    pos_voronoi.GetEdges(pos_edges);
-    neg_voronoi.GetEdges(neg_edges);
-
+    const Voronoi<>::View<Voronoi<>::Edge> pos_edges = pos_voronoi.EdgeView();
+    const Voronoi<>::View<Voronoi<>::Edge> neg_edges = neg_voronoi.EdgeView();
+    
     glPointSize(2);
     glBegin(GL_POINTS);
     for(int row=0;row<resolution.height;++row) {
         for(int col=0;col<resolution.width;++col) {
-            // Border point if it can be the closest point to anywhere on or beyond the line.
             const Vec2f loc_r(float(col) / float(resolution.width-1), float(row) / float(resolution.height-1));
             const Vec2f loc = extents_expanded.mMin + loc_r * extents_expanded.GetSize();
-            
-            bool side = OnPositiveSide(loc, div_o, div_d);
-            Voronoi const&v = side ? pos_voronoi : neg_voronoi;
-            bool is_border = BruteIsBorder(loc, div_o, div_d, v);
+            const bool is_border = border[row * resolution.width + col];
             
 //            glColor3f(0, is_border ? 0.5f : 0.75f, side ? 0.5f : 0.75f);
             glColor3f(is_border ? 0 : 1, 0,0);
@@ -306,7 +476,7 @@ Draw(void)
         const Vec2f midpt = (int_test_a + int_test_b) / 2.0f;
         const Vec2f dir = (int_test_b - int_test_a).Normalized();
         const Vec2f perp_dir = Vec2f(-dir.y, dir.x) * 0.1f;
-        const Voronoi::Edge test_edge(midpt - perp_dir,
+        const Voronoi<>::Edge test_edge(midpt - perp_dir,
                                       midpt + perp_dir,
                                       Extrema1f(Vec1f(-half_dist), Vec1f(half_dist)));
         const bool intersects = test_edge.intersects_line(div_o, div_d);
@@ -342,9 +512,11 @@ Draw(void)
     }
     
     {
-        PointCloudHalfSpace2D halfspace(div_o, div_d, points);
-        std::vector<PointCloudHalfSpace2D::Arc> arcs;
-        halfspace.GetArcs(arcs);
+        if(points_changed) {
+            PointCloudHalfSpace2D halfspace(div_o, div_d, points);
+            arcs.clear();
+            halfspace.GetArcs(arcs);
+        }
         for(PointCloudHalfSpace2D::Arc const&test_par : arcs)
         {
             glColor3f(0, 0, 1);
@@ -357,7 +529,7 @@ Draw(void)
         }
     }
     
-    fprintf(stderr, "--- drew\n");
+    TRACE_PRINTF("--- drew\n");
     
     glutSwapBuffers();
 }
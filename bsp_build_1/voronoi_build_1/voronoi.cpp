@@ -1,203 +1,1099 @@
-
 #include "voronoi.h"
 #include <cassert>
 #include <cfloat>
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <thread>
 
 using namespace std;
 
-Voronoi::Edge::Edge(Vec2f const&a, Vec2f const&b)
- : pt_a(a), pt_b(b) {
-    
+// With VORONOI_STATS, counts scratch_growths and scratch_bytes for the call it is in
+#if VORONOI_STATS
+#define STAT_SCRATCH() ScratchGrowth stat_scratch_(*this)
+#else
+#define STAT_SCRATCH() do { } while(0)
+#endif
+
+namespace {
+    // Exact arithmetic for the predicates, after Shewchuk's "Adaptive Precision Floating-Point
+    // Arithmetic and Fast Robust Geometric Predicates". An expansion is a sum of doubles which
+    // do not overlap, smallest first, so its sign is the sign of its last term.
+
+    // x + y is exactly a + b
+    inline void TwoSum(double a, double b, double &x, double &y) {
+        x = a + b;
+        const double b_virtual = x - a;
+        const double a_virtual = x - b_virtual;
+        y = (a - a_virtual) + (b - b_virtual);
+    }
+
+    inline void TwoDiff(double a, double b, double &x, double &y) {
+        x = a - b;
+        const double b_virtual = a - x;
+        const double a_virtual = x + b_virtual;
+        y = (a - a_virtual) + (b_virtual - b);
+    }
+
+    // fma() rounds once, so the error of the product is exact. Contraction of a*b - x into
+    // an fma by the compiler would give the same.
+    inline void TwoProduct(double a, double b, double &x, double &y) {
+        x = a * b;
+        y = std::fma(a, b, -x);
+    }
+
+    // h = e + f, zeros dropped. h has room for elen + flen.
+    int ExpansionSum(int elen, double const*e, int flen, double const*f, double *h) {
+        int ei = 0, fi = 0, hi = 0;
+        // Both merged by magnitude, each term carried into a running sum
+        auto next = [&]() {
+            if(fi == flen || (ei < elen && std::fabs(e[ei]) < std::fabs(f[fi])))
+                return e[ei++];
+            return f[fi++];
+        };
+        double q = next(), x, y;
+        while(ei < elen || fi < flen) {
+            TwoSum(q, next(), x, y);
+            if(y != 0)
+                h[hi++] = y;
+            q = x;
+        }
+        if(q != 0 || hi == 0)
+            h[hi++] = q;
+        return hi;
+    }
+
+    // h = e * b, zeros dropped. h has room for 2 * elen.
+    int ScaleExpansion(int elen, double const*e, double b, double *h) {
+        int hi = 0;
+        double q, y;
+        TwoProduct(e[0], b, q, y);
+        if(y != 0)
+            h[hi++] = y;
+        for(int ei=1;ei<elen;++ei) {
+            double product, product_low, sum;
+            TwoProduct(e[ei], b, product, product_low);
+            TwoSum(q, product_low, sum, y);
+            if(y != 0)
+                h[hi++] = y;
+            TwoSum(product, sum, q, y);
+            if(y != 0)
+                h[hi++] = y;
+        }
+        if(q != 0 || hi == 0)
+            h[hi++] = q;
+        return hi;
+    }
+
+    // h = e * f. h has room for 2 * elen * flen, scratch for 2 * elen * (flen + 1).
+    int ExpansionProduct(int elen, double const*e, int flen, double const*f, double *h, double *scratch) {
+        double *const term = scratch, *const sum = scratch + 2 * elen;
+        int hlen = ScaleExpansion(elen, e, f[0], h);
+        for(int fi=1;fi<flen;++fi) {
+            const int term_len = ScaleExpansion(elen, e, f[fi], term);
+            const int sum_len = ExpansionSum(hlen, h, term_len, term, sum);
+            std::copy(sum, sum + sum_len, h);
+            hlen = sum_len;
+        }
+        return hlen;
+    }
+
+    int ExpansionNegate(int elen, double *e) {
+        for(int i=0;i<elen;++i)
+            e[i] = -e[i];
+        return elen;
+    }
+
+    // (a.x - c.x) * (b.y - c.y) - (a.y - c.y) * (b.x - c.x), exactly. Kept out of line, like
+    // InCircleExact(), so the rare call does not cost the common one its stack frame.
+    __attribute__((noinline)) double OrientExact(Vec2f const&a, Vec2f const&b, Vec2f const&c) {
+        double acx[2], acy[2], bcx[2], bcy[2];
+        TwoDiff(a.x, c.x, acx[1], acx[0]);
+        TwoDiff(a.y, c.y, acy[1], acy[0]);
+        TwoDiff(b.x, c.x, bcx[1], bcx[0]);
+        TwoDiff(b.y, c.y, bcy[1], bcy[0]);
+        double left[8], right[8], det[16], scratch[16];
+        const int left_len = ExpansionProduct(2, acx, 2, bcy, left, scratch);
+        const int right_len = ExpansionNegate(ExpansionProduct(2, acy, 2, bcx, right, scratch), right);
+        const int det_len = ExpansionSum(left_len, left, right_len, right, det);
+        return det[det_len - 1];
+    }
+
+    // The lift of a times the cross product of b and c, all relative to d, exactly. h has room
+    // for 512.
+    int InCircleTerm(double const (&ad)[2][2], double const (&bd)[2][2], double const (&cd)[2][2],
+                     double *h) {
+        double scratch[1024], xx[8], yy[8], lift[16], bc[8], cb[8], cross[16];
+        const int xx_len = ExpansionProduct(2, ad[0], 2, ad[0], xx, scratch);
+        const int yy_len = ExpansionProduct(2, ad[1], 2, ad[1], yy, scratch);
+        const int lift_len = ExpansionSum(xx_len, xx, yy_len, yy, lift);
+        const int bc_len = ExpansionProduct(2, bd[0], 2, cd[1], bc, scratch);
+        const int cb_len = ExpansionNegate(ExpansionProduct(2, cd[0], 2, bd[1], cb, scratch), cb);
+        const int cross_len = ExpansionSum(bc_len, bc, cb_len, cb, cross);
+        return ExpansionProduct(lift_len, lift, cross_len, cross, h, scratch);
+    }
+
+    __attribute__((noinline)) double InCircleExact(Vec2f const&a, Vec2f const&b, Vec2f const&c, Vec2f const&d) {
+        double ad[2][2], bd[2][2], cd[2][2];
+        TwoDiff(a.x, d.x, ad[0][1], ad[0][0]);
+        TwoDiff(a.y, d.y, ad[1][1], ad[1][0]);
+        TwoDiff(b.x, d.x, bd[0][1], bd[0][0]);
+        TwoDiff(b.y, d.y, bd[1][1], bd[1][0]);
+        TwoDiff(c.x, d.x, cd[0][1], cd[0][0]);
+        TwoDiff(c.y, d.y, cd[1][1], cd[1][0]);
+        double a_term[512], b_term[512], c_term[512], ab[1024], det[1536];
+        const int a_len = InCircleTerm(ad, bd, cd, a_term);
+        const int b_len = InCircleTerm(bd, cd, ad, b_term);
+        const int c_len = InCircleTerm(cd, ad, bd, c_term);
+        const int ab_len = ExpansionSum(a_len, a_term, b_len, b_term, ab);
+        const int det_len = ExpansionSum(ab_len, ab, c_len, c_term, det);
+        return det[det_len - 1];
+    }
+
+    // Relative error bounds of the plain double evaluations, from the paper
+    const double kEpsilon = 1.0 / 9007199254740992.0;
+    const double kOrientBound = (3.0 + 16.0 * kEpsilon) * kEpsilon;
+    const double kInCircleBound = (10.0 + 96.0 * kEpsilon) * kEpsilon;
+
+    // > 0 if a, b, c turn counter clockwise, 0 only if they are collinear. Only the sign is exact.
+    inline double Orient(Vec2f const&a, Vec2f const&b, Vec2f const&c) {
+        STAT_COUNT(kStatPredicates, 1);
+        const double left = (double(a.x) - c.x) * (double(b.y) - c.y);
+        const double right = (double(a.y) - c.y) * (double(b.x) - c.x);
+        const double det = left - right;
+        if(std::fabs(det) > kOrientBound * (std::fabs(left) + std::fabs(right)))
+            return det;
+        return OrientExact(a, b, c);
+    }
+
+    inline double SquaredDistance(Vec2f const&a, Vec2f const&b) {
+        const double dx = double(a.x) - b.x, dy = double(a.y) - b.y;
+        return dx * dx + dy * dy;
+    }
+
+    // Sutherland-Hodgman, the part of poly where nx * x + ny * y <= c
+    void ClipToHalfPlane(std::vector<std::pair<double, double> > const&poly,
+                         double nx, double ny, double c,
+                         std::vector<std::pair<double, double> > &clipped) {
+        clipped.clear();
+        for(size_t i=0;i<poly.size();++i) {
+            std::pair<double, double> const&a = poly[i];
+            std::pair<double, double> const&b = poly[(i + 1) % poly.size()];
+            const double da = nx * a.first + ny * a.second - c;
+            const double db = nx * b.first + ny * b.second - c;
+            if(da <= 0)
+                clipped.push_back(a);
+            if((da < 0 && db > 0) || (da > 0 && db < 0)) {
+                const double f = da / (da - db);
+                clipped.push_back(std::make_pair(a.first + (b.first - a.first) * f,
+                                                 a.second + (b.second - a.second) * f));
+            }
+        }
+    }
+
+    // > 0 if d is inside the circumcircle of counter clockwise a, b, c, 0 only if it is on it.
+    // Only the sign is exact.
+    inline double InCircle(Vec2f const&a, Vec2f const&b, Vec2f const&c, Vec2f const&d) {
+        STAT_COUNT(kStatPredicates, 1);
+        const double adx = double(a.x) - d.x, ady = double(a.y) - d.y;
+        const double bdx = double(b.x) - d.x, bdy = double(b.y) - d.y;
+        const double cdx = double(c.x) - d.x, cdy = double(c.y) - d.y;
+        const double bdxcdy = bdx * cdy, cdxbdy = cdx * bdy;
+        const double cdxady = cdx * ady, adxcdy = adx * cdy;
+        const double adxbdy = adx * bdy, bdxady = bdx * ady;
+        const double alift = adx * adx + ady * ady;
+        const double blift = bdx * bdx + bdy * bdy;
+        const double clift = cdx * cdx + cdy * cdy;
+        const double det = alift * (bdxcdy - cdxbdy) + blift * (cdxady - adxcdy) + clift * (adxbdy - bdxady);
+        const double permanent = (std::fabs(bdxcdy) + std::fabs(cdxbdy)) * alift +
+                                 (std::fabs(cdxady) + std::fabs(adxcdy)) * blift +
+                                 (std::fabs(adxbdy) + std::fabs(bdxady)) * clift;
+        if(std::fabs(det) > kInCircleBound * permanent)
+            return det;
+        return InCircleExact(a, b, c, d);
+    }
+
+    inline Vec2f Circumcenter(Vec2f const&a, Vec2f const&b, Vec2f const&c) {
+        const double bx = double(b.x) - a.x, by = double(b.y) - a.y;
+        const double cx = double(c.x) - a.x, cy = double(c.y) - a.y;
+        const double d = 2.0 * (bx * cy - by * cx);
+        const double b2 = bx * bx + by * by;
+        const double c2 = cx * cx + cy * cy;
+        return Vec2f(float(a.x + (cy * b2 - by * c2) / d),
+                     float(a.y + (bx * c2 - cx * b2) / d));
+    }
+
+    // Position along a 2^16 x 2^16 Hilbert curve
+    uint32_t HilbertIndex(uint32_t x, uint32_t y) {
+        static const uint32_t n = 1 << 16;
+        uint32_t d = 0;
+        for(uint32_t s = n / 2; s > 0; s /= 2) {
+            const uint32_t rx = (x & s) ? 1 : 0;
+            const uint32_t ry = (y & s) ? 1 : 0;
+            d += s * s * ((3 * rx) ^ ry);
+            if(ry == 0) {
+                if(rx == 1) {
+                    x = n - 1 - x;
+                    y = n - 1 - y;
+                }
+                std::swap(x, y);
+            }
+        }
+        return d;
+    }
+
+    // Sorts indices into pts
+    void HilbertSort(std::vector<uint32_t>::iterator begin,
+                     std::vector<uint32_t>::iterator end,
+                     std::vector<Vec2f> const&pts,
+                     Extrema2f const&bounds) {
+        const Vec2f size = bounds.GetSize();
+        const float scale = 65535.0f / std::max(std::max(size.x, size.y), FLT_MIN);
+        std::vector<std::pair<uint32_t, uint32_t> > keyed;
+        keyed.reserve(end - begin);
+        for(auto it = begin; it != end; ++it) {
+            const Vec2f grid = (pts[*it] - bounds.mMin) * scale;
+            keyed.push_back(std::make_pair(HilbertIndex(uint32_t(grid.x), uint32_t(grid.y)), *it));
+        }
+        std::sort(keyed.begin(), keyed.end());
+        for(auto const&k : keyed)
+            *(begin++) = k.second;
+    }
+
+    // Lower envelope of the parabolas (t - q[i])^2 + h[i], for q sorted ascending
+    // (Felzenszwalb & Huttenlocher)
+    class ParabolaEnvelope {
+    public:
+        void Build(std::vector<double> const&q, std::vector<double> const&h) {
+            v_.clear();
+            z_.clear();
+            for(uint32_t i=0;i<q.size();++i) {
+                double s = -DBL_MAX;
+                bool hidden = false;
+                while(!v_.empty()) {
+                    const uint32_t j = v_.back();
+                    if(q[i] == q[j]) {
+                        hidden = (h[i] >= h[j]);
+                        if(hidden)
+                            break;
+                    } else {
+                        s = ((h[i] + q[i] * q[i]) - (h[j] + q[j] * q[j])) / (2.0 * (q[i] - q[j]));
+                        if(s > z_.back())
+                            break;
+                    }
+                    v_.pop_back();
+                    z_.pop_back();
+                }
+                if(hidden)
+                    continue;
+                if(v_.empty())
+                    s = -DBL_MAX;
+                v_.push_back(i);
+                z_.push_back(s);
+            }
+            k_ = 0;
+        }
+        // Index of the lowest parabola at t, which must not decrease between calls
+        inline uint32_t Lowest(double t) {
+            while(k_ + 1 < v_.size() && z_[k_ + 1] < t)
+                ++k_;
+            return v_[k_];
+        }
+        inline bool Empty()const {
+            return v_.empty();
+        }
+    private:
+        // Parabola, and where its interval starts
+        std::vector<uint32_t> v_;
+        std::vector<double> z_;
+        size_t k_;
+    };
+
+    // Threads which are kept between calls, one per hardware thread with the caller as the first.
+    // Calls from several threads take turns, each has all of the threads while it runs.
+    class ThreadPool {
+    public:
+        ThreadPool() :
+            num_threads_(std::max(1u, std::thread::hardware_concurrency())),
+            job_(NULL), n_(0), round_(0), pending_(0), stop_(false) {
+            for(uint32_t i=1;i<num_threads_;++i)
+                threads_.push_back(std::thread(&ThreadPool::Work, this, i));
+        }
+        ~ThreadPool() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            wake_.notify_all();
+            for(std::thread &thread : threads_)
+                thread.join();
+        }
+        // Calls f(begin, end) over [0, n) split into one block per thread
+        template<typename F>
+        void ParallelFor(uint32_t n, F f) {
+            const std::function<void(uint32_t, uint32_t)> job(f);
+            std::lock_guard<std::mutex> turn(turn_mutex_);
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                job_ = &job;
+                n_ = n;
+                pending_ = num_threads_ - 1;
+                ++round_;
+            }
+            wake_.notify_all();
+            RunBlock(0);
+            std::unique_lock<std::mutex> lock(mutex_);
+            done_.wait(lock, [this] { return pending_ == 0; });
+            job_ = NULL;
+        }
+    private:
+        void RunBlock(uint32_t i) {
+            const uint32_t begin = uint32_t(uint64_t(n_) * i / num_threads_);
+            const uint32_t end = uint32_t(uint64_t(n_) * (i + 1) / num_threads_);
+            if(begin < end)
+                (*job_)(begin, end);
+        }
+        void Work(uint32_t i) {
+            uint64_t seen = 0;
+            for(;;) {
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    wake_.wait(lock, [&] { return stop_ || round_ != seen; });
+                    if(stop_)
+                        return;
+                    seen = round_;
+                }
+                RunBlock(i);
+                std::lock_guard<std::mutex> lock(mutex_);
+                if(--pending_ == 0)
+                    done_.notify_one();
+            }
+        }
+        const uint32_t num_threads_;
+        std::vector<std::thread> threads_;
+        std::mutex turn_mutex_, mutex_;
+        std::condition_variable wake_, done_;
+        std::function<void(uint32_t, uint32_t)> const*job_;
+        uint32_t n_;
+        uint64_t round_;
+        uint32_t pending_;
+        bool stop_;
+    };
+
+    // Shared by every diagram, so that a loop calling it each step does not start new threads.
+    // f must not call ParallelFor() itself.
+    template<typename F>
+    void ParallelFor(uint32_t n, F f) {
+        static ThreadPool pool;
+        pool.ParallelFor(n, f);
+    }
+
+    template<typename T>
+    inline size_t CapacityBytes(std::vector<T> const&v) {
+        return v.capacity() * sizeof(T);
+    }
+}
+
+const VoronoiBase::SiteHandle VoronoiBase::kNoSite;
+const uint32_t VoronoiBase::kInfinite;
+const uint32_t VoronoiBase::kDead;
+const uint32_t VoronoiBase::kNoTriangle;
+const uint32_t VoronoiBase::kNoEdge;
+const uint32_t VoronoiBase::Triangulation::kNoNeighbor;
+
+VoronoiBase::Edge::Edge(Vec2f const&a, Vec2f const&b)
+ : site_a(kNoSite), site_b(kNoSite), pt_a(a), pt_b(b) {
+
+}
+
+VoronoiBase::Edge::Edge(Vec2f const&a, Vec2f const&b, Extrema1f const&extents)
+ : site_a(kNoSite), site_b(kNoSite), pt_a(a), pt_b(b), extents(extents) {
+
 }
 
-Voronoi::Edge::Edge(Vec2f const&a, Vec2f const&b, Extrema1f const&extents)
- : pt_a(a), pt_b(b), extents(extents) {
-    
+VoronoiBase::Edge::Edge(SiteHandle site_a, Vec2f const&a,
+                    SiteHandle site_b, Vec2f const&b,
+                    Extrema1f const&extents)
+ : site_a(site_a), site_b(site_b), pt_a(a), pt_b(b), extents(extents) {
+
 }
 
-Voronoi::Voronoi()
-  : extents_(Vec2f(FLT_MAX, FLT_MAX), Vec2f(-FLT_MAX, -FLT_MAX))
+VoronoiBase::VoronoiBase()
+  : last_site_(0),
+    extents_(Vec2f(FLT_MAX, FLT_MAX), Vec2f(-FLT_MAX, -FLT_MAX)),
+    generation_(0),
+    hint_side_(0),
+    hint_outside_(0),
+    edge_cache_generation_(0),
+    stamp_(0),
+    feed_(NULL),
+    feed_dropped_(false),
+    feed_stamp_(1),
+    cell_stats_box_(Vec2f(FLT_MAX, FLT_MAX), Vec2f(-FLT_MAX, -FLT_MAX))
 {
-    
+
+}
+
+VoronoiBase::ScratchGrowth::ScratchGrowth(VoronoiBase const&owner) : owner_(owner), start_(Bytes()) {
 }
 
-void Voronoi::Add(Vec2f const&pt) {
-    if (points_.find(pt) != points_.end())
+VoronoiBase::ScratchGrowth::~ScratchGrowth() {
+    const size_t end = Bytes();
+    if(end > start_) {
+        STAT_COUNT(kStatScratchGrowths, 1);
+        STAT_COUNT(kStatScratchBytes, end - start_);
+    }
+}
+
+size_t VoronoiBase::ScratchGrowth::Bytes()const {
+    VoronoiBase const&o = owner_;
+    return CapacityBytes(o.tri_stamps_) + CapacityBytes(o.cavity_) + CapacityBytes(o.boundary_) +
+           CapacityBytes(o.link_) + CapacityBytes(o.flip_stack_) + CapacityBytes(o.star_) +
+           CapacityBytes(o.hole_) + CapacityBytes(o.affected_.stamps) + CapacityBytes(o.affected_.stack) +
+           CapacityBytes(o.affected_found_) + CapacityBytes(o.region_.stamps) +
+           CapacityBytes(o.region_.stack) + CapacityBytes(o.clip_poly_) + CapacityBytes(o.clip_scratch_) +
+           CapacityBytes(o.region_box_);
+}
+
+void VoronoiBase::Reserve(size_t num_sites) {
+    sites_.reserve(num_sites);
+    site_tris_.reserve(num_sites);
+    // 2n - 2 - hull triangles, plus the infinite ones, which is 2n - 2 in all
+    tris_.reserve(2 * num_sites);
+    tri_stamps_.reserve(2 * num_sites);
+    link_.reserve(num_sites + 1);
+    affected_.stamps.reserve(2 * num_sites);
+}
+
+VoronoiBase::SiteHandle VoronoiBase::Add(Vec2f const&pt) {
+    bool added;
+    return Add(pt, added);
+}
+
+VoronoiBase::SiteHandle VoronoiBase::Add(Vec2f const&pt, bool &added) {
+    STAT_TIMER(kStatTimeAdd);
+    STAT_SCRATCH();
+    // Unrelated points one after another would each walk across the diagram from the last
+    if(Triangulated())
+        last_site_ = WalkStart(pt, last_site_);
+    const SiteHandle site = AddInternal(pt, added);
+    if(added)
+        UpdateExtents();
+    return site;
+}
+
+void VoronoiBase::AddBatch(std::vector<Vec2f> const&pts, std::vector<SiteHandle> &handles,
+                           std::vector<uint8_t> *added) {
+    STAT_TIMER(kStatTimeAddBatch);
+    STAT_SCRATCH();
+    handles.resize(pts.size());
+    if(added)
+        added->assign(pts.size(), 0);
+    if(pts.empty())
         return;
-    
-    // TODO: This is O(N^3)
-    
-    extents_ = Extrema2f(Vec2f(FLT_MAX, FLT_MAX), Vec2f(-FLT_MAX, -FLT_MAX));
-    
-    points_.insert(pt);
-    
-    for(auto const&pt : points_)
-        extents_.DoEnclose(pt);
-    
-    edges_.clear();
-    for(auto const&pt_a : points_) {
-        for(auto const&pt_b : points_) {
-            // Don't check neighbors twice
-            if (&pt_a >= &pt_b)
-                continue;
-            
-            Vec2f mid_pt = (pt_a + pt_b) / 2.0f;
-            Vec2f closest_to_mid = BruteClosest(mid_pt);
-            if(closest_to_mid == pt_a || closest_to_mid == pt_b) {
-                neighbors_.insert(Neighbors::value_type(pt_a, pt_b));
-            }
-            
-            edges_.insert(Edges::value_type(MakeNeighborId(pt_a, pt_b),
-                                            MakeEdgeExtents(-FLT_MAX, FLT_MAX)));
-        }
-    }
-    
-    // Discover extents
-    std::vector<NeighborId> dead_edges;
-    for(auto &edge_find : edges_) {
-        Extrema1f &extents_to_find = edge_find.second;
-        NeighborId const&neighbors_find = edge_find.first;
-        // TODO: This is kind of dumb
-        const Edge temp_edge_to_find(std::get<0>(neighbors_find), std::get<1>(neighbors_find));
-        
-        int n_intersect = 0;
-        
-        for(auto const&edge_b : edges_) {
-            // Don't check against self
-            if (edge_find.first == edge_b.first)
+
+    Extrema2f bounds(pts.front(), pts.front());
+    for(Vec2f const&pt : pts)
+        bounds.DoEnclose(pt);
+
+    // Biased randomized insertion order: each round is twice the size of the one before it.
+    // Randomizing between rounds keeps the expected structural change per insert constant,
+    // sorting within a round keeps the walks short.
+    std::vector<uint32_t> order(pts.size());
+    for(uint32_t i=0;i<order.size();++i)
+        order[i] = i;
+    std::minstd_rand rng(uint32_t(pts.size()));
+    std::shuffle(order.begin(), order.end(), rng);
+    static const size_t kMinRound = 64;
+    size_t round_end = order.size();
+    while(round_end > kMinRound) {
+        const size_t round_begin = round_end / 2;
+        HilbertSort(order.begin() + round_begin, order.begin() + round_end, pts, bounds);
+        round_end = round_begin;
+    }
+    HilbertSort(order.begin(), order.begin() + round_end, pts, bounds);
+
+    bool was_added;
+    for(uint32_t i : order) {
+        STAT_TIMER(kStatTimeAdd);
+        handles[i] = AddInternal(pts[i], was_added);
+        if(added)
+            (*added)[i] = was_added;
+    }
+    UpdateExtents();
+}
+
+VoronoiBase::SiteHandle VoronoiBase::AddInternal(Vec2f const&pt, bool &added) {
+    added = false;
+    if(Triangulated()) {
+        // A duplicate is always a vertex of the triangle the walk ends in
+        const uint32_t t = Locate(pt, last_site_);
+        for(unsigned i=0;i<3;++i) {
+            const uint32_t v = tris_[t].v[i];
+            if(v == kInfinite)
                 continue;
-            
-            // TODO: This is kind of dumb
-            NeighborId const&neighbors_b = edge_b.first;
-            const Edge temp_edge_b(std::get<0>(neighbors_b), std::get<1>(neighbors_b));
-            
-            float t_a;
-            if(EdgesIntersect(temp_edge_to_find,
-                              temp_edge_b,
-                              t_a)) {
-                // !! TODO: In multi-line intersections, this is not reliable
-                // Try epsilon back/forth
-                if(BruteIsBetweenNeighbors(temp_edge_to_find.mid() + temp_edge_to_find.dir() * (t_a + 0.0001f),
-                                           neighbors_b) ||
-                   BruteIsBetweenNeighbors(temp_edge_to_find.mid() + temp_edge_to_find.dir() * (t_a - 0.0001f),
-                                           neighbors_b))
-                {
-                    static const float find_epsilon = 0.001f;
-                    Vec2f min_pt = temp_edge_to_find.mid() + temp_edge_to_find.dir() * (t_a + find_epsilon);
-                    // Must check slightly up for min, slightly down for max
-                    if (BruteIsBetweenNeighbors(min_pt,
-                                                neighbors_find)) {
-                        extents_to_find.mMin[0] = std::max(extents_to_find.mMin[0], t_a);
-                        extents_.DoEnclose(min_pt);
-                        ++n_intersect;
-                    }
-                    Vec2f max_pt = temp_edge_to_find.mid() + temp_edge_to_find.dir() * (t_a - find_epsilon);
-                    if (BruteIsBetweenNeighbors(max_pt,
-                                                neighbors_find)) {
-                        extents_to_find.mMax[0] = std::min(extents_to_find.mMax[0], t_a);
-                        extents_.DoEnclose(max_pt);
-                        ++n_intersect;
-                    }
+            if(sites_[v] == pt)
+                return v;
+            // So the insert's own walk is only a step
+            last_site_ = v;
+        }
+    } else {
+        for(SiteHandle site : collinear_) {
+            if(sites_[site] == pt)
+                return site;
+        }
+    }
+
+    SiteHandle site;
+    if(!free_sites_.empty()) {
+        site = free_sites_.back();
+        free_sites_.pop_back();
+        sites_[site] = pt;
+        removed_[site] = 0;
+        if(site < expiries_.size())
+            expiries_[site] = -HUGE_VAL;
+        InvalidateCell(site);
+    } else {
+        site = SiteHandle(sites_.size());
+        sites_.push_back(pt);
+        removed_.push_back(0);
+        site_tris_.push_back(kNoTriangle);
+    }
+    PushExtents(site | kSiteKey, pt);
+
+    if(Triangulated())
+        InsertTriangulated(site);
+    else
+        InsertCollinear(site);
+    last_site_ = site;
+    NoteHint(site);
+    ++generation_;
+    FeedEnd();
+    added = true;
+    return site;
+}
+
+void VoronoiBase::InsertCollinear(SiteHandle site) {
+    Vec2f const&pt = sites_[site];
+    if(collinear_.size() < 2) {
+        for(SiteHandle other : collinear_) {
+            InvalidateCell(other);
+            FeedChainEdge(other, site, true);
+        }
+        collinear_.push_back(site);
+        return;
+    }
+
+    Vec2f const&first = sites_[collinear_.front()];
+    Vec2f const&last = sites_[collinear_.back()];
+    if(Orient(first, last, pt) != 0) {
+        Triangulate(site);
+        return;
+    }
+
+    // Keep the chain sorted along the line
+    const double dx = double(last.x) - first.x, dy = double(last.y) - first.y;
+    const double t = (double(pt.x) - first.x) * dx + (double(pt.y) - first.y) * dy;
+    auto it = collinear_.begin();
+    for(;it != collinear_.end();++it) {
+        Vec2f const&other = sites_[*it];
+        if((double(other.x) - first.x) * dx + (double(other.y) - first.y) * dy > t)
+            break;
+    }
+    // Only the strips on either side change
+    if(it != collinear_.begin() && it != collinear_.end())
+        FeedChainEdge(*(it-1), *it, false);
+    if(it != collinear_.begin()) {
+        InvalidateCell(*(it-1));
+        FeedChainEdge(*(it-1), site, true);
+    }
+    if(it != collinear_.end()) {
+        InvalidateCell(*it);
+        FeedChainEdge(site, *it, true);
+    }
+    collinear_.insert(it, site);
+}
+
+void VoronoiBase::Triangulate(SiteHandle apex) {
+    // Fan from the chain to the first site off of the line
+    if(Orient(sites_[collinear_.front()], sites_[collinear_.back()], sites_[apex]) < 0)
+        std::reverse(collinear_.begin(), collinear_.end());
+
+    std::vector<uint32_t> new_tris;
+    for(size_t i=0;i+1<collinear_.size();++i) {
+        FeedChainEdge(collinear_[i], collinear_[i+1], false);
+        new_tris.push_back(NewTriangle(collinear_[i], collinear_[i+1], apex));
+        // Outside of the hull is to the left of the infinite triangle's finite edge
+        new_tris.push_back(NewTriangle(collinear_[i+1], collinear_[i], kInfinite));
+    }
+    new_tris.push_back(NewTriangle(apex, collinear_.back(), kInfinite));
+    new_tris.push_back(NewTriangle(collinear_.front(), apex, kInfinite));
+    LinkTriangles(new_tris);
+    for(SiteHandle site : collinear_)
+        InvalidateCell(site);
+    collinear_.clear();
+}
+
+uint32_t VoronoiBase::NewTriangle(uint32_t a, uint32_t b, uint32_t c) {
+    uint32_t t;
+    if(!free_tris_.empty()) {
+        t = free_tris_.back();
+        free_tris_.pop_back();
+    } else {
+        t = uint32_t(tris_.size());
+        tris_.push_back(Triangle());
+    }
+    Triangle &tri = tris_[t];
+    tri.v[0] = a;
+    tri.v[1] = b;
+    tri.v[2] = c;
+    tri.n[0] = tri.n[1] = tri.n[2] = kNoTriangle;
+    for(unsigned i=0;i<3;++i) {
+        if(tri.v[i] != kInfinite)
+            site_tris_[tri.v[i]] = t;
+    }
+    if(a != kInfinite && b != kInfinite && c != kInfinite)
+        PushExtents(t, Circumcenter(sites_[a], sites_[b], sites_[c]));
+    FeedBorn(t);
+    return t;
+}
+
+void VoronoiBase::LinkTriangles(std::vector<uint32_t> const&new_tris) {
+    // Only used to build the first fan, so a map is fine
+    std::map<std::pair<uint32_t, uint32_t>, std::pair<uint32_t, unsigned> > half_edges;
+    for(uint32_t t : new_tris) {
+        for(unsigned i=0;i<3;++i) {
+            const uint32_t a = tris_[t].v[Next(i)], b = tris_[t].v[Prev(i)];
+            auto twin = half_edges.find(std::make_pair(b, a));
+            if(twin != half_edges.end()) {
+                tris_[t].n[i] = twin->second.first;
+                tris_[twin->second.first].n[twin->second.second] = t;
+            } else {
+                half_edges.insert(std::make_pair(std::make_pair(a, b), std::make_pair(t, i)));
+            }
+        }
+    }
+}
+
+bool VoronoiBase::InConflict(uint32_t t, Vec2f const&pt)const {
+    Triangle const&tri = tris_[t];
+    const int inf = InfiniteIndex(t);
+    if(inf < 0)
+        return InCircle(sites_[tri.v[0]], sites_[tri.v[1]], sites_[tri.v[2]], pt) > 0;
+
+    // The circumcircle of an infinite triangle is the half plane outside of its edge
+    Vec2f const&a = sites_[tri.v[Next(inf)]];
+    Vec2f const&b = sites_[tri.v[Prev(inf)]];
+    const double side = Orient(a, b, pt);
+    if(side != 0)
+        return side > 0;
+    // On the hull line, only conflicts if strictly within the edge
+    return (pt - a).Dot(b - a) > 0 && (pt - b).Dot(a - b) > 0;
+}
+
+uint32_t VoronoiBase::Locate(Vec2f const&pt, SiteHandle hint)const {
+    uint32_t t = site_tris_[hint];
+    int inf = InfiniteIndex(t);
+    if(inf >= 0)
+        t = tris_[t].n[inf];
+
+    // Visibility walk, always terminates in a Delaunay triangulation
+    for(;;) {
+        STAT_COUNT(kStatWalkSteps, 1);
+        Triangle const&tri = tris_[t];
+        if(InfiniteIndex(t) >= 0)
+            return t;
+        bool moved = false;
+        for(unsigned k=0;k<3;++k) {
+            // Vary the starting edge, so degenerate walks can't cycle
+            const unsigned i = (t + k) % 3;
+            if(Orient(sites_[tri.v[Next(i)]], sites_[tri.v[Prev(i)]], pt) < 0) {
+                t = tri.n[i];
+                moved = true;
+                break;
+            }
+        }
+        if(!moved)
+            return t;
+    }
+}
+
+void VoronoiBase::InsertTriangulated(SiteHandle site) {
+    Vec2f const&pt = sites_[site];
+    const uint32_t start = Locate(pt, last_site_);
+
+    if(tri_stamps_.size() < tris_.size())
+        tri_stamps_.resize(tris_.size(), 0);
+    ++stamp_;
+
+    // Bowyer-Watson: find every triangle whose circumcircle holds the new site
+    cavity_.clear();
+    cavity_.push_back(start);
+    tri_stamps_[start] = stamp_;
+    for(size_t c=0;c<cavity_.size();++c) {
+        Triangle const&tri = tris_[cavity_[c]];
+        for(unsigned i=0;i<3;++i) {
+            const uint32_t n = tri.n[i];
+            if(tri_stamps_[n] != stamp_ && InConflict(n, pt)) {
+                tri_stamps_[n] = stamp_;
+                cavity_.push_back(n);
+            }
+        }
+    }
+
+    // The new site must see every boundary edge, otherwise round off made the cavity
+    // non star shaped, so grow it.
+    std::vector<BoundaryEdge> &boundary = boundary_;
+    for(bool grew = true;grew;) {
+        grew = false;
+        boundary.clear();
+        for(size_t c=0;c<cavity_.size();++c) {
+            Triangle const&tri = tris_[cavity_[c]];
+            for(unsigned i=0;i<3;++i) {
+                const uint32_t n = tri.n[i];
+                if(tri_stamps_[n] == stamp_)
+                    continue;
+                const uint32_t a = tri.v[Next(i)], b = tri.v[Prev(i)];
+                if(a != kInfinite && b != kInfinite && Orient(sites_[a], sites_[b], pt) <= 0) {
+                    tri_stamps_[n] = stamp_;
+                    cavity_.push_back(n);
+                    grew = true;
+                    continue;
                 }
+                BoundaryEdge edge = { a, b, n, 0 };
+                for(unsigned j=0;j<3;++j) {
+                    if(tris_[n].n[j] == cavity_[c])
+                        edge.outside_i = j;
+                }
+                boundary.push_back(edge);
             }
         }
-        
-        if (n_intersect == 0)
-            dead_edges.push_back(neighbors_find);
     }
-    
-    for(NeighborId const&dead_id : dead_edges)
-        edges_.erase(dead_id);
+
+    STAT_COUNT(kStatCavityTriangles, cavity_.size());
+    for(uint32_t t : cavity_) {
+        // The new site's neighbors, which are the only cells it changes
+        for(unsigned i=0;i<3;++i) {
+            if(tris_[t].v[i] != kInfinite)
+                InvalidateCell(tris_[t].v[i]);
+        }
+        FeedKill(t);
+        tris_[t].v[0] = kDead;
+        free_tris_.push_back(t);
+    }
+
+    // Fan the boundary to the new site, linking around it through link_
+    if(link_.size() < sites_.size() + 1)
+        link_.resize(sites_.size() + 1);
+    std::vector<uint32_t> &new_tris = cavity_;
+    new_tris.clear();
+    for(BoundaryEdge const&edge : boundary) {
+        const uint32_t t = NewTriangle(edge.a, edge.b, site);
+        tris_[t].n[2] = edge.outside;
+        tris_[edge.outside].n[edge.outside_i] = t;
+        link_[(edge.a == kInfinite) ? sites_.size() : edge.a] = t;
+        new_tris.push_back(t);
+    }
+    for(uint32_t t : new_tris) {
+        const uint32_t b = tris_[t].v[1];
+        const uint32_t next = link_[(b == kInfinite) ? sites_.size() : b];
+        tris_[t].n[0] = next;
+        tris_[next].n[1] = t;
+    }
+}
+
+template<typename F>
+void VoronoiBase::ForEachNeighbor(SiteHandle site, F f)const {
+    if(!Triangulated()) {
+        auto it = std::find(collinear_.begin(), collinear_.end(), site);
+        if(it != collinear_.begin())
+            f(*(it-1));
+        if(it+1 != collinear_.end())
+            f(*(it+1));
+        return;
+    }
+    const uint32_t first = site_tris_[site];
+    uint32_t t = first;
+    do {
+        Triangle const&tri = tris_[t];
+        unsigned i = 0;
+        while(tri.v[i] != site)
+            ++i;
+        if(tri.v[Next(i)] != kInfinite)
+            f(tri.v[Next(i)]);
+        t = tri.n[Next(i)];
+    } while(t != first);
+}
+
+VoronoiBase::Edge VoronoiBase::MakeEdge(uint32_t t, unsigned i)const {
+    Triangle const&tri = tris_[t];
+    Edge edge = MakeSiteEdge(tri.v[Next(i)], tri.v[Prev(i)], MakeEdgeExtents(-FLT_MAX, FLT_MAX));
+    const Vec2f mid = edge.mid(), dir = edge.dir();
+
+    float t_min = FLT_MAX, t_max = -FLT_MAX;
+    const uint32_t sides[2] = { t, tri.n[i] };
+    for(uint32_t side : sides) {
+        Triangle const&side_tri = tris_[side];
+        const int inf = InfiniteIndex(side);
+        if(inf >= 0)
+            continue;
+        const float t_vert = (Circumcenter(sites_[side_tri.v[0]],
+                                           sites_[side_tri.v[1]],
+                                           sites_[side_tri.v[2]]) - mid).Dot(dir);
+        t_min = std::min(t_min, t_vert);
+        t_max = std::max(t_max, t_vert);
+    }
+
+    // Hull edges are rays, going away from the hull
+    const int inf = InfiniteIndex(tri.n[i]) >= 0 ? 1 : (InfiniteIndex(t) >= 0 ? 0 : -1);
+    if(inf >= 0) {
+        const uint32_t finite = (inf == 1) ? t : tri.n[i];
+        Triangle const&finite_tri = tris_[finite];
+        uint32_t opposite = 0;
+        for(unsigned j=0;j<3;++j) {
+            if(finite_tri.v[j] != tri.v[Next(i)] && finite_tri.v[j] != tri.v[Prev(i)])
+                opposite = finite_tri.v[j];
+        }
+        // The sign of (sites_[opposite] - mid).Dot(dir), which rounding gets wrong when the
+        // triangle is thin
+        if(Orient(sites_[edge.site_b], sites_[edge.site_a], sites_[opposite]) > 0)
+            t_min = -FLT_MAX;
+        else
+            t_max = FLT_MAX;
+    }
+    edge.extents = MakeEdgeExtents(t_min, t_max);
+    return edge;
+}
+
+bool VoronoiBase::IsDegenerateEdge(uint32_t t, unsigned i)const {
+    // Cocircular sites, e.g. a square, give a diagonal whose Voronoi edge has no length
+    const uint32_t other = tris_[t].n[i];
+    if(InfiniteIndex(t) >= 0 || InfiniteIndex(other) >= 0)
+        return false;
+    Triangle const&tri = tris_[t];
+    Triangle const&other_tri = tris_[other];
+    unsigned j = 0;
+    while(other_tri.n[j] != t)
+        ++j;
+    return InCircle(sites_[tri.v[0]], sites_[tri.v[1]], sites_[tri.v[2]], sites_[other_tri.v[j]]) == 0;
+}
+
+VoronoiBase::Edge VoronoiBase::MakeSiteEdge(SiteHandle a, SiteHandle b, Extrema1f const&extents)const {
+    if(pt_less(sites_[b], sites_[a]))
+        std::swap(a, b);
+    return Edge(a, sites_[a], b, sites_[b], extents);
+}
+
+template<typename F>
+void VoronoiBase::ForEachEdgeOfSite(SiteHandle site, F f)const {
+    if(!Triangulated()) {
+        ForEachNeighbor(site, [&](SiteHandle neighbor) {
+            f(neighbor, kNoTriangle, 0);
+        });
+        return;
+    }
+
+    const uint32_t first = site_tris_[site];
+    uint32_t t = first;
+    do {
+        Triangle const&tri = tris_[t];
+        unsigned i = 0;
+        while(tri.v[i] != site)
+            ++i;
+        // Edge from site to v[Next(i)]
+        if(tri.v[Next(i)] != kInfinite && !IsDegenerateEdge(t, Prev(i)))
+            f(tri.v[Next(i)], t, Prev(i));
+        t = tri.n[Next(i)];
+    } while(t != first);
 }
 
-bool Voronoi::NeighboringPoints(Vec2f const&pt, std::vector<Vec2f> &output)const {
-    std::vector<Edge> edges;
-    if(!NeighboringEdges(pt, edges))
+bool VoronoiBase::NeighboringPoints(SiteHandle site, std::vector<SiteHandle> &output)const {
+    if(site >= sites_.size() || removed_[site])
         return false;
-    
-    std::set<Vec2f> out_set;
-    for(auto const&edge : edges) {
-        out_set.insert(edge.pt_a);
-        out_set.insert(edge.pt_b);
-    }
-    out_set.erase(pt);
-    std::copy(out_set.begin(), out_set.end(), std::back_inserter(output));
+
+    // Not ForEachNeighbor(), which also gives the neighbors across degenerate edges
+    ForEachEdgeOfSite(site, [&](SiteHandle neighbor, uint32_t, unsigned) {
+        output.push_back(neighbor);
+    });
     return true;
 }
 
-bool Voronoi::NeighboringEdges(Vec2f const&pt, std::vector<Edge> &output)const {
-    if(points_.find(pt) == points_.end())
+bool VoronoiBase::NeighboringEdges(SiteHandle site, std::vector<Edge> &output)const {
+    if(site >= sites_.size() || removed_[site])
         return false;
-    
-    // TODO: This is O(n), use a multimap
+
     output.clear();
-    for(auto const&edge : edges_) {
-        NeighborId const&neighbors = edge.first;
-        if(std::get<0>(neighbors) == pt || std::get<1>(neighbors) == pt)
-            output.push_back(Edge(std::get<0>(neighbors), std::get<1>(neighbors), edge.second));
-    }
+    ForEachEdgeOfSite(site, [&](SiteHandle neighbor, uint32_t t, unsigned i) {
+        if(t == kNoTriangle)
+            output.push_back(MakeSiteEdge(site, neighbor, MakeEdgeExtents(-FLT_MAX, FLT_MAX)));
+        else
+            output.push_back(MakeEdge(t, i));
+    });
     return true;
 }
 
-void Voronoi::EdgesAffectedByAddInternal(const Vec2f const&new_pt,
-                                         const Vec2f const&existing_pt,
-                                         const float max_dim,
-                                         std::set<NeighborId> &edges,
-                                         std::set<Vec2f> &points_visited)const {
-    if(points_visited.find(existing_pt) != points_visited.end())
-        return;
-    points_visited.insert(existing_pt);
-    
-    vector<Edge> neighboring_edges;
-    NeighboringEdges(existing_pt, neighboring_edges);
-    for(auto const&edge : neighboring_edges) {
-        const vector<Vec2f> test_pts = {
-            edge.closest_pt_on_edge(new_pt),
-            edge.closest_pt_on_edge(existing_pt),
-            edge.closest_pt_on_edge(edge.pt_a),
-            edge.closest_pt_on_edge(edge.pt_b),
-            edge.min_pt(max_dim),
-            edge.max_pt(max_dim),
-        };
-        bool any_chance = false;
-        for(Vec2f const&test_pt : test_pts) {
-            const float dist_to_new_pt = (new_pt - test_pt).Length();
-            const float dist_to_existing_pt = (existing_pt - test_pt).Length();
-            if(dist_to_new_pt <= dist_to_existing_pt) {
-                any_chance = true;
-                break;
-            }
+template<typename F>
+bool VoronoiBase::ForEachAffectedEdge(Vec2f const&pt, SiteHandle &hint, SearchScratch &scratch, F found)const {
+    if(!Triangulated()) {
+        // If the point is already in the graph, then no edges will be affected
+        for(SiteHandle site : collinear_) {
+            if(sites_[site] == pt)
+                return false;
+        }
+        // The edges are lines, so any point off the chain's line is closer to some of each
+        for(size_t c=1;c<collinear_.size();++c) {
+            if(IsAffectedByAdd(MakeSiteEdge(collinear_[c-1], collinear_[c], MakeEdgeExtents(-FLT_MAX, FLT_MAX)), pt))
+                found(kNoTriangle, unsigned(c-1));
         }
-        if(any_chance) {
-            edges.insert(MakeNeighborId(edge.pt_a, edge.pt_b));
-            // TODO: Really we should recurse by edges with shared verts, this is inefficient
-            EdgesAffectedByAddInternal(new_pt, edge.pt_a, max_dim, edges, points_visited);
-            EdgesAffectedByAddInternal(new_pt, edge.pt_b, max_dim, edges, points_visited);
+        return true;
+    }
+
+    // A point on a Voronoi edge is the center of an empty circle through its two sites.
+    // Those circles are nested on either side of the sites, so if the new site is in one of
+    // them it is also in the circle of one of the edge's vertices. The affected edges are
+    // the ones around the vertices, triangles, the new site conflicts with, and those are
+    // connected, so this is a search of the Bowyer-Watson cavity without changing anything.
+    const uint32_t start = Locate(pt, hint);
+    for(unsigned i=0;i<3;++i) {
+        const uint32_t v = tris_[start].v[i];
+        if(v != kInfinite)
+            hint = v;
+        if(v != kInfinite && sites_[v] == pt)
+            return false;
+    }
+    if(scratch.stamps.size() < tris_.size())
+        scratch.stamps.resize(tris_.size(), 0);
+    const uint32_t stamp = ++scratch.stamp;
+
+    std::vector<uint32_t> &stack = scratch.stack;
+    stack.clear();
+    stack.push_back(start);
+    scratch.stamps[start] = stamp;
+    uint32_t vertices = 0;
+    while(!stack.empty()) {
+        const uint32_t t = stack.back();
+        stack.pop_back();
+        ++vertices;
+        Triangle const&tri = tris_[t];
+        for(unsigned i=0;i<3;++i) {
+            const uint32_t n = tri.n[i];
+            const bool n_conflicts = (scratch.stamps[n] == stamp) || InConflict(n, pt);
+            if(n_conflicts && scratch.stamps[n] != stamp) {
+                scratch.stamps[n] = stamp;
+                stack.push_back(n);
+            }
+            // Edges to the infinite vertex are not Voronoi edges.
+            // Shared edges are found from the side with the lower index.
+            if(tri.v[Next(i)] == kInfinite || tri.v[Prev(i)] == kInfinite)
+                continue;
+            if((!n_conflicts || t < n) && !IsDegenerateEdge(t, i))
+                found(t, i);
         }
     }
+    STAT_MAX(kStatAffectedVertices, vertices);
+    return true;
 }
 
-void Voronoi::EdgesAffectedByAdd(Vec2f const&anywhere,
+void VoronoiBase::EdgesAffectedByAdd(Vec2f const&anywhere,
                                  std::vector<Edge> &edges)const {
-    const Vec2f closest = Closest(anywhere);
+    STAT_TIMER(kStatTimeEdgesAffected);
+    STAT_SCRATCH();
     edges.clear();
-    // If the point is already in the graph, then no edges will be affected
-    if(closest == anywhere)
+    if(!NumLiveSites())
+        return;
+    affected_found_.clear();
+    SiteHandle hint = last_site_;
+    ForEachAffectedEdge(anywhere, hint, affected_, [&](uint32_t t, unsigned i) {
+        const Edge edge = (t == kNoTriangle) ?
+            MakeSiteEdge(collinear_[i], collinear_[i+1], MakeEdgeExtents(-FLT_MAX, FLT_MAX)) : MakeEdge(t, i);
+        affected_found_.push_back(std::make_pair(MakeNeighborId(edge.site_a, edge.site_b), edge));
+    });
+    STAT_COUNT(kStatEdgesTouched, affected_found_.size());
+
+    // Ordered by their sites
+    std::sort(affected_found_.begin(), affected_found_.end(),
+              [](std::pair<NeighborId, Edge> const&a, std::pair<NeighborId, Edge> const&b) {
+        return a.first < b.first;
+    });
+    for(auto const&found : affected_found_)
+        edges.push_back(found.second);
+}
+
+void VoronoiBase::EdgesAffectedByAddBatch(std::vector<Vec2f> const&candidates, AffectedEdges &output)const {
+    STAT_TIMER(kStatTimeEdgesAffectedBatch);
+    // Builds edge_ids_ too
+    EdgeView();
+    const uint32_t n = uint32_t(candidates.size());
+    output.offsets.assign(n + 1, 0);
+    output.edges.clear();
+    if(!NumLiveSites() || n == 0)
         return;
-    const Extrema2f extrema = GetDiagramDetailExtents();
-    const float max_dim = 2.0f * std::max(extrema.GetSize().x, extrema.GetSize().y);
-    set<NeighborId> edges_internal;
-    set<Vec2f> points_visited;
-    EdgesAffectedByAddInternal(anywhere, closest, max_dim, edges_internal, points_visited);
-    for(NeighborId const&edge_id : edges_internal)
-        edges.push_back(Edge(std::get<0>(edge_id),
-                             std::get<1>(edge_id),
-                             edges_.find(edge_id)->second));
-    
-}
-
-bool Voronoi::BruteIsBetweenNeighbors(Vec2f const&test_pt, NeighborId const&neighbors)const {
-    Vec2f closest = BruteClosest(test_pt);
+
+    // Neighboring candidates next to each other, so each walk starts from the one before
+    Extrema2f bounds(candidates.front(), candidates.front());
+    for(Vec2f const&pt : candidates)
+        bounds.DoEnclose(pt);
+    std::vector<uint32_t> order(n);
+    for(uint32_t c=0;c<n;++c)
+        order[c] = c;
+    HilbertSort(order.begin(), order.end(), candidates, bounds);
+
+    // Blocks of the sorted order, each thread takes a run of them
+    static const uint32_t kBlock = 256;
+    const uint32_t num_blocks = (n + kBlock - 1) / kBlock;
+    std::vector<std::vector<uint32_t> > block_edges(num_blocks);
+    // Where each candidate's edges start in its block
+    std::vector<uint32_t> block_start(n);
+    ParallelFor(num_blocks, [&](uint32_t block_begin, uint32_t block_end) {
+        SearchScratch scratch;
+        SiteHandle hint = last_site_;
+        for(uint32_t b=block_begin;b<block_end;++b) {
+            std::vector<uint32_t> &found = block_edges[b];
+            for(uint32_t k=b*kBlock;k<std::min(n, (b + 1) * kBlock);++k) {
+                const uint32_t c = order[k];
+                block_start[c] = uint32_t(found.size());
+                ForEachAffectedEdge(candidates[c], hint, scratch, [&](uint32_t t, unsigned i) {
+                    found.push_back((t == kNoTriangle) ? i : edge_ids_[3 * t + i]);
+                });
+                std::sort(found.begin() + block_start[c], found.end());
+                output.offsets[c + 1] = uint32_t(found.size()) - block_start[c];
+            }
+        }
+    });
+
+    for(uint32_t c=0;c<n;++c)
+        output.offsets[c + 1] += output.offsets[c];
+    output.edges.resize(output.offsets[n]);
+    for(uint32_t b=0;b<num_blocks;++b) {
+        for(uint32_t k=b*kBlock;k<std::min(n, (b + 1) * kBlock);++k) {
+            const uint32_t c = order[k];
+            std::copy(block_edges[b].begin() + block_start[c],
+                      block_edges[b].begin() + block_start[c] + (output.offsets[c + 1] - output.offsets[c]),
+                      output.edges.begin() + output.offsets[c]);
+        }
+    }
+    STAT_COUNT(kStatEdgesTouched, output.edges.size());
+}
+
+bool VoronoiBase::IsAffectedByAdd(Edge const&edge, Vec2f const&new_pt)const {
+    // Along the edge, |q - new_pt|^2 - |q - pt_a|^2 is linear in t
+    const Vec2f mid = edge.mid(), dir = edge.dir();
+    const double c0 = SquaredDistance(mid, new_pt) - SquaredDistance(mid, edge.pt_a);
+    const double c1 = 2.0 * ((double(edge.pt_a.x) - new_pt.x) * dir.x + (double(edge.pt_a.y) - new_pt.y) * dir.y);
+    const double lo = edge.extents.mMin[0], hi = edge.extents.mMax[0];
+    if(c1 > 0)
+        return (lo == -FLT_MAX) || c0 + c1 * lo < 0;
+    if(c1 < 0)
+        return (hi == FLT_MAX) || c0 + c1 * hi < 0;
+    return c0 < 0;
+}
+
+bool VoronoiBase::BruteIsBetweenNeighbors(Vec2f const&test_pt, NeighborId const&neighbors)const {
+    STAT_TIMER(kStatTimeBruteBetween);
+    SiteHandle closest = BruteClosest(test_pt);
     return closest == std::get<0>(neighbors) || closest == std::get<1>(neighbors);
 }
 
@@ -210,21 +1106,21 @@ bool LineCollision( const Vec2f& A1, const Vec2f& A2,
 {
     Vec2f a(A2-A1);
     Vec2f b(B2-B1);
-    
+
     float f = PerpDot(a,b);
     if(::fabs(f) < 0.0001f)      // lines are parallel
         return false;
-    
+
     Vec2f c(B2-A2);
     float aa = PerpDot(a,c);
-    
+
     *out = 1.0f - (aa / f);
     return true;
 }
 
 
 
-bool Voronoi::EdgesIntersect(Edge const&a,
+bool VoronoiBase::EdgesIntersect(Edge const&a,
                              Edge const&b,
                              float &t_a) {
     Vec2f i_pt;
@@ -232,45 +1128,1512 @@ bool Voronoi::EdgesIntersect(Edge const&a,
                            b.mid(), b.mid()+b.dir(),
                            i_pt))
         return false;
-    
+
     t_a = (i_pt - a.mid()).Dot(a.dir());
     return true;
 }
 
-void Voronoi::Remove(Vec2f const&pt) {
-    assert(!"TODO");
+bool VoronoiBase::Remove(SiteHandle site) {
+    if(!RemoveInternal(site))
+        return false;
+    UpdateExtents();
+    return true;
+}
+
+VoronoiBase::SiteHandle VoronoiBase::WalkStart(Vec2f const&pt, SiteHandle start) {
+    // Built again as the sites double, or once many land outside of it
+    if(hint_grid_.empty() || NumLiveSites() > 4 * hint_grid_.size() || hint_outside_ > hint_grid_.size())
+        RebuildHints();
+    const SiteHandle hint = hint_grid_[HintCell(pt)];
+    if(hint == kNoSite || removed_[hint] ||
+       SquaredDistance(sites_[hint], pt) >= SquaredDistance(sites_[start], pt))
+        return start;
+    return hint;
+}
+
+uint32_t VoronoiBase::HintCell(Vec2f const&pt)const {
+    const Vec2f size = hint_bounds_.GetSize();
+    const float x = (size.x > 0) ? (pt.x - hint_bounds_.mMin.x) / size.x * float(hint_side_) : 0;
+    const float y = (size.y > 0) ? (pt.y - hint_bounds_.mMin.y) / size.y * float(hint_side_) : 0;
+    const uint32_t col = uint32_t(std::max(0.0f, std::min(float(hint_side_ - 1), x)));
+    const uint32_t row = uint32_t(std::max(0.0f, std::min(float(hint_side_ - 1), y)));
+    return row * hint_side_ + col;
+}
+
+void VoronoiBase::NoteHint(SiteHandle site) {
+    if(hint_grid_.empty())
+        return;
+    Vec2f const&pt = sites_[site];
+    if(pt.x < hint_bounds_.mMin.x || pt.y < hint_bounds_.mMin.y ||
+       pt.x > hint_bounds_.mMax.x || pt.y > hint_bounds_.mMax.y)
+        ++hint_outside_;
+    hint_grid_[HintCell(pt)] = site;
+}
+
+void VoronoiBase::RebuildHints() {
+    hint_bounds_ = Extrema2f(Vec2f(FLT_MAX, FLT_MAX), Vec2f(-FLT_MAX, -FLT_MAX));
+    for(SiteHandle site=0;site<sites_.size();++site) {
+        if(!removed_[site])
+            hint_bounds_.DoEnclose(sites_[site]);
+    }
+    // About two sites a cell
+    hint_side_ = std::max(uint32_t(1), uint32_t(std::sqrt(double(NumLiveSites()) / 2)));
+    hint_grid_.assign(size_t(hint_side_) * hint_side_, kNoSite);
+    hint_outside_ = 0;
+    for(SiteHandle site=0;site<sites_.size();++site) {
+        if(!removed_[site])
+            hint_grid_[HintCell(sites_[site])] = site;
+    }
+}
+
+bool VoronoiBase::RemoveInternal(SiteHandle site) {
+    STAT_TIMER(kStatTimeRemove);
+    STAT_SCRATCH();
+    if(site >= sites_.size() || removed_[site])
+        return false;
+    Detach(site);
+    removed_[site] = 1;
+    free_sites_.push_back(site);
+    ++generation_;
+    FeedEnd();
+    return true;
+}
+
+VoronoiBase::SiteHandle VoronoiBase::AddUntil(Vec2f const&pt, double expires) {
+    const SiteHandle site = Add(pt);
+    ExtendExpiry(site, expires);
+    return site;
 }
 
-Vec2f Voronoi::Closest(Vec2f const&pt)const {
-    // TODO
-//    assert(!"TODO");
-//    return Vec2f(0,0);
-    return BruteClosest(pt);
+void VoronoiBase::ExtendExpiry(SiteHandle site, double expires) {
+    if(expiries_.size() < sites_.size())
+        expiries_.resize(sites_.size(), -HUGE_VAL);
+    if(!(expires > expiries_[site]))
+        return;
+    expiries_[site] = expires;
+    expiry_heap_.push_back(std::make_pair(expires, site));
+    std::push_heap(expiry_heap_.begin(), expiry_heap_.end(), std::greater<std::pair<double, SiteHandle> >());
 }
 
-void Voronoi::GetEdges(std::vector<Voronoi::Edge> &output)const {
-    for(auto const&edge : edges_) {
-        NeighborId const&neighborId = edge.first;
-        output.push_back(Edge(std::get<0>(neighborId), std::get<1>(neighborId), edge.second));
+size_t VoronoiBase::Advance(double now) {
+    STAT_TIMER(kStatTimeAdvance);
+    size_t removed = 0;
+    while(!expiry_heap_.empty() && expiry_heap_.front().first <= now) {
+        const std::pair<double, SiteHandle> entry = expiry_heap_.front();
+        std::pop_heap(expiry_heap_.begin(), expiry_heap_.end(), std::greater<std::pair<double, SiteHandle> >());
+        expiry_heap_.pop_back();
+        if(!removed_[entry.second] && expiries_[entry.second] == entry.first)
+            removed += RemoveInternal(entry.second);
     }
+    // The extents only once for the batch
+    if(removed)
+        UpdateExtents();
+    return removed;
 }
-void Voronoi::GetPoints(std::vector<Vec2f> &output)const {
-    std::copy(points_.begin(), points_.end(), std::back_inserter(output));
+
+void VoronoiBase::SetChangeFeed(ChangeRing *ring) {
+    feed_ = ring;
+    feed_dropped_ = false;
+    feed_born_tris_.clear();
+    feed_removed_.clear();
+    feed_chain_added_.clear();
+    ++feed_stamp_;
 }
 
-Extrema2f Voronoi::GetDiagramDetailExtents()const {
-    return extents_;
+void VoronoiBase::FeedKillTriangle(uint32_t t) {
+    // Its edges were already counted when the triangle it replaced died
+    if(t < feed_born_.size() && feed_born_[t] == feed_stamp_)
+        return;
+    // Edges next to a triangle already gone, or born, were counted when it died, while both
+    // sides were still as they were
+    Triangle const&tri = tris_[t];
+    for(unsigned i=0;i<3;++i) {
+        const uint32_t a = tri.v[Next(i)], b = tri.v[Prev(i)], n = tri.n[i];
+        if(a == kInfinite || b == kInfinite || tris_[n].v[0] == kDead ||
+           (n < feed_born_.size() && feed_born_[n] == feed_stamp_) || IsDegenerateEdge(t, i))
+            continue;
+        feed_removed_.push_back(MakeNeighborId(a, b));
+    }
 }
 
-Vec2f Voronoi::BruteClosest(Vec2f const&pt)const {
-    Vec2f ret(std::numeric_limits<float>::signaling_NaN(), std::numeric_limits<float>::signaling_NaN());
-    float dist = FLT_MAX;
-    for (Vec2f const&pt_ref : points_) {
-        float this_dist = (pt_ref - pt).Length();
-        if (this_dist < dist) {
-            dist = this_dist;
-            ret = pt_ref;
-        }
+void VoronoiBase::FeedBornTriangle(uint32_t t) {
+    if(feed_born_.size() <= t)
+        feed_born_.resize(tris_.size(), 0);
+    feed_born_[t] = feed_stamp_;
+    feed_born_tris_.push_back(t);
+}
+
+void VoronoiBase::FeedChainEdgeChanged(SiteHandle a, SiteHandle b, bool added) {
+    const NeighborId id = MakeNeighborId(a, b);
+    if(added) {
+        feed_chain_added_.push_back(id);
+        return;
     }
-    return ret;
-}
\ No newline at end of file
+    // One added earlier in the same update was never seen
+    auto it = std::find(feed_chain_added_.begin(), feed_chain_added_.end(), id);
+    if(it != feed_chain_added_.end())
+        feed_chain_added_.erase(it);
+    else
+        feed_removed_.push_back(id);
+}
+
+void VoronoiBase::FeedEnd(bool reset) {
+    if(!feed_)
+        return;
+    Change change;
+    change.generation = generation_;
+    feed_out_.clear();
+    if(reset || feed_dropped_) {
+        change.kind = Change::kReset;
+        feed_out_.push_back(change);
+    } else {
+        std::sort(feed_removed_.begin(), feed_removed_.end());
+        feed_removed_.erase(std::unique(feed_removed_.begin(), feed_removed_.end()), feed_removed_.end());
+        change.kind = Change::kEdgeRemoved;
+        for(NeighborId const&id : feed_removed_) {
+            change.edge.site_a = std::get<0>(id);
+            change.edge.site_b = std::get<1>(id);
+            feed_out_.push_back(change);
+        }
+
+        // The edges of the triangles born in this update, once each as in BuildEdges()
+        change.kind = Change::kEdgeAdded;
+        feed_created_.clear();
+        if(feed_born_.size() < tris_.size())
+            feed_born_.resize(tris_.size(), 0);
+        std::sort(feed_born_tris_.begin(), feed_born_tris_.end());
+        feed_born_tris_.erase(std::unique(feed_born_tris_.begin(), feed_born_tris_.end()), feed_born_tris_.end());
+        for(uint32_t t : feed_born_tris_) {
+            if(t >= tris_.size() || tris_[t].v[0] == kDead || feed_born_[t] != feed_stamp_)
+                continue;
+            Triangle const&tri = tris_[t];
+            for(unsigned i=0;i<3;++i) {
+                const uint32_t a = tri.v[Next(i)], b = tri.v[Prev(i)];
+                if(a == kInfinite || b == kInfinite ||
+                   (feed_born_[tri.n[i]] == feed_stamp_ && tri.n[i] < t))
+                    continue;
+                if(IsDegenerateEdge(t, i))
+                    continue;
+                feed_created_.push_back(MakeNeighborId(a, b));
+                change.edge = MakeEdge(t, i);
+                feed_out_.push_back(change);
+            }
+        }
+        if(!Triangulated()) {
+            for(NeighborId const&id : feed_chain_added_) {
+                feed_created_.push_back(id);
+                change.edge = MakeSiteEdge(std::get<0>(id), std::get<1>(id), MakeEdgeExtents(-FLT_MAX, FLT_MAX));
+                feed_out_.push_back(change);
+            }
+        }
+
+        // Edges only removed, or only created, are neighbors lost or gained
+        std::sort(feed_created_.begin(), feed_created_.end());
+        feed_changed_.clear();
+        size_t r = 0, c = 0;
+        while(r < feed_removed_.size() || c < feed_created_.size()) {
+            NeighborId id;
+            if(c == feed_created_.size() || (r < feed_removed_.size() && feed_removed_[r] < feed_created_[c])) {
+                id = feed_removed_[r++];
+            } else if(r == feed_removed_.size() || feed_created_[c] < feed_removed_[r]) {
+                id = feed_created_[c++];
+            } else {
+                ++r;
+                ++c;
+                continue;
+            }
+            feed_changed_.push_back(std::get<0>(id));
+            feed_changed_.push_back(std::get<1>(id));
+        }
+        std::sort(feed_changed_.begin(), feed_changed_.end());
+        feed_changed_.erase(std::unique(feed_changed_.begin(), feed_changed_.end()), feed_changed_.end());
+        change = Change();
+        change.kind = Change::kNeighborsChanged;
+        change.generation = generation_;
+        for(SiteHandle site : feed_changed_) {
+            change.site = site;
+            feed_out_.push_back(change);
+        }
+    }
+    change = Change();
+    change.generation = generation_;
+    feed_out_.push_back(change);
+
+    // All of the update or none of it
+    feed_dropped_ = feed_->FreeSpace() < feed_out_.size();
+    if(!feed_dropped_) {
+        for(Change const&out : feed_out_)
+            feed_->TryPush(out);
+    }
+    feed_born_tris_.clear();
+    feed_removed_.clear();
+    feed_chain_added_.clear();
+    ++feed_stamp_;
+}
+
+VoronoiBase::SiteHandle VoronoiBase::ClosestSite(Vec2f const&pt, SiteHandle hint)const {
+    // Greedy walk over Delaunay neighbors always ends at the closest site
+    // In double, so near duplicates still end at the closer one
+    SiteHandle site = hint;
+    double dist = SquaredDistance(sites_[site], pt);
+    for(bool moved = true;moved;) {
+        moved = false;
+        const SiteHandle from = site;
+        STAT_COUNT(kStatSitesVisited, 1);
+        ForEachNeighbor(from, [&](SiteHandle neighbor) {
+            const double this_dist = SquaredDistance(sites_[neighbor], pt);
+            if(this_dist < dist) {
+                dist = this_dist;
+                site = neighbor;
+                moved = true;
+            }
+        });
+    }
+    return site;
+}
+
+VoronoiBase::SiteHandle VoronoiBase::Closest(Vec2f const&pt)const {
+    STAT_TIMER(kStatTimeClosest);
+    if(!NumLiveSites())
+        return kNoSite;
+    return ClosestSite(pt, last_site_);
+}
+
+void VoronoiBase::WalkCells(Vec2f const&o, Vec2f const&d, double t_end, SiteHandle site,
+                            std::vector<SiteHandle> &output)const {
+    // Each step is to a site further along d, so the walk always ends
+    for(;;) {
+        STAT_COUNT(kStatSitesVisited, 1);
+        Vec2f const&s = sites_[site];
+        // The line leaves the cell where it first crosses the bisector with a site ahead of it
+        SiteHandle next = kNoSite;
+        double exit_t = t_end;
+        ForEachNeighbor(site, [&](SiteHandle neighbor) {
+            Vec2f const&q = sites_[neighbor];
+            const double ex = double(q.x) - s.x, ey = double(q.y) - s.y;
+            const double toward = double(d.x) * ex + double(d.y) * ey;
+            if(toward <= 0)
+                return;
+            const double mx = 0.5 * (double(q.x) + s.x) - o.x, my = 0.5 * (double(q.y) + s.y) - o.y;
+            const double t = (mx * ex + my * ey) / toward;
+            if(t <= t_end && (next == kNoSite || t < exit_t)) {
+                exit_t = t;
+                next = neighbor;
+            }
+        });
+        if(next == kNoSite)
+            return;
+        output.push_back(next);
+        site = next;
+    }
+}
+
+void VoronoiBase::CellsCrossingLine(Vec2f const&o, Vec2f const&d, std::vector<SiteHandle> &output)const {
+    STAT_TIMER(kStatTimeCellsCrossingLine);
+    output.clear();
+    if(!NumLiveSites())
+        return;
+    // Both ways from the cell at o, the backward half is reversed in front of it
+    const SiteHandle start = ClosestSite(o, last_site_);
+    const double kForever = std::numeric_limits<double>::infinity();
+    WalkCells(o, -d, kForever, start, output);
+    std::reverse(output.begin(), output.end());
+    output.push_back(start);
+    WalkCells(o, d, kForever, start, output);
+}
+
+void VoronoiBase::CellsCrossingRay(Vec2f const&o, Vec2f const&d, std::vector<SiteHandle> &output)const {
+    STAT_TIMER(kStatTimeCellsCrossingRay);
+    output.clear();
+    if(!NumLiveSites())
+        return;
+    const SiteHandle start = ClosestSite(o, last_site_);
+    output.push_back(start);
+    WalkCells(o, d, std::numeric_limits<double>::infinity(), start, output);
+}
+
+void VoronoiBase::CellsCrossingSegment(Vec2f const&a, Vec2f const&b, std::vector<SiteHandle> &output)const {
+    STAT_TIMER(kStatTimeCellsCrossingSegment);
+    output.clear();
+    if(!NumLiveSites())
+        return;
+    const SiteHandle start = ClosestSite(a, last_site_);
+    output.push_back(start);
+    WalkCells(a, b - a, 1.0, start, output);
+}
+
+bool VoronoiBase::CellTouchesPolygon(SiteHandle site, std::vector<Vec2f> const&polygon)const {
+    Vec2f const&s = sites_[site];
+    // A cell always holds its site, so only cells whose sites are outside are clipped
+    bool inside = false;
+    for(size_t i=0, j=polygon.size()-1;i<polygon.size();j=i++) {
+        Vec2f const&a = polygon[i];
+        Vec2f const&b = polygon[j];
+        if((a.y > s.y) != (b.y > s.y) &&
+           s.x < a.x + (double(b.x) - a.x) * (double(s.y) - a.y) / (double(b.y) - a.y))
+            inside = !inside;
+    }
+    if(inside)
+        return true;
+
+    clip_poly_.clear();
+    for(Vec2f const&corner : polygon)
+        clip_poly_.push_back(std::make_pair(double(corner.x), double(corner.y)));
+    ClipToCell(site, clip_poly_, clip_scratch_);
+    return !clip_poly_.empty();
+}
+
+void VoronoiBase::ClipToCell(SiteHandle site, ClipPolygon &poly, ClipPolygon &scratch)const {
+    Vec2f const&s = sites_[site];
+    ForEachNeighbor(site, [&](SiteHandle neighbor) {
+        if(poly.empty())
+            return;
+        Vec2f const&t = sites_[neighbor];
+        const double nx = double(t.x) - s.x, ny = double(t.y) - s.y;
+        ClipToHalfPlane(poly, nx, ny, nx * (double(s.x) + t.x) * 0.5 + ny * (double(s.y) + t.y) * 0.5,
+                        scratch);
+        poly.swap(scratch);
+    });
+}
+
+bool VoronoiBase::Cell(SiteHandle site, Extrema2f const&clip_box, std::vector<Vec2f> &output)const {
+    output.clear();
+    if(site >= sites_.size() || removed_[site])
+        return false;
+    ClipBoxToCell(site, clip_box, clip_poly_, clip_scratch_);
+    for(auto const&pt : clip_poly_)
+        output.push_back(Vec2f(float(pt.first), float(pt.second)));
+    return true;
+}
+
+void VoronoiBase::ClipBoxToCell(SiteHandle site, Extrema2f const&box, ClipPolygon &poly, ClipPolygon &scratch)const {
+    poly.clear();
+    poly.push_back(std::make_pair(double(box.mMin.x), double(box.mMin.y)));
+    poly.push_back(std::make_pair(double(box.mMax.x), double(box.mMin.y)));
+    poly.push_back(std::make_pair(double(box.mMax.x), double(box.mMax.y)));
+    poly.push_back(std::make_pair(double(box.mMin.x), double(box.mMax.y)));
+    ClipToCell(site, poly, scratch);
+}
+
+VoronoiBase::CellStats VoronoiBase::MeasureCell(SiteHandle site, ClipPolygon const&poly)const {
+    // Shoelace, in double and about the site to keep the products small
+    const double sx = sites_[site].x, sy = sites_[site].y;
+    double area = 0, cx = 0, cy = 0, perimeter = 0;
+    for(size_t i=0;i<poly.size();++i) {
+        const double ax = poly[i].first - sx, ay = poly[i].second - sy;
+        const double bx = poly[(i + 1) % poly.size()].first - sx, by = poly[(i + 1) % poly.size()].second - sy;
+        const double cross = ax * by - bx * ay;
+        area += cross;
+        cx += (ax + bx) * cross;
+        cy += (ay + by) * cross;
+        perimeter += std::sqrt((bx - ax) * (bx - ax) + (by - ay) * (by - ay));
+    }
+    CellStats stats;
+    stats.area = area * 0.5;
+    stats.perimeter = perimeter;
+    stats.centroid = (area != 0) ? Vec2f(float(sx + cx / (3.0 * area)), float(sy + cy / (3.0 * area))) : sites_[site];
+    return stats;
+}
+
+VoronoiBase::CellStats VoronoiBase::GetCellStats(SiteHandle site, Extrema2f const&clip_box)const {
+    if(site >= sites_.size() || removed_[site])
+        return CellStats();
+    if(cell_stats_box_.mMin != clip_box.mMin || cell_stats_box_.mMax != clip_box.mMax) {
+        cell_stats_box_ = clip_box;
+        cell_stats_valid_.assign(sites_.size(), 0);
+    }
+    if(cell_stats_valid_.size() < sites_.size())
+        cell_stats_valid_.resize(sites_.size(), 0);
+    if(cell_stats_.size() < sites_.size())
+        cell_stats_.resize(sites_.size());
+    if(cell_stats_valid_[site])
+        return cell_stats_[site];
+
+    ClipBoxToCell(site, clip_box, clip_poly_, clip_scratch_);
+    cell_stats_[site] = MeasureCell(site, clip_poly_);
+    cell_stats_valid_[site] = 1;
+    return cell_stats_[site];
+}
+
+unsigned VoronoiBase::Relax(unsigned iterations, Extrema2f const&clip_box, float tolerance) {
+    STAT_TIMER(kStatTimeRelax);
+    if(!Triangulated())
+        return 0;
+    const uint32_t n = uint32_t(sites_.size());
+    std::vector<Vec2f> centroids(n), old_sites;
+    std::vector<uint8_t> moved(n);
+    // Every edge may change, so the feed is told only that
+    ChangeRing *const feed = feed_;
+    feed_ = NULL;
+    unsigned done = 0;
+    while(done < iterations) {
+        ++done;
+        ParallelFor(n, [&](uint32_t begin, uint32_t end) {
+            ClipPolygon poly, scratch;
+            for(SiteHandle s=begin;s<end;++s) {
+                if(removed_[s]) {
+                    centroids[s] = sites_[s];
+                    continue;
+                }
+                ClipBoxToCell(s, clip_box, poly, scratch);
+                centroids[s] = poly.empty() ? sites_[s] : MeasureCell(s, poly).centroid;
+            }
+        });
+
+        old_sites = sites_;
+        double max_move = 0;
+        for(SiteHandle s=0;s<n;++s) {
+            max_move = std::max(max_move, SquaredDistance(centroids[s], sites_[s]));
+            moved[s] = (centroids[s] != sites_[s]);
+            sites_[s] = centroids[s];
+        }
+        // Put back the sites of folded triangles until none are. Everything back where
+        // it was is a valid triangulation, so this ends.
+        for(bool reverted = true;reverted;) {
+            reverted = false;
+            uint32_t corners[3];
+            for(uint32_t t=0;t<tris_.size();++t) {
+                if(tris_[t].v[0] == kDead || !IsFolded(t, corners))
+                    continue;
+                for(uint32_t v : corners) {
+                    if(moved[v]) {
+                        sites_[v] = old_sites[v];
+                        moved[v] = 0;
+                        reverted = true;
+                    }
+                }
+            }
+        }
+        RestoreDelaunay();
+        ++generation_;
+        if(max_move <= double(tolerance) * tolerance)
+            break;
+    }
+
+    RebuildExtents();
+    UpdateExtents();
+    cell_stats_valid_.clear();
+    feed_ = feed;
+    FeedEnd(true);
+    return done;
+}
+
+bool VoronoiBase::IsFolded(uint32_t t, uint32_t (&corners)[3])const {
+    Triangle const&tri = tris_[t];
+    const int inf = InfiniteIndex(t);
+    if(inf < 0) {
+        std::copy(tri.v, tri.v + 3, corners);
+        return Orient(sites_[tri.v[0]], sites_[tri.v[1]], sites_[tri.v[2]]) <= 0;
+    }
+    // Outside is to the left of a to b, so the hull turns right at b onto the next edge
+    corners[0] = tri.v[Next(inf)];
+    corners[1] = tri.v[Prev(inf)];
+    Triangle const&next = tris_[tri.n[Next(inf)]];
+    for(unsigned i=0;i<3;++i) {
+        if(next.v[i] != kInfinite && next.v[i] != corners[1])
+            corners[2] = next.v[i];
+    }
+    return Orient(sites_[corners[0]], sites_[corners[1]], sites_[corners[2]]) > 0;
+}
+
+void VoronoiBase::RestoreDelaunay() {
+    flip_stack_.clear();
+    for(uint32_t t=0;t<tris_.size();++t) {
+        if(tris_[t].v[0] == kDead)
+            continue;
+        for(unsigned i=0;i<3;++i) {
+            if(tris_[t].n[i] > t)
+                flip_stack_.push_back(std::make_pair(t, i));
+        }
+    }
+    FlipUntilDelaunay();
+}
+
+void VoronoiBase::FlipUntilDelaunay() {
+    std::vector<std::pair<uint32_t, unsigned> > &stack = flip_stack_;
+    // With exact predicates the flips end, the limit only guards against a bug making them cycle
+    size_t budget = 16 * stack.size() + 64;
+    while(!stack.empty() && budget) {
+        const uint32_t t = stack.back().first;
+        const unsigned i = stack.back().second;
+        stack.pop_back();
+        const uint32_t n = tris_[t].n[i];
+        if(!FlipIfIllegal(t, i))
+            continue;
+        --budget;
+        // The four edges around the new diagonal
+        stack.push_back(std::make_pair(t, 0u));
+        stack.push_back(std::make_pair(t, 2u));
+        stack.push_back(std::make_pair(n, 0u));
+        stack.push_back(std::make_pair(n, 1u));
+    }
+    if(!stack.empty()) {
+        STAT_COUNT(kStatFlipRebuilds, 1);
+        Retriangulate();
+    }
+}
+
+void VoronoiBase::Retriangulate() {
+    // The sites in the triangulation, in the order AddBatch() would insert them
+    std::vector<uint32_t> order;
+    Extrema2f bounds;
+    for(SiteHandle site=0;site<sites_.size();++site) {
+        if(removed_[site] || site_tris_[site] == kNoTriangle)
+            continue;
+        if(order.empty())
+            bounds = Extrema2f(sites_[site], sites_[site]);
+        bounds.DoEnclose(sites_[site]);
+        order.push_back(site);
+    }
+    HilbertSort(order.begin(), order.end(), sites_, bounds);
+    tris_.clear();
+    free_tris_.clear();
+    collinear_.clear();
+    std::fill(site_tris_.begin(), site_tris_.end(), kNoTriangle);
+    for(SiteHandle site : order) {
+        InvalidateCell(site);
+        if(Triangulated())
+            InsertTriangulated(site);
+        else
+            InsertCollinear(site);
+        last_site_ = site;
+    }
+    RebuildExtents();
+    // Too much changed to list
+    if(feed_)
+        feed_dropped_ = true;
+}
+
+bool VoronoiBase::FlipIfIllegal(uint32_t t, unsigned i) {
+    const uint32_t n = tris_[t].n[i];
+    if(InfiniteIndex(t) >= 0 || InfiniteIndex(n) >= 0)
+        return false;
+    Triangle const&tri = tris_[t];
+    unsigned j = 0;
+    while(tris_[n].n[j] != t)
+        ++j;
+    // t is p, a, b and n is q, b, a
+    const uint32_t p = tri.v[i], a = tri.v[Next(i)], b = tri.v[Prev(i)], q = tris_[n].v[j];
+    if(InCircle(sites_[p], sites_[a], sites_[b], sites_[q]) <= 0)
+        return false;
+    // Only the diagonal of a convex quad can be flipped
+    if(Orient(sites_[p], sites_[a], sites_[q]) <= 0 || Orient(sites_[p], sites_[q], sites_[b]) <= 0)
+        return false;
+    STAT_COUNT(kStatFlips, 1);
+
+    const uint32_t t_a = tri.n[Next(i)], t_b = tri.n[Prev(i)];
+    const uint32_t n_a = tris_[n].n[Prev(j)], n_b = tris_[n].n[Next(j)];
+    // t becomes p, a, q and n becomes p, q, b
+    const Triangle first = { { p, a, q }, { n_b, n, t_b } };
+    const Triangle second = { { p, q, b }, { n_a, t_a, t } };
+    FeedKill(t);
+    FeedKill(n);
+    tris_[t] = first;
+    tris_[n] = second;
+    FeedBorn(t);
+    FeedBorn(n);
+    ReplaceNeighbor(n_b, n, t);
+    ReplaceNeighbor(t_a, t, n);
+    site_tris_[p] = site_tris_[a] = site_tris_[q] = t;
+    site_tris_[b] = n;
+    PushExtents(t, Circumcenter(sites_[p], sites_[a], sites_[q]));
+    PushExtents(n, Circumcenter(sites_[p], sites_[q], sites_[b]));
+    InvalidateCell(p);
+    InvalidateCell(a);
+    InvalidateCell(b);
+    InvalidateCell(q);
+    return true;
+}
+
+void VoronoiBase::ReplaceNeighbor(uint32_t t, uint32_t from, uint32_t to) {
+    for(unsigned i=0;i<3;++i) {
+        if(tris_[t].n[i] == from)
+            tris_[t].n[i] = to;
+    }
+}
+
+bool VoronoiBase::Move(SiteHandle site, Vec2f const&pt) {
+    STAT_TIMER(kStatTimeMove);
+    STAT_SCRATCH();
+    if(site >= sites_.size() || removed_[site])
+        return false;
+    if(sites_[site] == pt)
+        return true;
+    // Staying within the triangles around site, pt can't be another site, or they would fold
+    if(!Triangulated() || !MoveWithinStar(site, pt)) {
+        if(Triangulated()) {
+            // As in AddInternal(), a duplicate is a vertex of the triangle the walk ends in,
+            // and the insert starts next to it
+            const uint32_t t = Locate(pt, WalkStart(pt, site));
+            for(unsigned i=0;i<3;++i) {
+                const uint32_t v = tris_[t].v[i];
+                if(v == kInfinite || v == site)
+                    continue;
+                if(sites_[v] == pt)
+                    return false;
+                last_site_ = v;
+            }
+        } else {
+            for(SiteHandle other : collinear_) {
+                if(other != site && sites_[other] == pt)
+                    return false;
+            }
+        }
+        Detach(site);
+        sites_[site] = pt;
+        PushExtents(site | kSiteKey, pt);
+        if(Triangulated())
+            InsertTriangulated(site);
+        else
+            InsertCollinear(site);
+    }
+    last_site_ = site;
+    NoteHint(site);
+    ++generation_;
+    FeedEnd();
+    UpdateExtents();
+    return true;
+}
+
+bool VoronoiBase::MoveWithinStar(SiteHandle site, Vec2f const&pt) {
+    const Vec2f from = sites_[site];
+    sites_[site] = pt;
+    // The triangles around site must stay counter clockwise, and the hull convex at site
+    // and at its neighbors on the hull
+    star_.clear();
+    bool folded = false;
+    uint32_t corners[3];
+    const uint32_t first = site_tris_[site];
+    uint32_t t = first;
+    do {
+        star_.push_back(t);
+        const int inf = InfiniteIndex(t);
+        if(IsFolded(t, corners) || (inf >= 0 && IsFolded(tris_[t].n[Prev(inf)], corners)))
+            folded = true;
+        Triangle const&tri = tris_[t];
+        unsigned i = 0;
+        while(tri.v[i] != site)
+            ++i;
+        t = tri.n[Next(i)];
+    } while(t != first && !folded);
+    if(folded) {
+        sites_[site] = from;
+        return false;
+    }
+
+    // Every circumcircle around site has changed, so any edge of these triangles may flip
+    if(feed_) {
+        // As they were before the move
+        sites_[site] = from;
+        for(uint32_t t : star_)
+            FeedKillTriangle(t);
+        sites_[site] = pt;
+        for(uint32_t t : star_)
+            FeedBornTriangle(t);
+    }
+    flip_stack_.clear();
+    for(uint32_t t : star_) {
+        Triangle const&tri = tris_[t];
+        for(unsigned i=0;i<3;++i) {
+            if(tri.v[i] != kInfinite)
+                InvalidateCell(tri.v[i]);
+            flip_stack_.push_back(std::make_pair(t, i));
+        }
+        if(InfiniteIndex(t) < 0)
+            PushExtents(t, Circumcenter(sites_[tri.v[0]], sites_[tri.v[1]], sites_[tri.v[2]]));
+    }
+    FlipUntilDelaunay();
+    PushExtents(site | kSiteKey, pt);
+    return true;
+}
+
+void VoronoiBase::Detach(SiteHandle site) {
+    InvalidateCell(site);
+    if(!Triangulated()) {
+        auto it = std::find(collinear_.begin(), collinear_.end(), site);
+        if(it != collinear_.begin()) {
+            InvalidateCell(*(it-1));
+            FeedChainEdge(*(it-1), site, false);
+        }
+        if(it+1 != collinear_.end()) {
+            InvalidateCell(*(it+1));
+            FeedChainEdge(site, *(it+1), false);
+        }
+        if(it != collinear_.begin() && it+1 != collinear_.end())
+            FeedChainEdge(*(it-1), *(it+1), true);
+        collinear_.erase(it);
+        if(last_site_ == site && !collinear_.empty())
+            last_site_ = collinear_.front();
+        return;
+    }
+
+    // The edges across from site, counter clockwise around it, bound the hole it leaves
+    hole_.clear();
+    size_t infinite_at = 0;
+    bool on_hull = false;
+    const uint32_t first = site_tris_[site];
+    uint32_t t = first;
+    do {
+        Triangle &tri = tris_[t];
+        unsigned i = 0;
+        while(tri.v[i] != site)
+            ++i;
+        BoundaryEdge edge = { tri.v[Next(i)], tri.v[Prev(i)], tri.n[i], 0 };
+        while(tris_[edge.outside].n[edge.outside_i] != t)
+            ++edge.outside_i;
+        if(edge.a == kInfinite) {
+            on_hull = true;
+            infinite_at = hole_.size();
+        } else {
+            InvalidateCell(edge.a);
+        }
+        hole_.push_back(edge);
+        const uint32_t next = tri.n[Next(i)];
+        FeedKill(t);
+        tri.v[0] = kDead;
+        free_tris_.push_back(t);
+        t = next;
+    } while(t != first);
+    std::rotate(hole_.begin(), hole_.begin() + infinite_at, hole_.end());
+    site_tris_[site] = kNoTriangle;
+    if(last_site_ == site)
+        last_site_ = hole_[on_hull ? 1 : 0].a;
+
+    if(on_hull) {
+        // Nothing is left but the sites around it, all on one line, so back to a chain
+        bool collinear = true;
+        for(size_t k=1;k+1<hole_.size();++k) {
+            if(InfiniteIndex(hole_[k].outside) < 0 ||
+               (k+2 < hole_.size() && Orient(sites_[hole_[k].a], sites_[hole_[k].b], sites_[hole_[k+1].b]) != 0))
+                collinear = false;
+        }
+        if(collinear) {
+            for(uint32_t t=0;t<tris_.size();++t) {
+                if(tris_[t].v[0] != kDead)
+                    FeedKill(t);
+            }
+            collinear_.clear();
+            for(size_t k=1;k<hole_.size();++k) {
+                if(k > 1)
+                    FeedChainEdge(hole_[k-1].a, hole_[k].a, true);
+                collinear_.push_back(hole_[k].a);
+                site_tris_[hole_[k].a] = kNoTriangle;
+            }
+            tris_.clear();
+            free_tris_.clear();
+            return;
+        }
+    }
+
+    // Cut ears until one triangle is left. Any counter clockwise ear holding none of the
+    // other corners keeps the triangulation valid, and the flips after make it Delaunay.
+    // On the hull, once no finite ears are left the rest is convex, and fans to infinity.
+    flip_stack_.clear();
+    while(hole_.size() > 3) {
+        size_t ear = 0;
+        while(ear < hole_.size() && !IsEar(ear))
+            ++ear;
+        if(ear == hole_.size() && !on_hull) {
+            // Only round off gets here, take the most convex corner
+            double best = -DBL_MAX;
+            for(size_t k=0;k<hole_.size();++k) {
+                const double turn = Orient(sites_[hole_[k].a], sites_[hole_[k].b],
+                                           sites_[hole_[(k + 1) % hole_.size()].b]);
+                if(turn > best) {
+                    best = turn;
+                    ear = k;
+                }
+            }
+        }
+        if(ear == hole_.size())
+            ear = 0;
+        ClipEar(ear);
+    }
+    const uint32_t last = NewTriangle(hole_[0].a, hole_[1].a, hole_[2].a);
+    for(unsigned i=0;i<3;++i) {
+        BoundaryEdge const&edge = hole_[i];
+        tris_[last].n[Prev(i)] = edge.outside;
+        tris_[edge.outside].n[edge.outside_i] = last;
+        flip_stack_.push_back(std::make_pair(last, i));
+    }
+    FlipUntilDelaunay();
+}
+
+bool VoronoiBase::IsEar(size_t k)const {
+    const uint32_t a = hole_[k].a, b = hole_[k].b, c = hole_[(k + 1) % hole_.size()].b;
+    if(a == kInfinite || b == kInfinite || c == kInfinite)
+        return false;
+    if(Orient(sites_[a], sites_[b], sites_[c]) <= 0)
+        return false;
+    for(BoundaryEdge const&edge : hole_) {
+        const uint32_t p = edge.a;
+        if(p == kInfinite || p == a || p == b || p == c)
+            continue;
+        Vec2f const&pt = sites_[p];
+        if(Orient(sites_[a], sites_[b], pt) >= 0 && Orient(sites_[b], sites_[c], pt) >= 0 &&
+           Orient(sites_[c], sites_[a], pt) >= 0)
+            return false;
+    }
+    return true;
+}
+
+void VoronoiBase::ClipEar(size_t k) {
+    const size_t k1 = (k + 1) % hole_.size();
+    const BoundaryEdge first = hole_[k], second = hole_[k1];
+    // Across first is n[2], across second n[0], and the new edge stays open for now
+    const uint32_t t = NewTriangle(first.a, first.b, second.b);
+    tris_[t].n[2] = first.outside;
+    tris_[first.outside].n[first.outside_i] = t;
+    tris_[t].n[0] = second.outside;
+    tris_[second.outside].n[second.outside_i] = t;
+    for(unsigned i=0;i<3;++i)
+        flip_stack_.push_back(std::make_pair(t, i));
+    const BoundaryEdge edge = { first.a, second.b, t, 1 };
+    hole_[k] = edge;
+    hole_.erase(hole_.begin() + k1);
+}
+
+void VoronoiBase::CellsInRegion(std::vector<Vec2f> const&polygon, std::vector<SiteHandle> &output)const {
+    STAT_TIMER(kStatTimeCellsInRegion);
+    STAT_SCRATCH();
+    output.clear();
+    if(!NumLiveSites() || polygon.empty())
+        return;
+    if(region_.stamps.size() < sites_.size())
+        region_.stamps.resize(sites_.size(), 0);
+    const uint32_t stamp = ++region_.stamp;
+
+    // The cells touching a connected region are connected, so a fill from any one finds them
+    std::vector<uint32_t> &stack = region_.stack;
+    stack.clear();
+    const SiteHandle start = ClosestSite(polygon.front(), last_site_);
+    stack.push_back(start);
+    region_.stamps[start] = stamp;
+    while(!stack.empty()) {
+        const SiteHandle site = stack.back();
+        stack.pop_back();
+        STAT_COUNT(kStatSitesVisited, 1);
+        output.push_back(site);
+        ForEachNeighbor(site, [&](SiteHandle neighbor) {
+            if(region_.stamps[neighbor] == stamp)
+                return;
+            region_.stamps[neighbor] = stamp;
+            if(CellTouchesPolygon(neighbor, polygon))
+                stack.push_back(neighbor);
+        });
+    }
+}
+
+void VoronoiBase::CellsInRegion(Extrema2f const&box, std::vector<SiteHandle> &output)const {
+    std::vector<Vec2f> &polygon = region_box_;
+    polygon.clear();
+    polygon.push_back(box.mMin);
+    polygon.push_back(Vec2f(box.mMax.x, box.mMin.y));
+    polygon.push_back(box.mMax);
+    polygon.push_back(Vec2f(box.mMin.x, box.mMax.y));
+    CellsInRegion(polygon, output);
+}
+
+void VoronoiBase::GetEdges(std::vector<VoronoiBase::Edge> &output)const {
+    View<Edge> edges = EdgeView();
+    output.insert(output.end(), edges.begin(), edges.end());
+}
+
+VoronoiBase::View<VoronoiBase::Edge> VoronoiBase::EdgeView()const {
+    // Only changes can make it stale, and those are not const, so concurrent calls only race
+    // to build it once
+    std::lock_guard<std::mutex> lock(edge_cache_mutex_.mutex);
+    if(edge_cache_generation_ != generation_) {
+        // clear() keeps the capacity, so rebuilding does not allocate in the steady state
+        edge_cache_.clear();
+        BuildEdges(edge_cache_, edge_ids_);
+        edge_cache_generation_ = generation_;
+    }
+    return View<Edge>(edge_cache_.data(), edge_cache_.data() + edge_cache_.size());
+}
+
+void VoronoiBase::BuildEdges(std::vector<VoronoiBase::Edge> &output, std::vector<uint32_t> &ids)const {
+    ids.assign(3 * tris_.size(), kNoEdge);
+    if(!Triangulated()) {
+        for(size_t i=0;i+1<collinear_.size();++i)
+            output.push_back(MakeSiteEdge(collinear_[i], collinear_[i+1], MakeEdgeExtents(-FLT_MAX, FLT_MAX)));
+        return;
+    }
+    for(uint32_t t=0;t<tris_.size();++t) {
+        Triangle const&tri = tris_[t];
+        if(tri.v[0] == kDead)
+            continue;
+        for(unsigned i=0;i<3;++i) {
+            // Each edge once, from the lesser triangle
+            if(tri.n[i] < t ||
+               tri.v[Next(i)] == kInfinite || tri.v[Prev(i)] == kInfinite ||
+               IsDegenerateEdge(t, i))
+                continue;
+            const uint32_t other = tri.n[i];
+            for(unsigned j=0;j<3;++j) {
+                if(tris_[other].n[j] == t)
+                    ids[3 * other + j] = uint32_t(output.size());
+            }
+            ids[3 * t + i] = uint32_t(output.size());
+            output.push_back(MakeEdge(t, i));
+        }
+    }
+}
+void VoronoiBase::GetPoints(std::vector<Vec2f> &output)const {
+    std::copy(sites_.begin(), sites_.end(), std::back_inserter(output));
+}
+
+const uint32_t VoronoiBase::kSiteKey;
+
+void VoronoiBase::PushExtents(uint32_t key, Vec2f const&pt) {
+    for(unsigned h=0;h<4;++h) {
+        const float value = (h < 2) ? -pt[h % 2] : pt[h % 2];
+        // Nearly degenerate triangles can have no center, which never bounds anything
+        if(value != value)
+            continue;
+        extent_heaps_[h].push_back(ExtentEntry(value, key));
+        std::push_heap(extent_heaps_[h].begin(), extent_heaps_[h].end());
+    }
+}
+
+bool VoronoiBase::IsCurrentExtent(unsigned h, ExtentEntry const&entry)const {
+    Vec2f pt;
+    if(entry.second & kSiteKey) {
+        if(removed_[entry.second & ~kSiteKey])
+            return false;
+        pt = sites_[entry.second & ~kSiteKey];
+    } else {
+        // The slot may since have been reused, which is fine if the center is the same,
+        // or dropped when the triangles went back to a chain
+        if(entry.second >= tris_.size())
+            return false;
+        Triangle const&tri = tris_[entry.second];
+        if(tri.v[0] == kDead ||
+           tri.v[0] == kInfinite || tri.v[1] == kInfinite || tri.v[2] == kInfinite)
+            return false;
+        pt = Circumcenter(sites_[tri.v[0]], sites_[tri.v[1]], sites_[tri.v[2]]);
+    }
+    return ((h < 2) ? -pt[h % 2] : pt[h % 2]) == entry.first;
+}
+
+void VoronoiBase::UpdateExtents() {
+    // Each live site and triangle has one entry, so more than twice that means mostly stale
+    const size_t live = NumLiveSites() + tris_.size() - free_tris_.size();
+    for(std::vector<ExtentEntry> const&heap : extent_heaps_) {
+        if(heap.size() > 2 * live + 64) {
+            RebuildExtents();
+            break;
+        }
+    }
+
+    for(unsigned h=0;h<4;++h) {
+        std::vector<ExtentEntry> &heap = extent_heaps_[h];
+        while(!heap.empty() && !IsCurrentExtent(h, heap.front())) {
+            std::pop_heap(heap.begin(), heap.end());
+            heap.pop_back();
+        }
+    }
+
+    extents_ = Extrema2f(Vec2f(FLT_MAX, FLT_MAX), Vec2f(-FLT_MAX, -FLT_MAX));
+    for(unsigned h=0;h<4;++h) {
+        if(extent_heaps_[h].empty())
+            continue;
+        const float value = extent_heaps_[h].front().first;
+        if(h < 2)
+            extents_.mMin[h % 2] = -value;
+        else
+            extents_.mMax[h % 2] = value;
+    }
+}
+
+void VoronoiBase::RebuildExtents() {
+    for(std::vector<ExtentEntry> &heap : extent_heaps_)
+        heap.clear();
+    for(SiteHandle site=0;site<sites_.size();++site) {
+        if(!removed_[site])
+            PushExtents(site | kSiteKey, sites_[site]);
+    }
+    for(uint32_t t=0;t<tris_.size();++t) {
+        Triangle const&tri = tris_[t];
+        if(tri.v[0] == kDead ||
+           tri.v[0] == kInfinite || tri.v[1] == kInfinite || tri.v[2] == kInfinite)
+            continue;
+        PushExtents(t, Circumcenter(sites_[tri.v[0]], sites_[tri.v[1]], sites_[tri.v[2]]));
+    }
+}
+
+Extrema2f VoronoiBase::GetDiagramDetailExtents()const {
+    return extents_;
+}
+
+void VoronoiBase::ExportTriangulation(Triangulation &output)const {
+    output.triangles.clear();
+    output.neighbors.clear();
+    output.incident.clear();
+    output.incident_offsets.assign(sites_.size() + 1, 0);
+
+    // Dense numbering, skipping dead and infinite triangles
+    std::vector<uint32_t> compact(tris_.size(), Triangulation::kNoNeighbor);
+    uint32_t num_tris = 0;
+    for(uint32_t t=0;t<tris_.size();++t) {
+        if(tris_[t].v[0] != kDead && InfiniteIndex(t) < 0)
+            compact[t] = num_tris++;
+    }
+
+    output.triangles.reserve(num_tris * 3);
+    output.neighbors.reserve(num_tris * 3);
+    for(uint32_t t=0;t<tris_.size();++t) {
+        if(compact[t] == Triangulation::kNoNeighbor)
+            continue;
+        Triangle const&tri = tris_[t];
+        for(unsigned i=0;i<3;++i) {
+            output.triangles.push_back(tri.v[i]);
+            output.neighbors.push_back(compact[tri.n[i]]);
+            ++output.incident_offsets[tri.v[i] + 1];
+        }
+    }
+
+    // Counting sort by site
+    for(size_t s=0;s<sites_.size();++s)
+        output.incident_offsets[s + 1] += output.incident_offsets[s];
+    output.incident.resize(num_tris * 3);
+    std::vector<uint32_t> fill(output.incident_offsets.begin(), output.incident_offsets.end() - 1);
+    for(uint32_t t=0;t<num_tris;++t) {
+        for(unsigned i=0;i<3;++i)
+            output.incident[fill[output.triangles[3*t+i]]++] = t;
+    }
+}
+
+void VoronoiBase::RasterizeNearest(Extrema2f const&bounds,
+                                   uint32_t width, uint32_t height,
+                                   uint32_t *ids, float *dist)const {
+    STAT_TIMER(kStatTimeRaster);
+    const size_t num_pixels = size_t(width) * height;
+    if(!NumLiveSites() || num_pixels == 0) {
+        std::fill(ids, ids + num_pixels, kNoSite);
+        if(dist)
+            std::fill(dist, dist + num_pixels, FLT_MAX);
+        return;
+    }
+
+    const Vec2f pixel = bounds.GetSize() / Vec2f(float(width), float(height));
+    auto pixel_x = [&](uint32_t col) { return bounds.mMin.x + (col + 0.5f) * pixel.x; };
+    auto pixel_y = [&](uint32_t row) { return bounds.mMin.y + (row + 0.5f) * pixel.y; };
+
+    // Sites bucketed by the pixel column they fall in, sorted by y within a column.
+    // Sites outside of bounds go in the first or last column.
+    std::vector<uint32_t> column_offsets(width + 1, 0);
+    std::vector<uint32_t> site_columns(sites_.size());
+    for(SiteHandle s=0;s<sites_.size();++s) {
+        if(removed_[s])
+            continue;
+        const float col = std::floor((sites_[s].x - bounds.mMin.x) / pixel.x);
+        site_columns[s] = uint32_t(std::max(0.0f, std::min(float(width - 1), col)));
+        ++column_offsets[site_columns[s] + 1];
+    }
+    bool shared_column = false;
+    for(uint32_t col=0;col<width;++col) {
+        shared_column = shared_column || (column_offsets[col + 1] > 1);
+        column_offsets[col + 1] += column_offsets[col];
+    }
+    std::vector<SiteHandle> column_sites(sites_.size());
+    {
+        std::vector<uint32_t> fill(column_offsets.begin(), column_offsets.end() - 1);
+        for(SiteHandle s=0;s<sites_.size();++s) {
+            if(!removed_[s])
+                column_sites[fill[site_columns[s]]++] = s;
+        }
+    }
+
+    // Columns: closest site in each column's bucket, for every pixel in the column.
+    // The vertical envelope uses the true horizontal offset of each site from the column,
+    // so with at most one site per column this is exact.
+    ParallelFor(width, [&](uint32_t col_begin, uint32_t col_end) {
+        std::vector<double> q, h;
+        ParabolaEnvelope envelope;
+        for(uint32_t col=col_begin;col<col_end;++col) {
+            const auto begin = column_sites.begin() + column_offsets[col];
+            const auto end = column_sites.begin() + column_offsets[col + 1];
+            if(begin == end) {
+                for(uint32_t row=0;row<height;++row)
+                    ids[size_t(row) * width + col] = kNoSite;
+                continue;
+            }
+            std::sort(begin, end, [&](SiteHandle a, SiteHandle b) {
+                return sites_[a].y < sites_[b].y;
+            });
+            const double x = pixel_x(col);
+            q.clear();
+            h.clear();
+            for(auto it = begin; it != end; ++it) {
+                q.push_back(sites_[*it].y);
+                h.push_back((sites_[*it].x - x) * (sites_[*it].x - x));
+            }
+            envelope.Build(q, h);
+            for(uint32_t row=0;row<height;++row)
+                ids[size_t(row) * width + col] = *(begin + envelope.Lowest(pixel_y(row)));
+        }
+    });
+
+    // With several sites in a column, the column pass can pick the wrong one for pixels
+    // away from the column. Finish those with a walk, since a site is the closest one iff
+    // none of its Delaunay neighbors is closer.
+    std::vector<uint32_t> neighbor_offsets;
+    std::vector<SiteHandle> neighbors;
+    if(shared_column)
+        BuildNeighborLists(neighbor_offsets, neighbors);
+
+    // Rows: lower envelope of each column's candidate, at its true position
+    ParallelFor(height, [&](uint32_t row_begin, uint32_t row_end) {
+        std::vector<double> q, h;
+        std::vector<SiteHandle> candidates;
+        ParabolaEnvelope envelope;
+        for(uint32_t row=row_begin;row<row_end;++row) {
+            uint32_t *row_ids = ids + size_t(row) * width;
+            const double y = pixel_y(row);
+            q.clear();
+            h.clear();
+            candidates.clear();
+            // Columns hold disjoint ranges of x, so the candidates are already sorted
+            for(uint32_t col=0;col<width;++col) {
+                const SiteHandle s = row_ids[col];
+                if(s == kNoSite)
+                    continue;
+                candidates.push_back(s);
+                q.push_back(sites_[s].x);
+                h.push_back((sites_[s].y - y) * (sites_[s].y - y));
+            }
+            envelope.Build(q, h);
+            for(uint32_t col=0;col<width;++col) {
+                const Vec2f pt(pixel_x(col), float(y));
+                SiteHandle site = candidates[envelope.Lowest(pt.x)];
+                float site_dist = (sites_[site] - pt).SquaredLength();
+                for(bool moved = shared_column;moved;) {
+                    moved = false;
+                    const SiteHandle from = site;
+                    for(uint32_t n=neighbor_offsets[from];n<neighbor_offsets[from + 1];++n) {
+                        const float this_dist = (sites_[neighbors[n]] - pt).SquaredLength();
+                        if(this_dist < site_dist) {
+                            site_dist = this_dist;
+                            site = neighbors[n];
+                            moved = true;
+                        }
+                    }
+                }
+                row_ids[col] = site;
+                if(dist)
+                    dist[size_t(row) * width + col] = std::sqrt(site_dist);
+            }
+        }
+    });
+}
+
+void VoronoiBase::BuildNeighborLists(std::vector<uint32_t> &offsets, std::vector<SiteHandle> &neighbors)const {
+    offsets.clear();
+    neighbors.clear();
+    offsets.reserve(sites_.size() + 1);
+    neighbors.reserve(sites_.size() * 6);
+    offsets.push_back(0);
+    for(SiteHandle s=0;s<sites_.size();++s) {
+        if(!removed_[s]) {
+            ForEachNeighbor(s, [&](SiteHandle neighbor) {
+                neighbors.push_back(neighbor);
+            });
+        }
+        offsets.push_back(uint32_t(neighbors.size()));
+    }
+}
+
+VoronoiBase::SiteHandle VoronoiBase::WalkBruteClosest(Vec2f const&pt, SiteHandle start,
+                                                      std::vector<uint32_t> const&offsets,
+                                                      std::vector<SiteHandle> const&neighbors,
+                                                      std::vector<SiteHandle> &visited)const {
+    auto exact_dist = [&](SiteHandle s) {
+        const double dx = double(sites_[s].x) - pt.x, dy = double(sites_[s].y) - pt.y;
+        return dx * dx + dy * dy;
+    };
+    // Greedy walk to the closest site
+    SiteHandle site = start;
+    double dist = exact_dist(site);
+    for(bool moved = true;moved;) {
+        moved = false;
+        const SiteHandle from = site;
+        for(uint32_t n=offsets[from];n<offsets[from + 1];++n) {
+            const double this_dist = exact_dist(neighbors[n]);
+            if(this_dist < dist) {
+                dist = this_dist;
+                site = neighbors[n];
+                moved = true;
+            }
+        }
+    }
+
+    // BruteClosest() compares rounded float lengths and keeps the lowest handle,
+    // so look through every site which is about as close. They are all near one empty
+    // circle around pt, and so connected by Delaunay edges.
+    const double max_dist = dist * (1.0 + 1e-5);
+    visited.clear();
+    visited.push_back(site);
+    SiteHandle best = site;
+    float best_length = (sites_[site] - pt).Length();
+    for(size_t i=0;i<visited.size();++i) {
+        const SiteHandle from = visited[i];
+        for(uint32_t n=offsets[from];n<offsets[from + 1];++n) {
+            const SiteHandle neighbor = neighbors[n];
+            if(exact_dist(neighbor) > max_dist ||
+               std::find(visited.begin(), visited.end(), neighbor) != visited.end())
+                continue;
+            visited.push_back(neighbor);
+            const float length = (sites_[neighbor] - pt).Length();
+            if(length < best_length || (length == best_length && neighbor < best)) {
+                best_length = length;
+                best = neighbor;
+            }
+        }
+    }
+    return best;
+}
+
+void VoronoiBase::RasterizeCells(Extrema2f const&bounds,
+                                 uint32_t width, uint32_t height,
+                                 uint32_t *ids)const {
+    STAT_TIMER(kStatTimeRaster);
+    const size_t num_pixels = size_t(width) * height;
+    std::fill(ids, ids + num_pixels, kNoSite);
+    if(!NumLiveSites() || num_pixels == 0)
+        return;
+
+    const Vec2f pixel = bounds.GetSize() / Vec2f(float(width), float(height));
+    auto pixel_x = [&](uint32_t col) { return bounds.mMin.x + (col + 0.5f) * pixel.x; };
+    auto pixel_y = [&](uint32_t row) { return bounds.mMin.y + (row + 0.5f) * pixel.y; };
+
+    std::vector<uint32_t> neighbor_offsets;
+    std::vector<SiteHandle> neighbors;
+    BuildNeighborLists(neighbor_offsets, neighbors);
+
+    // Each cell is the intersection of n.p <= c, one per Delaunay neighbor.
+    // Pixels with n.p <= inner for every neighbor are certainly in the cell, whatever
+    // the rounding in BruteClosest(). The rest, up to n.p <= outer, are tested.
+    struct HalfPlane {
+        double nx, ny;
+        double inner, outer;
+    };
+    std::vector<HalfPlane> planes(neighbors.size());
+    // Clipped cell bounds, in rows. Empty if the cell misses bounds.
+    std::vector<uint32_t> cell_rows(sites_.size() * 2, 0);
+
+    const double scale = std::max(std::max(std::fabs(bounds.mMin.x), std::fabs(bounds.mMax.x)),
+                                  std::max(std::fabs(bounds.mMin.y), std::fabs(bounds.mMax.y)));
+    const Vec2f corners[4] = {
+        bounds.mMin, Vec2f(bounds.mMax.x, bounds.mMin.y),
+        bounds.mMax, Vec2f(bounds.mMin.x, bounds.mMax.y)
+    };
+    std::vector<std::pair<double, double> > poly, clipped;
+    for(SiteHandle s=0;s<sites_.size();++s) {
+        if(removed_[s])
+            continue;
+        const double sx = sites_[s].x, sy = sites_[s].y;
+
+        // Cell clipped to bounds, with the bisectors as they are
+        poly.clear();
+        for(Vec2f const&corner : corners)
+            poly.push_back(std::make_pair(double(corner.x), double(corner.y)));
+        for(uint32_t n=neighbor_offsets[s];n<neighbor_offsets[s + 1];++n) {
+            Vec2f const&t = sites_[neighbors[n]];
+            HalfPlane &plane = planes[n];
+            plane.nx = double(t.x) - sx;
+            plane.ny = double(t.y) - sy;
+            plane.inner = plane.outer = plane.nx * (sx + t.x) * 0.5 + plane.ny * (sy + t.y) * 0.5;
+            ClipToHalfPlane(poly, plane.nx, plane.ny, plane.outer, clipped);
+            poly.swap(clipped);
+        }
+
+        // Furthest a pixel center of this cell can be from the site, with some slack
+        double reach = 0;
+        double min_y = DBL_MAX, max_y = -DBL_MAX;
+        for(auto const&pt : poly) {
+            reach = std::max(reach, (pt.first - sx) * (pt.first - sx) + (pt.second - sy) * (pt.second - sy));
+            min_y = std::min(min_y, pt.second);
+            max_y = std::max(max_y, pt.second);
+        }
+        reach = std::sqrt(reach) + pixel.x + pixel.y;
+
+        // The difference in distance to s and t is at least the distance to the bisector
+        // times length / (2 * reach + length). Keep that well above float error in both.
+        double max_margin = 0;
+        for(uint32_t n=neighbor_offsets[s];n<neighbor_offsets[s + 1];++n) {
+            HalfPlane &plane = planes[n];
+            const double length = std::sqrt(plane.nx * plane.nx + plane.ny * plane.ny);
+            const double error = 8.0 * FLT_EPSILON * (2.0 * reach + length + 2.0 * scale);
+            const double margin = error * (2.0 * reach + length);
+            plane.inner -= margin;
+            plane.outer += margin;
+            max_margin = std::max(max_margin, margin / length);
+        }
+        // Skipping a cell is always safe, since its pixels are then tested
+        if(poly.empty())
+            continue;
+        min_y -= max_margin;
+        max_y += max_margin;
+        // One row of slack either way, for the rounding of pixel centers
+        const double first = std::ceil((min_y - bounds.mMin.y) / pixel.y - 0.5) - 1;
+        const double last = std::floor((max_y - bounds.mMin.y) / pixel.y - 0.5) + 1;
+        cell_rows[2 * s] = uint32_t(std::max(0.0, first));
+        cell_rows[2 * s + 1] = uint32_t(std::max(0.0, std::min(double(height) - 1, last)) + 1);
+    }
+
+    // Cells touching each band of rows
+    static const uint32_t kBandRows = 32;
+    const uint32_t num_bands = (height + kBandRows - 1) / kBandRows;
+    std::vector<uint32_t> band_offsets(num_bands + 1, 0);
+    for(SiteHandle s=0;s<sites_.size();++s) {
+        if(cell_rows[2 * s] >= cell_rows[2 * s + 1])
+            continue;
+        for(uint32_t band = cell_rows[2 * s] / kBandRows;band <= (cell_rows[2 * s + 1] - 1) / kBandRows;++band)
+            ++band_offsets[band + 1];
+    }
+    for(uint32_t band=0;band<num_bands;++band)
+        band_offsets[band + 1] += band_offsets[band];
+    std::vector<SiteHandle> band_cells(band_offsets.back());
+    {
+        std::vector<uint32_t> fill(band_offsets.begin(), band_offsets.end() - 1);
+        for(SiteHandle s=0;s<sites_.size();++s) {
+            if(cell_rows[2 * s] >= cell_rows[2 * s + 1])
+                continue;
+            for(uint32_t band = cell_rows[2 * s] / kBandRows;band <= (cell_rows[2 * s + 1] - 1) / kBandRows;++band)
+                band_cells[fill[band]++] = s;
+        }
+    }
+
+    // Walks which no cell starts go from a live site, removed ones have no neighbors
+    SiteHandle live = last_site_;
+    if(live >= sites_.size() || removed_[live]) {
+        live = 0;
+        while(removed_[live])
+            ++live;
+    }
+    ParallelFor(num_bands, [&](uint32_t band_begin, uint32_t band_end) {
+        std::vector<SiteHandle> visited;
+        for(uint32_t band=band_begin;band<band_end;++band) {
+            const uint32_t band_first = band * kBandRows;
+            const uint32_t band_last = std::min(height, band_first + kBandRows);
+            for(uint32_t c=band_offsets[band];c<band_offsets[band + 1];++c) {
+                const SiteHandle s = band_cells[c];
+                const uint32_t first_row = std::max(band_first, cell_rows[2 * s]);
+                const uint32_t last_row = std::min(band_last, cell_rows[2 * s + 1]);
+                for(uint32_t row=first_row;row<last_row;++row) {
+                    const float y = pixel_y(row);
+                    // Spans of x inside every inner and outer plane
+                    double inner_min = -DBL_MAX, inner_max = DBL_MAX;
+                    double outer_min = -DBL_MAX, outer_max = DBL_MAX;
+                    for(uint32_t n=neighbor_offsets[s];n<neighbor_offsets[s + 1];++n) {
+                        HalfPlane const&plane = planes[n];
+                        const double inner = plane.inner - plane.ny * y;
+                        const double outer = plane.outer - plane.ny * y;
+                        if(plane.nx > 0) {
+                            inner_max = std::min(inner_max, inner / plane.nx);
+                            outer_max = std::min(outer_max, outer / plane.nx);
+                        } else if(plane.nx < 0) {
+                            inner_min = std::max(inner_min, inner / plane.nx);
+                            outer_min = std::max(outer_min, outer / plane.nx);
+                        } else {
+                            if(inner < 0)
+                                inner_max = -DBL_MAX;
+                            if(outer < 0)
+                                outer_max = -DBL_MAX;
+                        }
+                    }
+                    if(outer_min > outer_max)
+                        continue;
+
+                    // Columns whose centers may be in the span, with one column of slack
+                    auto first_col = [&](double x) {
+                        return std::max(0.0, std::min(double(width), std::ceil((x - bounds.mMin.x) / pixel.x - 0.5) + 1));
+                    };
+                    auto end_col = [&](double x) {
+                        return std::max(0.0, std::min(double(width), std::floor((x - bounds.mMin.x) / pixel.x - 0.5)));
+                    };
+                    const uint32_t outer_begin = uint32_t(std::max(0.0, first_col(outer_min) - 2));
+                    const uint32_t outer_end = uint32_t(std::min(double(width), end_col(outer_max) + 2));
+                    uint32_t inner_begin = outer_end, inner_end = outer_end;
+                    if(inner_min <= inner_max) {
+                        inner_begin = std::max(outer_begin, uint32_t(first_col(inner_min)));
+                        inner_end = std::max(inner_begin, std::min(outer_end, uint32_t(end_col(inner_max))));
+                    }
+
+                    uint32_t *row_ids = ids + size_t(row) * width;
+                    std::fill(row_ids + inner_begin, row_ids + inner_end, s);
+                    for(uint32_t col=outer_begin;col<outer_end;++col) {
+                        if(col == inner_begin)
+                            col = inner_end;
+                        if(col >= outer_end)
+                            break;
+                        if(row_ids[col] == kNoSite)
+                            row_ids[col] = WalkBruteClosest(Vec2f(pixel_x(col), y), s,
+                                                            neighbor_offsets, neighbors, visited);
+                    }
+                }
+            }
+            // Pixels missed by every cell, if rounding left any, walk from the pixel before
+            for(uint32_t row=band_first;row<band_last;++row) {
+                uint32_t *row_ids = ids + size_t(row) * width;
+                for(uint32_t col=0;col<width;++col) {
+                    if(row_ids[col] != kNoSite)
+                        continue;
+                    const SiteHandle start = (col > 0 && row_ids[col - 1] != kNoSite) ? row_ids[col - 1] : live;
+                    row_ids[col] = WalkBruteClosest(Vec2f(pixel_x(col), pixel_y(row)), start,
+                                                    neighbor_offsets, neighbors, visited);
+                }
+            }
+        }
+    });
+}
+
+void VoronoiBase::RasterizeQuadtree(Extrema2f const&bounds,
+                                    uint32_t width, uint32_t height,
+                                    uint32_t *ids)const {
+    STAT_TIMER(kStatTimeRaster);
+    const size_t num_pixels = size_t(width) * height;
+    if(!NumLiveSites() || num_pixels == 0) {
+        std::fill(ids, ids + num_pixels, kNoSite);
+        return;
+    }
+
+    const Vec2f pixel = bounds.GetSize() / Vec2f(float(width), float(height));
+    static const uint32_t kTile = 64;
+    const uint32_t tile_cols = (width + kTile - 1) / kTile;
+    const uint32_t tile_rows = (height + kTile - 1) / kTile;
+    QuadtreeRaster<uint32_t> raster(width, height, 1, ids);
+    ParallelFor(tile_cols * tile_rows, [&](uint32_t tile_begin, uint32_t tile_end) {
+        // Each corner walks from the last one, which is usually in the same cell or next to it
+        SiteHandle hint = last_site_;
+        auto eval = [&](uint32_t col, uint32_t row) {
+            const Vec2f pt(bounds.mMin.x + (col + 0.5f) * pixel.x,
+                           bounds.mMin.y + (row + 0.5f) * pixel.y);
+            hint = ClosestSite(pt, hint);
+            return hint;
+        };
+        for(uint32_t tile=tile_begin;tile<tile_end;++tile) {
+            const uint32_t col = (tile % tile_cols) * kTile;
+            const uint32_t row = (tile / tile_cols) * kTile;
+            raster.Fill(col, row, std::min(width, col + kTile), std::min(height, row + kTile), eval);
+        }
+    });
+}
+
+VoronoiBase::SiteHandle VoronoiBase::BruteClosest(Vec2f const&pt)const {
+    STAT_TIMER(kStatTimeBruteClosest);
+    STAT_COUNT(kStatBruteDistances, sites_.size());
+    SiteHandle ret = kNoSite;
+    float dist = FLT_MAX;
+    for (SiteHandle site = 0; site < sites_.size(); ++site) {
+        if (removed_[site])
+            continue;
+        float this_dist = (sites_[site] - pt).Length();
+        if (this_dist < dist) {
+            dist = this_dist;
+            ret = site;
+        }
+    }
+    return ret;
+}
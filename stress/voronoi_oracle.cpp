@@ -0,0 +1,1323 @@
+//
+//  voronoi_oracle.cpp
+//  stress
+//
+//  Randomized differential checks of the fast paths against brute force references.
+//  Failing inputs are shrunk and printed in the points.push_back(Vec2f(...)) form.
+//
+//  usage: voronoi_oracle [--cases=20000] [--max-n=200] [--seed=1] [--threads=N]
+//                        [--checks=closest,edges,...] [--include-known-failures] [--max-reports=3]
+//
+//  Checks of code known to be wrong are only run if named in --checks or with
+//  --include-known-failures, so the default run passes.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Vec2f.h"
+#include "voronoi.h"
+#include "closest_point.h"
+#include "datasets.h"
+
+using namespace std;
+
+namespace {
+struct CheckResult {
+    CheckResult() : checks(0), failures(0) { }
+
+    size_t checks;
+    size_t failures;
+    // First failure, for the report
+    string detail;
+
+    void Fail(string const&what) {
+        if(!failures)
+            detail = what;
+        ++failures;
+    }
+};
+
+// Every check is a deterministic function of the points and the seed, so it can be
+// rerun on smaller inputs while shrinking
+typedef CheckResult (*CheckFunction)(vector<Vec2f> const&pts, uint32_t seed);
+
+struct Check {
+    const char *name;
+    CheckFunction function;
+    // Fails on the default cases, so not run by default
+    bool known_failure;
+};
+
+// Simple and reproducible, for the queries
+class Random {
+public:
+    Random(uint32_t seed) : state_(seed * 2654435761u + 1) { }
+    inline uint32_t Next() {
+        state_ ^= state_ << 13;
+        state_ ^= state_ >> 17;
+        state_ ^= state_ << 5;
+        return state_;
+    }
+    inline float Unit() {
+        return float(Next() >> 8) * (1.0f / 16777216.0f);
+    }
+private:
+    uint32_t state_;
+};
+
+Extrema2f Bounds(vector<Vec2f> const&pts) {
+    Extrema2f bounds(pts.front(), pts.front());
+    for(Vec2f const&pt : pts)
+        bounds.DoEnclose(pt);
+    // Some room around the sites, and never empty
+    const Vec2f size = bounds.GetSize();
+    const float pad = std::max(std::max(size.x, size.y) * 0.25f, 0.01f);
+    return Extrema2f(bounds.mMin - Vec2f(pad, pad), bounds.mMax + Vec2f(pad, pad));
+}
+
+Vec2f RandomIn(Extrema2f const&bounds, Random &random) {
+    const float x = random.Unit();
+    return bounds.mMin + Vec2f(x, random.Unit()) * bounds.GetSize();
+}
+
+void Build(vector<Vec2f> const&pts, uint32_t seed, Voronoi<> &voronoi) {
+    // Both insertion paths
+    if(seed & 1) {
+        voronoi.AddRange(pts.begin(), pts.end());
+    } else {
+        for(Vec2f const&pt : pts)
+            voronoi.Add(pt);
+    }
+}
+
+double SquaredDistance(Vec2f const&a, Vec2f const&b) {
+    const double dx = double(a.x) - b.x, dy = double(a.y) - b.y;
+    return dx * dx + dy * dy;
+}
+
+// Equal up to float rounding of the distances
+bool SameDistance(double a, double b) {
+    return ::fabs(a - b) <= 1e-5 * std::max(a, b) + 1e-30;
+}
+
+string Describe(const char *format, float a, float b) {
+    char buf[128];
+    snprintf(buf, sizeof(buf), format, a, b);
+    return buf;
+}
+
+CheckResult CheckClosest(vector<Vec2f> const&pts, uint32_t seed) {
+    CheckResult result;
+    Voronoi<> voronoi;
+    Build(pts, seed, voronoi);
+    const Extrema2f bounds = Bounds(pts);
+    Random random(seed);
+    for(int i=0;i<256;++i) {
+        const Vec2f q = RandomIn(bounds, random);
+        const double fast = SquaredDistance(voronoi.Position(voronoi.Closest(q)), q);
+        const double brute = SquaredDistance(voronoi.Position(voronoi.BruteClosest(q)), q);
+        ++result.checks;
+        if(!SameDistance(fast, brute))
+            result.Fail(Describe("Closest(%f,%f) is not the closest site", q.x, q.y));
+    }
+    return result;
+}
+
+// Points along every edge are as close to its sites as to any other, which is
+// what BruteIsBetweenNeighbors() tests
+CheckResult CheckEdges(vector<Vec2f> const&pts, uint32_t seed) {
+    CheckResult result;
+    Voronoi<> voronoi;
+    Build(pts, seed, voronoi);
+    const Extrema2f bounds = Bounds(pts);
+    const float max_dim = std::max(bounds.GetSize().x, bounds.GetSize().y);
+    for(Voronoi<>::Edge const&edge : voronoi.EdgeView()) {
+        ++result.checks;
+        if(edge.site_a >= voronoi.NumSites() || edge.site_b >= voronoi.NumSites() ||
+           !(voronoi.Position(edge.site_a) == edge.pt_a) || !(voronoi.Position(edge.site_b) == edge.pt_b)) {
+            result.Fail(Describe("Edge handles do not match its points at %f,%f", edge.pt_a.x, edge.pt_a.y));
+            continue;
+        }
+        // Rays run max_dim past their vertex, min_pt() and max_pt() can turn back from it
+        const float lo = edge.extents.mMin[0], hi = edge.extents.mMax[0];
+        const float t0 = (lo != -FLT_MAX) ? lo : ((hi != FLT_MAX) ? hi : 0) - max_dim;
+        const float t1 = (hi != FLT_MAX) ? hi : ((lo != -FLT_MAX) ? lo : 0) + max_dim;
+        for(float f : {0.25f, 0.5f, 0.75f}) {
+            const Vec2f pt = edge.mid() + edge.dir() * (t0 + (t1 - t0) * f);
+            // The edge ends are rounded to float, so allow for that in the units of the coordinates
+            const double tolerance = 1e-5 * std::max(1.0f, std::max(::fabsf(pt.x), ::fabsf(pt.y)));
+            const double to_edge = ::sqrt(SquaredDistance(edge.pt_a, pt));
+            const double closest = ::sqrt(SquaredDistance(voronoi.Position(voronoi.BruteClosest(pt)), pt));
+            ++result.checks;
+            if(to_edge - closest > tolerance)
+                result.Fail(Describe("Edge point %f,%f is closer to another site", pt.x, pt.y));
+        }
+    }
+    return result;
+}
+
+CheckResult CheckNeighbors(vector<Vec2f> const&pts, uint32_t seed) {
+    CheckResult result;
+    Voronoi<> voronoi;
+    Build(pts, seed, voronoi);
+    vector<vector<Voronoi<>::SiteHandle> > neighbors(voronoi.NumSites());
+    for(Voronoi<>::SiteHandle s=0;s<voronoi.NumSites();++s)
+        voronoi.NeighboringPoints(s, neighbors[s]);
+    for(Voronoi<>::SiteHandle s=0;s<voronoi.NumSites();++s) {
+        for(Voronoi<>::SiteHandle n : neighbors[s]) {
+            ++result.checks;
+            if(std::find(neighbors[n].begin(), neighbors[n].end(), s) == neighbors[n].end())
+                result.Fail(Describe("Neighbors of %f,%f are not symmetric", voronoi.Position(s).x, voronoi.Position(s).y));
+        }
+    }
+    return result;
+}
+
+// Smallest of |q - new_pt|^2 - |q - pt_a|^2 over the points q of the edge, as in double
+// as the edge allows. -DBL_MAX if it is unbounded below, 0 if too close to call.
+double MinAffected(Voronoi<>::Edge const&edge, Vec2f const&new_pt) {
+    const Vec2f mid = edge.mid(), dir = edge.dir();
+    const double c0 = SquaredDistance(mid, new_pt) - SquaredDistance(mid, edge.pt_a);
+    const double c1 = 2.0 * ((double(edge.pt_a.x) - new_pt.x) * dir.x + (double(edge.pt_a.y) - new_pt.y) * dir.y);
+    const double lo = edge.extents.mMin[0], hi = edge.extents.mMax[0];
+    // Along a ray, only the sign of c1 matters, and float can not tell it near 0
+    const double c1_error = 1e-5 * ::sqrt(SquaredDistance(edge.pt_a, new_pt));
+    if((lo == -FLT_MAX || hi == FLT_MAX) && ::fabs(c1) < c1_error)
+        return 0;
+    if(c1 > 0)
+        return (lo == -FLT_MAX) ? -DBL_MAX : c0 + c1 * lo;
+    if(c1 < 0)
+        return (hi == FLT_MAX) ? -DBL_MAX : c0 + c1 * hi;
+    return c0;
+}
+
+// Every edge of the diagram which would lose some of its points to a new site
+CheckResult CheckAffected(vector<Vec2f> const&pts, uint32_t seed) {
+    CheckResult result;
+    Voronoi<> voronoi;
+    Build(pts, seed, voronoi);
+    const Extrema2f bounds = Bounds(pts);
+    const float scale = std::max(bounds.GetSize().x, bounds.GetSize().y);
+    Random random(seed);
+    vector<Voronoi<>::Edge> affected;
+    set<pair<uint32_t, uint32_t> > fast;
+    for(int q=0;q<16;++q) {
+        // Sometimes right on a site
+        const Vec2f new_pt = (q == 0) ? pts[seed % pts.size()] : RandomIn(bounds, random);
+        voronoi.EdgesAffectedByAdd(new_pt, affected);
+        fast.clear();
+        for(Voronoi<>::Edge const&edge : affected)
+            fast.insert(make_pair(edge.site_a, edge.site_b));
+        ++result.checks;
+        if(fast.size() != affected.size())
+            result.Fail(Describe("EdgesAffectedByAdd(%f,%f) gave an edge twice", new_pt.x, new_pt.y));
+        const bool duplicate = voronoi.Position(voronoi.BruteClosest(new_pt)) == new_pt;
+        for(Voronoi<>::Edge const&edge : voronoi.EdgeView()) {
+            const double min_affected = MinAffected(edge, new_pt);
+            // Too close to call in float
+            if(::fabs(min_affected) < 1e-5 * scale * scale)
+                continue;
+            const bool brute = !duplicate && min_affected < 0;
+            ++result.checks;
+            if(brute != (fast.count(make_pair(edge.site_a, edge.site_b)) != 0))
+                result.Fail(Describe(brute ? "EdgesAffectedByAdd(%f,%f) missed an edge" :
+                                             "EdgesAffectedByAdd(%f,%f) gave an unaffected edge", new_pt.x, new_pt.y));
+        }
+    }
+    return result;
+}
+
+// The batch gives the same edges as one call per point
+CheckResult CheckAffectedBatch(vector<Vec2f> const&pts, uint32_t seed) {
+    CheckResult result;
+    Voronoi<> voronoi;
+    Build(pts, seed, voronoi);
+    const Extrema2f bounds = Bounds(pts);
+    Random random(seed);
+    vector<Vec2f> candidates;
+    for(int q=0;q<600;++q)
+        candidates.push_back((q % 50 == 0) ? pts[(seed + q) % pts.size()] : RandomIn(bounds, random));
+    Voronoi<>::AffectedEdges batch;
+    voronoi.EdgesAffectedByAddBatch(candidates, batch);
+    const Voronoi<>::View<Voronoi<>::Edge> edges = voronoi.EdgeView();
+    vector<Voronoi<>::Edge> affected;
+    for(size_t c=0;c<candidates.size();++c) {
+        voronoi.EdgesAffectedByAdd(candidates[c], affected);
+        set<pair<uint32_t, uint32_t> > single, batched;
+        for(Voronoi<>::Edge const&edge : affected)
+            single.insert(make_pair(edge.site_a, edge.site_b));
+        for(uint32_t e=batch.offsets[c];e<batch.offsets[c + 1];++e) {
+            if(batch.edges[e] < edges.size())
+                batched.insert(make_pair(edges[batch.edges[e]].site_a, edges[batch.edges[e]].site_b));
+        }
+        ++result.checks;
+        if(single != batched || batched.size() != batch.offsets[c + 1] - batch.offsets[c])
+            result.Fail(Describe("EdgesAffectedByAddBatch() differs at %f,%f", candidates[c].x, candidates[c].y));
+    }
+    return result;
+}
+
+// Same rounding as the library, so the extents can be compared exactly
+Vec2f Circumcenter(Vec2f const&a, Vec2f const&b, Vec2f const&c) {
+    const double bx = double(b.x) - a.x, by = double(b.y) - a.y;
+    const double cx = double(c.x) - a.x, cy = double(c.y) - a.y;
+    const double d = 2.0 * (bx * cy - by * cx);
+    const double b2 = bx * bx + by * by;
+    const double c2 = cx * cx + cy * cy;
+    return Vec2f(float(a.x + (cy * b2 - by * c2) / d),
+                 float(a.y + (bx * c2 - cx * b2) / d));
+}
+
+// The extents kept up to date by each insert are those of the sites and all circumcenters
+CheckResult CheckExtents(vector<Vec2f> const&pts, uint32_t seed) {
+    CheckResult result;
+    Voronoi<> voronoi;
+    // Some of the points in one batch, the rest one at a time
+    const size_t batch = (seed & 1) ? pts.size() / 2 : 0;
+    voronoi.AddRange(pts.begin(), pts.begin() + batch);
+    Voronoi<>::Triangulation triangulation;
+    for(size_t i=batch;i<=pts.size();++i) {
+        if(i > batch)
+            voronoi.Add(pts[i - 1]);
+        if(!voronoi.NumSites())
+            continue;
+        vector<Vec2f> sites;
+        voronoi.GetPoints(sites);
+        Extrema2f brute(sites.front(), sites.front());
+        for(Vec2f const&site : sites)
+            brute.DoEnclose(site);
+        triangulation = Voronoi<>::Triangulation();
+        voronoi.ExportTriangulation(triangulation);
+        for(size_t t=0;t+2<triangulation.triangles.size();t+=3) {
+            brute.DoEnclose(Circumcenter(sites[triangulation.triangles[t]],
+                                         sites[triangulation.triangles[t + 1]],
+                                         sites[triangulation.triangles[t + 2]]));
+        }
+        const Extrema2f fast = voronoi.GetDiagramDetailExtents();
+        ++result.checks;
+        if(fast.mMin != brute.mMin || fast.mMax != brute.mMax)
+            result.Fail(Describe("Extents after adding %f,%f are not exact", pts[i - 1].x, pts[i - 1].y));
+    }
+    return result;
+}
+
+// Pixel centers, as the rasterizers use them
+static const uint32_t kRasterWidth = 64, kRasterHeight = 48;
+Vec2f PixelCenter(Extrema2f const&bounds, uint32_t col, uint32_t row) {
+    const Vec2f pixel = bounds.GetSize() / Vec2f(float(kRasterWidth), float(kRasterHeight));
+    return Vec2f(bounds.mMin.x + (col + 0.5f) * pixel.x,
+                 bounds.mMin.y + (row + 0.5f) * pixel.y);
+}
+
+CheckResult CheckRasterCells(vector<Vec2f> const&pts, uint32_t seed) {
+    CheckResult result;
+    Voronoi<> voronoi;
+    Build(pts, seed, voronoi);
+    // Half of the time with holes in the handles, site 0 always among them
+    if(seed & 2) {
+        for(size_t s=0;s<voronoi.NumSites() && voronoi.NumLiveSites() > 1;s+=3)
+            voronoi.Remove(Voronoi<>::SiteHandle(s));
+    }
+    const Extrema2f bounds = Bounds(pts);
+    vector<uint32_t> ids(kRasterWidth * kRasterHeight);
+    voronoi.RasterizeCells(bounds, kRasterWidth, kRasterHeight, ids.data());
+    for(uint32_t row=0;row<kRasterHeight;++row) {
+        for(uint32_t col=0;col<kRasterWidth;++col) {
+            const Vec2f pt = PixelCenter(bounds, col, row);
+            ++result.checks;
+            // Exactly the same, ties included
+            if(ids[row * kRasterWidth + col] != voronoi.BruteClosest(pt))
+                result.Fail(Describe("RasterizeCells differs at %f,%f", pt.x, pt.y));
+        }
+    }
+    return result;
+}
+
+template<typename Rasterize>
+CheckResult CheckRaster(vector<Vec2f> const&pts, uint32_t seed, Rasterize rasterize, const char *name) {
+    CheckResult result;
+    Voronoi<> voronoi;
+    Build(pts, seed, voronoi);
+    const Extrema2f bounds = Bounds(pts);
+    vector<uint32_t> ids(kRasterWidth * kRasterHeight);
+    rasterize(voronoi, bounds, ids.data());
+    for(uint32_t row=0;row<kRasterHeight;++row) {
+        for(uint32_t col=0;col<kRasterWidth;++col) {
+            const Vec2f pt = PixelCenter(bounds, col, row);
+            ++result.checks;
+            const uint32_t id = ids[row * kRasterWidth + col];
+            if(id >= voronoi.NumSites() ||
+               !SameDistance(SquaredDistance(voronoi.Position(id), pt),
+                             SquaredDistance(voronoi.Position(voronoi.BruteClosest(pt)), pt)))
+                result.Fail(Describe((string(name) + " differs at %f,%f").c_str(), pt.x, pt.y));
+        }
+    }
+    return result;
+}
+
+CheckResult CheckRasterNearest(vector<Vec2f> const&pts, uint32_t seed) {
+    return CheckRaster(pts, seed, [](Voronoi<> const&v, Extrema2f const&bounds, uint32_t *ids) {
+        v.RasterizeNearest(bounds, kRasterWidth, kRasterHeight, ids, NULL);
+    }, "RasterizeNearest");
+}
+
+CheckResult CheckRasterQuadtree(vector<Vec2f> const&pts, uint32_t seed) {
+    return CheckRaster(pts, seed, [](Voronoi<> const&v, Extrema2f const&bounds, uint32_t *ids) {
+        v.RasterizeQuadtree(bounds, kRasterWidth, kRasterHeight, ids);
+    }, "RasterizeQuadtree");
+}
+
+// Sites which are the closest to some point of the line y = div_y, which is below
+// all of them. -1 where it is too close to call.
+static const Vec2f kDivDir(1, 0);
+void BruteBorder(vector<Vec2f> const&sites, float div_y, vector<int> &border) {
+    border.assign(sites.size(), 0);
+    for(size_t s=0;s<sites.size();++s) {
+        // Site s is closer than site o where t * 2 (o.x - s.x) < |o|^2 - |s|^2, measured from the line
+        const double sx = sites[s].x, sh = double(sites[s].y) - div_y;
+        double lo = -DBL_MAX, hi = DBL_MAX;
+        bool never = false, lo_parallel = false, hi_parallel = false;
+        for(size_t o=0;o<sites.size();++o) {
+            if(o == s)
+                continue;
+            const double ox = sites[o].x, oh = double(sites[o].y) - div_y;
+            const double a = 2.0 * (ox - sx), b = (ox * ox + oh * oh) - (sx * sx + sh * sh);
+            // line_intersection() takes edges this close to the line's direction as parallel
+            const bool parallel = ::fabs(a) < 2e-4 * ::hypot(ox - sx, oh - sh);
+            if(a > 0 && b / a < hi) {
+                hi = b / a;
+                hi_parallel = parallel;
+            } else if(a < 0 && b / a > lo) {
+                lo = b / a;
+                lo_parallel = parallel;
+            } else if(a == 0 && b <= 0)
+                never = true;
+        }
+        const double slack = 1e-4 * (1.0 + ::fabs(lo) + ::fabs(hi));
+        if(lo_parallel || hi_parallel)
+            border[s] = -1;
+        else if(never || hi - lo < -slack)
+            border[s] = 0;
+        else if(hi - lo > slack)
+            border[s] = 1;
+        else
+            border[s] = -1;
+    }
+}
+
+vector<Vec2f> Unique(vector<Vec2f> const&pts) {
+    set<Vec2f> seen;
+    vector<Vec2f> unique;
+    for(Vec2f const&pt : pts) {
+        if(seen.insert(pt).second)
+            unique.push_back(pt);
+    }
+    return unique;
+}
+
+// The diagram side of BruteIsBorder(): a site is on the border if one of its edges crosses the line
+CheckResult CheckBorder(vector<Vec2f> const&pts, uint32_t seed) {
+    CheckResult result;
+    const vector<Vec2f> sites = Unique(pts);
+    if(sites.size() < 2)
+        return result;
+    const float div_y = Bounds(sites).mMin.y;
+    Voronoi<> voronoi;
+    Build(sites, seed, voronoi);
+    vector<int> brute;
+    BruteBorder(sites, div_y, brute);
+    vector<Voronoi<>::Edge> edges;
+    for(size_t i=0;i<sites.size();++i) {
+        if(brute[i] < 0)
+            continue;
+        const Voronoi<>::SiteHandle site = voronoi.Closest(sites[i]);
+        edges.clear();
+        voronoi.NeighboringEdges(site, edges);
+        bool fast = false;
+        for(Voronoi<>::Edge const&edge : edges)
+            fast = fast || edge.intersects_line(Vec2f(0, div_y), kDivDir);
+        ++result.checks;
+        if(fast != bool(brute[i]))
+            result.Fail(Describe("Border of %f,%f differs from the diagram", sites[i].x, sites[i].y));
+    }
+    return result;
+}
+
+// The border raster of the bsp_build_1 viewer: a pixel is border if the cell it would have,
+// added to the diagram of the sites on its side of the line, crosses the line. Filled with
+// QuadtreeRaster's FillFromRow() from the first row past the line, against every pixel evaluated.
+CheckResult CheckBorderQuadtree(vector<Vec2f> const&pts, uint32_t seed) {
+    static const uint32_t kWidth = 24, kHeight = 18;
+    CheckResult result;
+    const vector<Vec2f> sites = Unique(pts);
+    if(sites.size() < 2)
+        return result;
+    const Extrema2f bounds = Bounds(sites);
+    const Vec2f div_o(0, (bounds.mMin.y + bounds.mMax.y) / 2);
+    Voronoi<> pos_voronoi, neg_voronoi;
+    for(Vec2f const&pt : sites)
+        (pt.y >= div_o.y ? pos_voronoi : neg_voronoi).Add(pt);
+    auto location = [&](uint32_t col, uint32_t row) {
+        return bounds.mMin + Vec2f(float(col) / float(kWidth - 1), float(row) / float(kHeight - 1)) * bounds.GetSize();
+    };
+    auto eval = [&](uint32_t col, uint32_t row) -> uint8_t {
+        const Vec2f loc = location(col, row);
+        Voronoi<> temp = (loc.y >= div_o.y) ? pos_voronoi : neg_voronoi;
+        vector<Voronoi<>::Edge> edges;
+        temp.NeighboringEdges(temp.Add(loc), edges);
+        for(Voronoi<>::Edge const&edge : edges) {
+            if(edge.intersects_line(div_o, kDivDir))
+                return 1;
+        }
+        return 0;
+    };
+    vector<uint8_t> quadtree(kWidth * kHeight);
+    uint32_t split_row = 0;
+    while(split_row < kHeight && location(0, split_row).y < div_o.y)
+        ++split_row;
+    QuadtreeRaster<uint8_t> raster(kWidth, kHeight, 1, quadtree.data());
+    raster.FillFromRow(0, 0, kWidth, kHeight, split_row, eval);
+    for(uint32_t row=0;row<kHeight;++row) {
+        for(uint32_t col=0;col<kWidth;++col) {
+            ++result.checks;
+            if(quadtree[row * kWidth + col] != eval(col, row))
+                result.Fail(Describe("Quadtree border differs at pixel %f,%f", float(col), float(row)));
+        }
+    }
+    return result;
+}
+
+// Sites which are the closest to some point o + t * d with t_lo <= t <= t_hi, -1 where it
+// is too close to call. The general form of BruteBorder().
+void BruteCrossing(vector<Vec2f> const&sites, Vec2f const&o, Vec2f const&d,
+                   double t_lo, double t_hi, vector<int> &crossing) {
+    crossing.assign(sites.size(), 0);
+    for(size_t s=0;s<sites.size();++s) {
+        // Site s is closer than site q where t * 2 d.(q - s) < |q - o|^2 - |s - o|^2
+        const double sx = double(sites[s].x) - o.x, sy = double(sites[s].y) - o.y;
+        double lo = t_lo, hi = t_hi;
+        bool never = false;
+        for(size_t q=0;q<sites.size();++q) {
+            if(q == s)
+                continue;
+            const double qx = double(sites[q].x) - o.x, qy = double(sites[q].y) - o.y;
+            const double a = 2.0 * (d.x * (qx - sx) + d.y * (qy - sy));
+            const double b = (qx * qx + qy * qy) - (sx * sx + sy * sy);
+            if(a > 0)
+                hi = std::min(hi, b / a);
+            else if(a < 0)
+                lo = std::max(lo, b / a);
+            else if(b <= 0)
+                never = true;
+        }
+        const double slack = 1e-4 * (1.0 + ::fabs(std::max(lo, -1e6)) + ::fabs(std::min(hi, 1e6)));
+        if(never || hi - lo < -slack)
+            crossing[s] = 0;
+        else if(hi - lo > slack)
+            crossing[s] = 1;
+        else
+            crossing[s] = -1;
+    }
+}
+
+// Lines, rays and segments through the sites' bounds, against BruteCrossing()
+CheckResult CheckCellsCrossing(vector<Vec2f> const&pts, uint32_t seed) {
+    CheckResult result;
+    const vector<Vec2f> sites = Unique(pts);
+    Voronoi<> voronoi;
+    Build(sites, seed, voronoi);
+    const Extrema2f bounds = Bounds(sites);
+    Random random(seed);
+    vector<Voronoi<>::SiteHandle> fast;
+    vector<int> brute;
+    for(int q=0;q<12;++q) {
+        const Vec2f a = RandomIn(bounds, random), b = RandomIn(bounds, random);
+        const Vec2f d = b - a;
+        const int kind = q % 3;
+        double t_lo = -DBL_MAX, t_hi = DBL_MAX;
+        if(kind == 0) {
+            voronoi.CellsCrossingLine(a, d, fast);
+        } else if(kind == 1) {
+            voronoi.CellsCrossingRay(a, d, fast);
+            t_lo = 0;
+        } else {
+            voronoi.CellsCrossingSegment(a, b, fast);
+            t_lo = 0;
+            t_hi = 1;
+        }
+        BruteCrossing(sites, a, d, t_lo, t_hi, brute);
+        set<Vec2f> crossed;
+        for(Voronoi<>::SiteHandle site : fast)
+            crossed.insert(voronoi.Position(site));
+        ++result.checks;
+        if(crossed.size() != fast.size())
+            result.Fail(Describe("CellsCrossing from %f,%f gave a cell twice", a.x, a.y));
+        for(size_t s=0;s<sites.size();++s) {
+            if(brute[s] >= 0 && (crossed.count(sites[s]) != 0) != bool(brute[s]))
+                result.Fail(Describe("CellsCrossing from %f,%f is wrong about a cell", a.x, a.y));
+        }
+        // In order along d
+        for(size_t i=1;i<fast.size();++i) {
+            const Vec2f step = voronoi.Position(fast[i]) - voronoi.Position(fast[i - 1]);
+            if(step.Dot(d) <= 0)
+                result.Fail(Describe("CellsCrossing from %f,%f is out of order", a.x, a.y));
+        }
+    }
+    return result;
+}
+
+// The part of polygon in the cell of site s, found by clipping it to the bisector with
+// every other site, each moved out by slack times its length
+void BruteClip(vector<Vec2f> const&sites, size_t s, vector<Vec2f> const&polygon, double slack,
+               vector<pair<double, double> > &poly) {
+    vector<pair<double, double> > clipped;
+    poly.clear();
+    for(Vec2f const&corner : polygon)
+        poly.push_back(make_pair(double(corner.x), double(corner.y)));
+    const double sx = sites[s].x, sy = sites[s].y;
+    for(size_t q=0;q<sites.size() && !poly.empty();++q) {
+        if(q == s)
+            continue;
+        const double nx = double(sites[q].x) - sx, ny = double(sites[q].y) - sy;
+        const double c = nx * (sx + sites[q].x) * 0.5 + ny * (sy + sites[q].y) * 0.5 +
+                         slack * std::sqrt(nx * nx + ny * ny);
+        clipped.clear();
+        for(size_t i=0;i<poly.size();++i) {
+            pair<double, double> const&a = poly[i];
+            pair<double, double> const&b = poly[(i + 1) % poly.size()];
+            const double da = nx * a.first + ny * a.second - c;
+            const double db = nx * b.first + ny * b.second - c;
+            if(da <= 0)
+                clipped.push_back(a);
+            if((da < 0 && db > 0) || (da > 0 && db < 0)) {
+                const double f = da / (da - db);
+                clipped.push_back(make_pair(a.first + (b.first - a.first) * f,
+                                            a.second + (b.second - a.second) * f));
+            }
+        }
+        poly.swap(clipped);
+    }
+}
+
+bool BruteCellTouches(vector<Vec2f> const&sites, size_t s, vector<Vec2f> const&polygon, double slack) {
+    vector<pair<double, double> > poly;
+    BruteClip(sites, s, polygon, slack, poly);
+    return !poly.empty();
+}
+
+// Sites are added one at a time, and after each the cached stats of every cell are read,
+// so a cell an insert changed without clearing its entry shows up as stale
+CheckResult CheckCellStats(vector<Vec2f> const&pts, uint32_t seed) {
+    CheckResult result;
+    const vector<Vec2f> sites = Unique(pts);
+    const Extrema2f box = Bounds(sites);
+    const vector<Vec2f> corners = {
+        box.mMin, Vec2f(box.mMax.x, box.mMin.y), box.mMax, Vec2f(box.mMin.x, box.mMax.y)
+    };
+    const double box_area = double(box.GetSize().x) * box.GetSize().y;
+    const double scale = std::max(box.GetSize().x, box.GetSize().y);
+    Voronoi<> voronoi;
+    Random random(seed);
+    vector<Vec2f> added;
+    vector<pair<double, double> > brute;
+    for(Vec2f const&pt : sites) {
+        voronoi.Add(pt);
+        added.push_back(pt);
+        for(size_t s=0;s<added.size();++s)
+            voronoi.GetCellStats(Voronoi<>::SiteHandle(s), box);
+        for(int q=0;q<3;++q) {
+            const size_t s = random.Next() % added.size();
+            const Voronoi<>::CellStats stats = voronoi.GetCellStats(Voronoi<>::SiteHandle(s), box);
+            BruteClip(added, s, corners, 0, brute);
+            double area = 0, perimeter = 0, cx = 0, cy = 0;
+            for(size_t i=0;i<brute.size();++i) {
+                pair<double, double> const&a = brute[i];
+                pair<double, double> const&b = brute[(i + 1) % brute.size()];
+                const double cross = a.first * b.second - b.first * a.second;
+                area += cross * 0.5;
+                cx += (a.first + b.first) * cross;
+                cy += (a.second + b.second) * cross;
+                perimeter += std::sqrt((b.first - a.first) * (b.first - a.first) +
+                                       (b.second - a.second) * (b.second - a.second));
+            }
+            ++result.checks;
+            if(::fabs(stats.area - area) > 1e-5 * box_area ||
+               ::fabs(stats.perimeter - perimeter) > 1e-4 * scale)
+                result.Fail(Describe("GetCellStats() of %f,%f has the wrong area or perimeter", added[s].x, added[s].y));
+            else if(area > 1e-3 * box_area &&
+                    (::fabs(stats.centroid.x - cx / (6.0 * area)) > 1e-4 * scale ||
+                     ::fabs(stats.centroid.y - cy / (6.0 * area)) > 1e-4 * scale))
+                result.Fail(Describe("GetCellStats() of %f,%f has the wrong centroid", added[s].x, added[s].y));
+        }
+    }
+    return result;
+}
+
+// Boxes and random convex polygons, against a brute clip of every cell
+CheckResult CheckRegion(vector<Vec2f> const&pts, uint32_t seed) {
+    CheckResult result;
+    const vector<Vec2f> sites = Unique(pts);
+    Voronoi<> voronoi;
+    Build(sites, seed, voronoi);
+    const Extrema2f bounds = Bounds(sites);
+    const float scale = std::max(bounds.GetSize().x, bounds.GetSize().y);
+    Random random(seed);
+    vector<Voronoi<>::SiteHandle> fast;
+    vector<Vec2f> polygon;
+    for(int q=0;q<8;++q) {
+        const Vec2f a = RandomIn(bounds, random), b = RandomIn(bounds, random);
+        polygon.clear();
+        if(q % 2 == 0) {
+            Extrema2f box(a, a);
+            box.DoEnclose(b);
+            voronoi.CellsInRegion(box, fast);
+            polygon.push_back(box.mMin);
+            polygon.push_back(Vec2f(box.mMax.x, box.mMin.y));
+            polygon.push_back(box.mMax);
+            polygon.push_back(Vec2f(box.mMin.x, box.mMax.y));
+        } else {
+            // Corners at increasing angles around a, so it is convex
+            const int corners = 3 + int(random.Next() % 5);
+            const float radius = (b - a).Length();
+            float angle = 0;
+            for(int i=0;i<corners;++i) {
+                angle += (0.2f + random.Unit()) * 6.2831853f / (1.2f * float(corners));
+                polygon.push_back(a + Vec2f(::cosf(angle), ::sinf(angle)) * radius);
+            }
+            voronoi.CellsInRegion(polygon, fast);
+        }
+        set<Vec2f> found;
+        for(Voronoi<>::SiteHandle site : fast)
+            found.insert(voronoi.Position(site));
+        ++result.checks;
+        if(found.size() != fast.size())
+            result.Fail(Describe("CellsInRegion around %f,%f gave a cell twice", a.x, a.y));
+        const double slack = 1e-5 * scale;
+        for(size_t s=0;s<sites.size();++s) {
+            const bool in_fast = found.count(sites[s]) != 0;
+            if(in_fast ? !BruteCellTouches(sites, s, polygon, slack) : BruteCellTouches(sites, s, polygon, -slack))
+                result.Fail(Describe("CellsInRegion around %f,%f is wrong about a cell", a.x, a.y));
+        }
+    }
+    return result;
+}
+
+// A repaired triangulation must still be Delaunay: no site well inside any circumcircle,
+// every site in some triangle, and Closest() agreeing with brute force
+void CheckDelaunay(VoronoiBase const&voronoi, Extrema2f const&box, const char *after,
+                   uint32_t seed, CheckResult &result) {
+    const float scale = std::max(box.GetSize().x, box.GetSize().y);
+    vector<Vec2f> sites;
+    voronoi.GetPoints(sites);
+    if(sites.size() < 3)
+        return;
+    Voronoi<>::Triangulation triangulation;
+    voronoi.ExportTriangulation(triangulation);
+    if(!triangulation.NumTriangles())
+        return;
+    for(size_t s=0;s<sites.size();++s) {
+        if(voronoi.IsRemoved(Voronoi<>::SiteHandle(s)))
+            continue;
+        ++result.checks;
+        if(triangulation.incident_offsets[s] == triangulation.incident_offsets[s + 1])
+            result.Fail(Describe((string(after) + " left %f,%f out of the triangulation").c_str(), sites[s].x, sites[s].y));
+    }
+    for(size_t t=0;t<triangulation.NumTriangles();++t) {
+        const Vec2f a = sites[triangulation.triangles[3 * t]];
+        const Vec2f b = sites[triangulation.triangles[3 * t + 1]];
+        const Vec2f c = sites[triangulation.triangles[3 * t + 2]];
+        const Vec2f center = Circumcenter(a, b, c);
+        const double radius = SquaredDistance(center, a);
+        ++result.checks;
+        for(size_t s=0;s<sites.size();++s) {
+            if(!voronoi.IsRemoved(Voronoi<>::SiteHandle(s)) &&
+               SquaredDistance(center, sites[s]) < radius - 1e-5 * (radius + scale * scale)) {
+                result.Fail(Describe((string(after) + " left a site inside the circle at %f,%f").c_str(), center.x, center.y));
+                break;
+            }
+        }
+    }
+    Random random(seed);
+    for(int q=0;q<16;++q) {
+        const Vec2f pt = RandomIn(box, random);
+        ++result.checks;
+        if(!SameDistance(SquaredDistance(voronoi.Position(voronoi.Closest(pt)), pt),
+                         SquaredDistance(voronoi.Position(voronoi.BruteClosest(pt)), pt)))
+            result.Fail(Describe((string("Closest(%f,%f) after ") + after + " is wrong").c_str(), pt.x, pt.y));
+    }
+}
+
+CheckResult CheckRelax(vector<Vec2f> const&pts, uint32_t seed) {
+    CheckResult result;
+    Voronoi<> voronoi;
+    Build(pts, seed, voronoi);
+    const Extrema2f box = Bounds(pts);
+    voronoi.Relax(1 + seed % 4, box);
+    CheckDelaunay(voronoi, box, "Relax()", seed, result);
+    return result;
+}
+
+// Small steps, long jumps and moves onto other sites, one at a time. Afterwards the extents
+// must be exact, the cached cell areas current, and the triangulation Delaunay.
+CheckResult CheckMove(vector<Vec2f> const&pts, uint32_t seed) {
+    CheckResult result;
+    vector<Vec2f> sites = Unique(pts);
+    if(sites.empty())
+        return result;
+    const Extrema2f box = Bounds(sites);
+    const float scale = std::max(box.GetSize().x, box.GetSize().y);
+    Voronoi<> voronoi;
+    for(Vec2f const&pt : sites)
+        voronoi.Add(pt);
+    for(size_t s=0;s<sites.size();++s)
+        voronoi.GetCellStats(Voronoi<>::SiteHandle(s), box);
+    Random random(seed);
+    vector<pair<double, double> > brute;
+    const vector<Vec2f> corners = {
+        box.mMin, Vec2f(box.mMax.x, box.mMin.y), box.mMax, Vec2f(box.mMin.x, box.mMax.y)
+    };
+    const size_t moves = std::min(sites.size() * 2, size_t(64));
+    for(size_t m=0;m<moves;++m) {
+        const size_t s = random.Next() % sites.size();
+        Vec2f to;
+        switch(random.Next() % 4) {
+        case 0:
+            to = sites[s] + Vec2f(random.Unit() - 0.5f, random.Unit() - 0.5f) * (1e-3f * scale);
+            break;
+        case 1:
+            to = sites[s] + Vec2f(random.Unit() - 0.5f, random.Unit() - 0.5f) * (0.1f * scale);
+            break;
+        case 2:
+            to = RandomIn(box, random);
+            break;
+        default:
+            to = sites[random.Next() % sites.size()];
+            break;
+        }
+        const bool taken = (to != sites[s]) && std::find(sites.begin(), sites.end(), to) != sites.end();
+        ++result.checks;
+        if(voronoi.Move(Voronoi<>::SiteHandle(s), to) == taken)
+            result.Fail(Describe("Move() to %f,%f said the wrong thing about a duplicate", to.x, to.y));
+        if(!taken)
+            sites[s] = to;
+        ++result.checks;
+        if(voronoi.Position(Voronoi<>::SiteHandle(s)) != sites[s])
+            result.Fail(Describe("Move() to %f,%f left the site somewhere else", to.x, to.y));
+
+        Extrema2f extents(sites.front(), sites.front());
+        for(Vec2f const&site : sites)
+            extents.DoEnclose(site);
+        Voronoi<>::Triangulation triangulation;
+        voronoi.ExportTriangulation(triangulation);
+        for(size_t t=0;t+2<triangulation.triangles.size();t+=3) {
+            extents.DoEnclose(Circumcenter(sites[triangulation.triangles[t]],
+                                           sites[triangulation.triangles[t + 1]],
+                                           sites[triangulation.triangles[t + 2]]));
+        }
+        const Extrema2f fast = voronoi.GetDiagramDetailExtents();
+        ++result.checks;
+        if(fast.mMin != extents.mMin || fast.mMax != extents.mMax)
+            result.Fail(Describe("Extents after a move to %f,%f are not exact", to.x, to.y));
+    }
+
+    const double box_area = double(box.GetSize().x) * box.GetSize().y;
+    for(size_t s=0;s<sites.size();++s) {
+        BruteClip(sites, s, corners, 0, brute);
+        double area = 0;
+        for(size_t i=0;i<brute.size();++i) {
+            pair<double, double> const&a = brute[i];
+            pair<double, double> const&b = brute[(i + 1) % brute.size()];
+            area += (a.first * b.second - b.first * a.second) * 0.5;
+        }
+        ++result.checks;
+        if(::fabs(voronoi.GetCellStats(Voronoi<>::SiteHandle(s), box).area - area) > 1e-5 * box_area)
+            result.Fail(Describe("GetCellStats() of %f,%f is stale after moves", sites[s].x, sites[s].y));
+    }
+    CheckDelaunay(voronoi, box, "Move()", seed, result);
+    return result;
+}
+
+// Sites added with expiries and taken out by Advance(), and some removed directly, against a
+// model of which handles are live. Freed handles must be used again, with the new payload.
+CheckResult CheckRemove(vector<Vec2f> const&pts, uint32_t seed) {
+    CheckResult result;
+    const vector<Vec2f> all = Unique(pts);
+    if(all.empty())
+        return result;
+    const Extrema2f box = Bounds(all);
+    Voronoi<int> voronoi;
+    vector<Vec2f> where;
+    vector<double> expiries;
+    vector<int> payloads;
+    vector<bool> live;
+    Random random(seed);
+    double now = 0;
+    for(size_t i=0;i<all.size() * 2;++i) {
+        now += 1;
+        const size_t removed = voronoi.Advance(now);
+        size_t expected = 0;
+        for(size_t s=0;s<live.size();++s) {
+            if(live[s] && expiries[s] <= now) {
+                live[s] = false;
+                ++expected;
+            }
+        }
+        ++result.checks;
+        if(removed != expected)
+            result.Fail(Describe("Advance(%f) removed %f sites, which is wrong", float(now), float(removed)));
+
+        if(i < all.size() || random.Next() % 2) {
+            // Windows of a few steps, so some points come back after their site has gone
+            const Vec2f pt = all[(i < all.size()) ? i : random.Next() % all.size()];
+            const double expires = now + 1 + random.Next() % 8;
+            const Voronoi<int>::SiteHandle site = voronoi.AddUntil(pt, int(i), expires);
+            size_t existing = live.size();
+            for(size_t s=0;s<live.size();++s) {
+                if(live[s] && where[s] == pt)
+                    existing = s;
+            }
+            ++result.checks;
+            if(existing != live.size()) {
+                if(site != existing)
+                    result.Fail(Describe("AddUntil(%f,%f) did not find the existing site", pt.x, pt.y));
+                expiries[existing] = std::max(expiries[existing], expires);
+            } else {
+                if(site < live.size() ? bool(live[site]) : site != live.size())
+                    result.Fail(Describe("AddUntil(%f,%f) gave a handle in use", pt.x, pt.y));
+                if(site >= live.size()) {
+                    where.resize(site + 1);
+                    expiries.resize(site + 1);
+                    payloads.resize(site + 1);
+                    live.resize(site + 1);
+                }
+                where[site] = pt;
+                expiries[site] = expires;
+                payloads[site] = int(i);
+                live[site] = true;
+            }
+        } else {
+            const size_t s = random.Next() % live.size();
+            ++result.checks;
+            if(voronoi.Remove(Voronoi<int>::SiteHandle(s)) != bool(live[s]))
+                result.Fail(Describe("Remove() of %f,%f said the wrong thing", where[s].x, where[s].y));
+            live[s] = false;
+        }
+
+        size_t num_live = 0;
+        for(size_t s=0;s<live.size();++s) {
+            num_live += live[s];
+            ++result.checks;
+            if(voronoi.IsRemoved(Voronoi<int>::SiteHandle(s)) == bool(live[s]))
+                result.Fail(Describe("Site %f,%f is live when it should not be, or the other way", where[s].x, where[s].y));
+        }
+        ++result.checks;
+        if(voronoi.NumLiveSites() != num_live)
+            result.Fail(Describe("NumLiveSites() is %f, not %f", float(voronoi.NumLiveSites()), float(num_live)));
+        for(int q=0;q<4 && num_live;++q) {
+            const Vec2f pt = RandomIn(box, random);
+            double best = DBL_MAX;
+            for(size_t s=0;s<live.size();++s) {
+                if(live[s])
+                    best = std::min(best, SquaredDistance(where[s], pt));
+            }
+            const Voronoi<int>::SiteHandle site = voronoi.Closest(pt);
+            ++result.checks;
+            if(site >= live.size() || !live[site] || !SameDistance(SquaredDistance(where[site], pt), best) ||
+               *voronoi.ClosestPayload(pt) != payloads[site])
+                result.Fail(Describe("Closest(%f,%f) after removes is wrong", pt.x, pt.y));
+        }
+
+        if(!num_live)
+            continue;
+        Extrema2f extents(Vec2f(FLT_MAX, FLT_MAX), Vec2f(-FLT_MAX, -FLT_MAX));
+        for(size_t s=0;s<live.size();++s) {
+            if(live[s])
+                extents.DoEnclose(where[s]);
+        }
+        Voronoi<int>::Triangulation triangulation;
+        voronoi.ExportTriangulation(triangulation);
+        for(size_t t=0;t+2<triangulation.triangles.size();t+=3) {
+            extents.DoEnclose(Circumcenter(where[triangulation.triangles[t]],
+                                           where[triangulation.triangles[t + 1]],
+                                           where[triangulation.triangles[t + 2]]));
+        }
+        const Extrema2f fast = voronoi.GetDiagramDetailExtents();
+        ++result.checks;
+        if(fast.mMin != extents.mMin || fast.mMax != extents.mMax)
+            result.Fail(Describe("Extents at %f with %f sites are not exact", float(now), float(num_live)));
+    }
+    CheckDelaunay(voronoi, box, "Remove()", seed, result);
+    return result;
+}
+
+// Adds, moves, removes and the odd Relax(), with the change feed applied to a copy of the
+// edges after each. The copy must match GetEdges(), and every site whose neighbors changed
+// must have been named. Some rings are small enough to drop updates, which must be followed
+// by a kReset.
+CheckResult CheckFeed(vector<Vec2f> const&pts, uint32_t seed) {
+    typedef Voronoi<>::Change Change;
+    typedef pair<Voronoi<>::SiteHandle, Voronoi<>::SiteHandle> Key;
+    CheckResult result;
+    const vector<Vec2f> all = Unique(pts);
+    if(all.empty())
+        return result;
+    const Extrema2f box = Bounds(all);
+    const float scale = std::max(box.GetSize().x, box.GetSize().y);
+    Voronoi<> voronoi;
+    Voronoi<>::ChangeRing ring((seed % 4) ? 4096 : 16);
+    voronoi.SetChangeFeed(&ring);
+    map<Key, Voronoi<>::Edge> copy;
+    vector<Voronoi<>::Edge> edges;
+    vector<vector<Voronoi<>::SiteHandle> > before, after;
+    Random random(seed);
+    size_t next = 0;
+    bool stale = false;
+    for(size_t step=0;step<all.size() * 2;++step) {
+        before.resize(voronoi.NumSites());
+        for(Voronoi<>::SiteHandle s=0;s<voronoi.NumSites();++s) {
+            before[s].clear();
+            voronoi.NeighboringPoints(s, before[s]);
+            std::sort(before[s].begin(), before[s].end());
+        }
+        const uint64_t generation = voronoi.Generation();
+        const uint32_t op = random.Next() % 32;
+        const Voronoi<>::SiteHandle site = Voronoi<>::SiteHandle(random.Next() % std::max(size_t(1), voronoi.NumSites()));
+        if(op == 0 && voronoi.NumLiveSites()) {
+            voronoi.Relax(1, box);
+        } else if((op < 16 || !voronoi.NumLiveSites()) && next < all.size()) {
+            voronoi.Add(all[next++]);
+        } else if(op < 24 && !voronoi.IsRemoved(site)) {
+            const Vec2f to = (op % 2) ? RandomIn(box, random) :
+                voronoi.Position(site) + Vec2f(random.Unit() - 0.5f, random.Unit() - 0.5f) * (1e-2f * scale);
+            voronoi.Move(site, to);
+        } else {
+            voronoi.Remove(site);
+        }
+        
+        set<Voronoi<>::SiteHandle> changed;
+        bool reset = false;
+        bool ended = false;
+        Change change;
+        while(ring.TryPop(change)) {
+            switch(change.kind) {
+            case Change::kEdgeRemoved:
+                copy.erase(Key(change.edge.site_a, change.edge.site_b));
+                break;
+            case Change::kEdgeAdded: {
+                // Removed edges are in handle order, added ones in the order of GetEdges()
+                const Key key(std::min(change.edge.site_a, change.edge.site_b),
+                              std::max(change.edge.site_a, change.edge.site_b));
+                copy.erase(key);
+                copy.insert(make_pair(key, change.edge));
+                break;
+            }
+            case Change::kNeighborsChanged:
+                changed.insert(change.site);
+                break;
+            case Change::kReset:
+                reset = true;
+                break;
+            case Change::kEndUpdate:
+                ended = true;
+                ++result.checks;
+                if(change.generation != voronoi.Generation())
+                    result.Fail(Describe("The feed's generation is %f behind, at %f", float(voronoi.Generation() - change.generation), float(change.generation)));
+                break;
+            }
+        }
+        if(voronoi.Generation() == generation) {
+            ++result.checks;
+            if(ended)
+                result.Fail(Describe("An update which changed nothing wrote to the feed", 0, 0));
+            continue;
+        }
+        if(!ended) {
+            // Dropped, the next update must say so
+            stale = true;
+            continue;
+        }
+        ++result.checks;
+        if(stale && !reset)
+            result.Fail(Describe("The update after a dropped one did not start with kReset", 0, 0));
+        stale = false;
+        edges.clear();
+        voronoi.GetEdges(edges);
+        if(reset) {
+            copy.clear();
+            for(Voronoi<>::Edge const&edge : edges) {
+                copy.insert(make_pair(Key(std::min(edge.site_a, edge.site_b),
+                                          std::max(edge.site_a, edge.site_b)), edge));
+            }
+            continue;
+        }
+        
+        ++result.checks;
+        if(copy.size() != edges.size())
+            result.Fail(Describe("The feed has %f edges, not %f", float(copy.size()), float(edges.size())));
+        for(Voronoi<>::Edge const&edge : edges) {
+            auto it = copy.find(Key(std::min(edge.site_a, edge.site_b), std::max(edge.site_a, edge.site_b)));
+            ++result.checks;
+            if(it == copy.end() || it->second.pt_a != edge.pt_a || it->second.pt_b != edge.pt_b ||
+               it->second.extents.mMin[0] != edge.extents.mMin[0] || it->second.extents.mMax[0] != edge.extents.mMax[0])
+                result.Fail(Describe("The feed's edge between %f and %f is missing or stale", float(edge.site_a), float(edge.site_b)));
+        }
+        after.resize(voronoi.NumSites());
+        before.resize(voronoi.NumSites());
+        for(Voronoi<>::SiteHandle s=0;s<voronoi.NumSites();++s) {
+            after[s].clear();
+            voronoi.NeighboringPoints(s, after[s]);
+            std::sort(after[s].begin(), after[s].end());
+            ++result.checks;
+            if(after[s] != before[s] && !changed.count(s))
+                result.Fail(Describe("Neighbors of site %f changed without a kNeighborsChanged", float(s), 0));
+        }
+    }
+    return result;
+}
+
+// PointCloudHalfSpace2D asserts on pairs of points nearly above one another
+bool HalfSpaceCanRun(vector<Vec2f> const&sites) {
+    for(size_t i=0;i<sites.size();++i) {
+        for(size_t j=i+1;j<sites.size();++j) {
+            const Vec2f d = sites[i] - sites[j];
+            if(::fabs(d.x) < 1e-3f * d.Length())
+                return false;
+        }
+    }
+    return true;
+}
+
+// The sites at the ends of the arcs are the border. A known failure: the constructor only
+// tests new points against the last arc it changed, so it misses sites on most inputs.
+CheckResult CheckHalfSpace(vector<Vec2f> const&pts, uint32_t seed) {
+    CheckResult result;
+    const vector<Vec2f> sites = Unique(pts);
+    if(sites.size() < 2 || !HalfSpaceCanRun(sites))
+        return result;
+    const float div_y = Bounds(sites).mMin.y;
+    PointCloudHalfSpace2D half_space(Vec2f(0, div_y), kDivDir, sites);
+    vector<PointCloudHalfSpace2D::Arc> arcs;
+    half_space.GetArcs(arcs);
+    set<Vec2f> fast;
+    for(PointCloudHalfSpace2D::Arc const&arc : arcs) {
+        fast.insert(arc.pt_a);
+        fast.insert(arc.pt_b);
+    }
+    vector<int> brute;
+    BruteBorder(sites, div_y, brute);
+    for(size_t i=0;i<sites.size();++i) {
+        if(brute[i] < 0)
+            continue;
+        ++result.checks;
+        if((fast.count(sites[i]) != 0) != bool(brute[i]))
+            result.Fail(Describe("PointCloudHalfSpace2D border of %f,%f is wrong", sites[i].x, sites[i].y));
+    }
+    return result;
+}
+
+const Check kChecks[] = {
+    { "closest", CheckClosest, false },
+    { "edges", CheckEdges, false },
+    { "neighbors", CheckNeighbors, false },
+    { "affected", CheckAffected, false },
+    { "affected_batch", CheckAffectedBatch, false },
+    { "extents", CheckExtents, false },
+    { "raster_cells", CheckRasterCells, false },
+    { "raster_nearest", CheckRasterNearest, false },
+    { "raster_quadtree", CheckRasterQuadtree, false },
+    { "border", CheckBorder, false },
+    { "border_quadtree", CheckBorderQuadtree, false },
+    { "cells_crossing", CheckCellsCrossing, false },
+    { "region", CheckRegion, false },
+    { "cell_stats", CheckCellStats, false },
+    { "relax", CheckRelax, false },
+    { "move", CheckMove, false },
+    { "remove", CheckRemove, false },
+    { "feed", CheckFeed, false },
+    { "halfspace", CheckHalfSpace, true },
+};
+static const size_t kNumChecks = sizeof(kChecks) / sizeof(kChecks[0]);
+
+// Greedily drops chunks of points, halving the chunk size, while the check still fails
+vector<Vec2f> Shrink(Check const&check, vector<Vec2f> pts, uint32_t seed) {
+    for(size_t chunk = std::max(size_t(1), pts.size() / 2);;) {
+        bool removed = false;
+        for(size_t start = 0;start < pts.size() && pts.size() > 1;) {
+            vector<Vec2f> candidate(pts.begin(), pts.begin() + start);
+            candidate.insert(candidate.end(), pts.begin() + std::min(pts.size(), start + chunk), pts.end());
+            if(!candidate.empty() && check.function(candidate, seed).failures) {
+                pts.swap(candidate);
+                removed = true;
+            } else {
+                start += chunk;
+            }
+        }
+        if(!removed) {
+            if(chunk == 1)
+                break;
+            chunk /= 2;
+        }
+    }
+    return pts;
+}
+
+struct Options {
+    Options()
+    : cases(20000),
+      max_n(200),
+      seed(1),
+      threads(std::max(1u, std::thread::hardware_concurrency())),
+      max_reports(3),
+      enabled(kNumChecks) {
+        for(size_t c=0;c<kNumChecks;++c)
+            enabled[c] = !kChecks[c].known_failure;
+    }
+
+    size_t cases;
+    size_t max_n;
+    uint32_t seed;
+    unsigned threads;
+    // Per check
+    size_t max_reports;
+    vector<bool> enabled;
+};
+
+bool ParseOptions(int argc, char **argv, Options &options) {
+    for(int i=1;i<argc;++i) {
+        const char *arg = argv[i];
+        if(!strncmp(arg, "--cases=", 8)) {
+            options.cases = strtoul(arg + 8, NULL, 10);
+        } else if(!strncmp(arg, "--max-n=", 8)) {
+            options.max_n = std::max(1ul, strtoul(arg + 8, NULL, 10));
+        } else if(!strncmp(arg, "--seed=", 7)) {
+            options.seed = uint32_t(strtoul(arg + 7, NULL, 10));
+        } else if(!strncmp(arg, "--threads=", 10)) {
+            options.threads = std::max(1u, unsigned(strtoul(arg + 10, NULL, 10)));
+        } else if(!strncmp(arg, "--max-reports=", 14)) {
+            options.max_reports = strtoul(arg + 14, NULL, 10);
+        } else if(!strcmp(arg, "--include-known-failures")) {
+            for(size_t c=0;c<kNumChecks;++c)
+                options.enabled[c] = options.enabled[c] || kChecks[c].known_failure;
+        } else if(!strncmp(arg, "--checks=", 9)) {
+            options.enabled.assign(kNumChecks, false);
+            string names = string(arg + 9) + ",";
+            for(size_t start = 0, comma;(comma = names.find(',', start)) != string::npos;start = comma + 1) {
+                const string name = names.substr(start, comma - start);
+                size_t c = 0;
+                while(c < kNumChecks && name != kChecks[c].name)
+                    ++c;
+                if(c == kNumChecks)
+                    return false;
+                options.enabled[c] = true;
+            }
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+void PrintPoints(vector<Vec2f> const&pts, const char *format) {
+    for(Vec2f const&pt : pts)
+        printf(format, pt.x, pt.y);
+}
+
+// As printed, so the reproduction can be pasted back in. Only used if it still fails.
+vector<Vec2f> AsPrinted(vector<Vec2f> const&pts) {
+    vector<Vec2f> printed;
+    char buf[64];
+    for(Vec2f const&pt : pts) {
+        snprintf(buf, sizeof(buf), "%f %f", pt.x, pt.y);
+        float x, y;
+        sscanf(buf, "%f %f", &x, &y);
+        printed.push_back(Vec2f(x, y));
+    }
+    return printed;
+}
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    if(!ParseOptions(argc, argv, options)) {
+        fprintf(stderr, "usage: %s [--cases=20000] [--max-n=200] [--seed=1] [--threads=N] "
+                        "[--checks=", argv[0]);
+        for(size_t c=0;c<kNumChecks;++c)
+            fprintf(stderr, "%s%s", c ? "," : "", kChecks[c].name);
+        fprintf(stderr, "] [--include-known-failures] [--max-reports=3]\nknown failures, not run by default:");
+        for(size_t c=0;c<kNumChecks;++c) {
+            if(kChecks[c].known_failure)
+                fprintf(stderr, " %s", kChecks[c].name);
+        }
+        fprintf(stderr, "\n");
+        return 1;
+    }
+
+    std::atomic<size_t> next_case(0);
+    vector<std::atomic<size_t> > checks(kNumChecks), failures(kNumChecks);
+    for(size_t c=0;c<kNumChecks;++c) {
+        checks[c] = 0;
+        failures[c] = 0;
+    }
+    std::mutex report_mutex;
+
+    auto worker = [&]() {
+        vector<Vec2f> pts;
+        for(size_t i;(i = next_case++) < options.cases;) {
+            const uint32_t seed = options.seed + uint32_t(i);
+            const DatasetKind kind = DatasetKind(i % kNumDatasetKinds);
+            const size_t n = 1 + (seed * 2654435761u >> 8) % options.max_n;
+            pts.clear();
+            GenerateDataset(kind, n, seed, pts);
+            for(size_t c=0;c<kNumChecks;++c) {
+                if(!options.enabled[c])
+                    continue;
+                const CheckResult result = kChecks[c].function(pts, seed);
+                checks[c] += result.checks;
+                if(!result.failures)
+                    continue;
+                // Only the first few of each check are shrunk and printed
+                if(failures[c]++ >= options.max_reports)
+                    continue;
+                vector<Vec2f> small = Shrink(kChecks[c], pts, seed);
+                const vector<Vec2f> printed = AsPrinted(small);
+                const bool printed_fails = kChecks[c].function(printed, seed).failures != 0;
+                const CheckResult small_result = kChecks[c].function(printed_fails ? printed : small, seed);
+
+                std::lock_guard<std::mutex> lock(report_mutex);
+                printf("FAIL %s: %s, %s n=%d seed=%u, shrunk to %d points: %s\n",
+                       kChecks[c].name, result.detail.c_str(), DatasetName(kind), int(n), seed,
+                       int(small.size()), small_result.detail.c_str());
+                PrintPoints(printed_fails ? printed : small,
+                            printed_fails ? "\tpoints.push_back(Vec2f(%f,%f));\n" :
+                                            "\tpoints.push_back(Vec2f(%.9g,%.9g));\n");
+                fflush(stdout);
+            }
+        }
+    };
+
+    vector<std::thread> threads;
+    for(unsigned t=1;t<options.threads;++t)
+        threads.push_back(std::thread(worker));
+    worker();
+    for(std::thread &thread : threads)
+        thread.join();
+
+    size_t total_failures = 0;
+    for(size_t c=0;c<kNumChecks;++c) {
+        if(!options.enabled[c])
+            continue;
+        printf("%-16s %12zu checks %8zu failing cases\n", kChecks[c].name, size_t(checks[c]), size_t(failures[c]));
+        total_failures += failures[c];
+    }
+    return total_failures ? 1 : 0;
+}
@@ -0,0 +1,168 @@
+#include "datasets.h"
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <random>
+
+using namespace std;
+
+namespace {
+    // The engines are fully specified by the standard, the distributions are not,
+    // so the conversions are done here.
+    class Random {
+    public:
+        Random(uint32_t seed) : engine_(seed) { }
+        
+        // [0, 1)
+        inline float Unit() {
+            return float(engine_() >> 8) * (1.0f / 16777216.0f);
+        }
+        // Box-Muller
+        inline Vec2f Gaussian() {
+            const float r = ::sqrt(-2.0f * ::log(1.0f - Unit()));
+            const float rads = Unit() * float(M_PI) * 2.0f;
+            return Vec2f(::cos(rads), ::sin(rads)) * r;
+        }
+        inline uint32_t Below(uint32_t n) {
+            return uint32_t(uint64_t(engine_()) * n >> 32);
+        }
+    private:
+        std::mt19937 engine_;
+    };
+    
+    const char *kNames[kNumDatasetKinds] = {
+        "uniform",
+        "clustered",
+        "grid",
+        "cocircular",
+        "spiral",
+        "near_duplicate",
+    };
+    
+    // From the #if blocks which used to be in bsp_build_1 Init()
+    // 0.79,-0.49 is ruled out, removing it removes the problem, so it's an ordering issue
+    const float kCaptured0[] = {
+        -0.623333f,0.023333f,  0.213333f,-0.296667f,  0.790000f,-0.490000f,
+        0.456667f,0.043333f,  0.303333f,0.170000f,  1.056667f,0.216667f,
+    };
+    const float kCaptured1[] = {
+        -0.796667f,-0.020000f,  0.170000f,-0.563333f,  0.366667f,0.256667f,
+        0.653333f,-0.490000f,  -0.020000f,-0.703333f,  0.773333f,0.483333f,
+    };
+    const float kCaptured2[] = {
+        -0.906667f,0.003333f,  0.720000f,-0.216667f,  0.763333f,0.113333f,
+        0.153333f,0.256667f,  -0.426667f,0.063333f,
+    };
+    // 0.086667,-0.463333 should be ruled out, but isn't
+    const float kCaptured3[] = {
+        -1.070000f,0.400000f,  -0.766667f,0.143333f,  -0.356667f,-0.156667f,
+        0.086667f,-0.463333f,  1.096667f,0.203333f,
+    };
+    // From the commented out block in voronoi_build_2 Init(), including its duplicate
+    const float kCaptured4[] = {
+        -0.6f,-0.5f,  0.3f,-0.3f,  -0.2f,0.5f,  0.0f,0.0f,  0.65f,-0.65f,  -0.1f,-0.1f,
+        -1.0f,-1.0f,  1.0f,-1.0f,  1.0f,1.0f,  1.0f,-1.0f,
+    };
+    
+    struct Captured {
+        const float *coords;
+        size_t count;
+    };
+    const Captured kCaptured[] = {
+        { kCaptured0, sizeof(kCaptured0) / sizeof(float) / 2 },
+        { kCaptured1, sizeof(kCaptured1) / sizeof(float) / 2 },
+        { kCaptured2, sizeof(kCaptured2) / sizeof(float) / 2 },
+        { kCaptured3, sizeof(kCaptured3) / sizeof(float) / 2 },
+        { kCaptured4, sizeof(kCaptured4) / sizeof(float) / 2 },
+    };
+}
+
+const char *DatasetName(DatasetKind kind) {
+    assert(kind < kNumDatasetKinds);
+    return kNames[kind];
+}
+
+bool DatasetFromName(const char *name, DatasetKind &kind) {
+    for(int k=0;k<kNumDatasetKinds;++k) {
+        if(!strcmp(name, kNames[k])) {
+            kind = DatasetKind(k);
+            return true;
+        }
+    }
+    return false;
+}
+
+void GenerateDataset(DatasetKind kind, size_t n, uint32_t seed, std::vector<Vec2f> &output) {
+    Random random(seed);
+    output.reserve(output.size() + n);
+    switch(kind) {
+        case kDatasetUniform:
+            for(size_t i=0;i<n;++i) {
+                const float x = random.Unit();
+                output.push_back(Vec2f(x, random.Unit()));
+            }
+            break;
+        case kDatasetClustered: {
+            const size_t num_centers = std::max(size_t(1), size_t(::sqrt(float(n)) / 2.0f));
+            std::vector<Vec2f> centers;
+            for(size_t i=0;i<num_centers;++i) {
+                const float x = random.Unit();
+                centers.push_back(Vec2f(x, random.Unit()));
+            }
+            for(size_t i=0;i<n;++i) {
+                Vec2f const&center = centers[random.Below(uint32_t(num_centers))];
+                output.push_back(center + random.Gaussian() * 0.02f);
+            }
+            break;
+        }
+        case kDatasetGrid: {
+            // As square as possible, the last row may be partial
+            const size_t cols = std::max(size_t(1), size_t(::ceil(::sqrt(double(n)))));
+            const size_t rows = (n + cols - 1) / cols;
+            const Vec2f scale(float(std::max(size_t(1), cols - 1)), float(std::max(size_t(1), rows - 1)));
+            for(size_t i=0;i<n;++i)
+                output.push_back(Vec2f(float(i % cols), float(i / cols)) / scale);
+            break;
+        }
+        case kDatasetCocircular:
+            for(size_t i=0;i<n;++i) {
+                const float rads = (float(i) / float(n)) * M_PI * 2.0f;
+                output.push_back(Vec2f(::cos(rads) * 0.75f, ::sin(rads) * 0.75f));
+            }
+            break;
+        case kDatasetSpiral:
+            for(size_t i=0;i<n;++i) {
+                const float t = float(i) / float(n);
+                const float rads = t * M_PI * 2.0f;
+                output.push_back(Vec2f(::cos(rads) * 0.75f, ::sin(rads) * 0.75f) * (t+0.1));
+            }
+            break;
+        case kDatasetNearDuplicate: {
+            Vec2f base;
+            for(size_t i=0;i<n;++i) {
+                if(i % 4 == 0) {
+                    const float x = random.Unit();
+                    base = Vec2f(x, random.Unit());
+                    output.push_back(base);
+                } else {
+                    const float dx = random.Unit() - 0.5f;
+                    output.push_back(base + Vec2f(dx, random.Unit() - 0.5f) * 2e-5f);
+                }
+            }
+            break;
+        }
+        default:
+            assert(!"Unknown dataset");
+    }
+}
+
+size_t NumCapturedDatasets() {
+    return sizeof(kCaptured) / sizeof(kCaptured[0]);
+}
+
+void CapturedDataset(size_t index, std::vector<Vec2f> &output) {
+    assert(index < NumCapturedDatasets());
+    Captured const&captured = kCaptured[index];
+    for(size_t i=0;i<captured.count;++i)
+        output.push_back(Vec2f(captured.coords[2*i], captured.coords[2*i+1]));
+}
@@ -0,0 +1,38 @@
+#ifndef voronoi_build_1_datasets_h
+#define voronoi_build_1_datasets_h
+
+#include "Vec2f.h"
+#include <cstdint>
+#include <vector>
+
+// Inputs for the apps, benchmarks and tests.
+// The same kind, n and seed give the same points with the same math library. Uniform, grid
+// and near duplicate match on any platform, the others call log, cos and sin, which do not.
+enum DatasetKind {
+    // In [0,1] x [0,1]
+    kDatasetUniform,
+    // Gaussian blobs around sqrt(n)/2 centers in [0,1] x [0,1]
+    kDatasetClustered,
+    // Square grid over [0,1] x [0,1], row by row, lots of cocircular quads
+    kDatasetGrid,
+    // Evenly spaced on a circle of radius 0.75 around the origin
+    kDatasetCocircular,
+    // One turn out from the origin, radius 0.75 * (t + 0.1)
+    kDatasetSpiral,
+    // Groups of four within about 1e-5 of each other in [0,1] x [0,1]
+    kDatasetNearDuplicate,
+    kNumDatasetKinds
+};
+
+const char *DatasetName(DatasetKind kind);
+// Returns false for an unknown name
+bool DatasetFromName(const char *name, DatasetKind &kind);
+
+// Appends n points. The seed does not matter for grid, cocircular and spiral.
+void GenerateDataset(DatasetKind kind, size_t n, uint32_t seed, std::vector<Vec2f> &output);
+
+// Inputs which once showed a problem, as printed by the apps
+size_t NumCapturedDatasets();
+void CapturedDataset(size_t index, std::vector<Vec2f> &output);
+
+#endif
@@ -16,49 +16,33 @@
 
 #include "Vec2f.h"
 #include "voronoi.h"
+#include "datasets.h"
 
 using namespace std;
 
-Voronoi voronoi;
+Voronoi<> voronoi;
 int random_seed = 234;
+DatasetKind dataset = kDatasetCocircular;
+
+// The reference raster is kept between frames, and only made again by Init() or a change of view
+static const int nRefRows = 800;
+static const int nRefCols = 600;
+vector<uint32_t> ref_ids(nRefRows * nRefCols);
+Extrema2f ref_extents;
+bool ref_valid = false;
 
 static void
 Init(void)
 {
-    voronoi = Voronoi();
-    /*
-    voronoi.Add(Vec2f(-0.6f, -0.5f));
-    voronoi.Add(Vec2f(0.3f, -0.3f));
-    voronoi.Add(Vec2f(-0.2f, 0.5f));
-    voronoi.Add(Vec2f(0,0));
-    voronoi.Add(Vec2f(0.65,-0.65));
-    voronoi.Add(Vec2f(-0.1, -0.1));
-
-    voronoi.Add(Vec2f(-1, -1));
-    voronoi.Add(Vec2f( 1, -1));
-    voronoi.Add(Vec2f( 1,  1));
-    voronoi.Add(Vec2f( 1, -1));
-     */
-    /*
-     // Random
-    srand(random_seed);
-    for(int pts = 0;pts<25;++pts)
-        voronoi.Add(Vec2f(float(rand()) / float(RAND_MAX), float(rand()) / float(RAND_MAX)));
-     */
-    /*
-    // Square
-    for(int row=0;row<5;++row) {
-        for(int col=0;col<5;++col) {
-            voronoi.Add(Vec2f(col, row) / Vec2f(4,4));
-        }
-    }*/
-    
+    voronoi = Voronoi<>();
+    ref_valid = false;
+    vector<Vec2f> pts;
+    GenerateDataset(dataset, 25, random_seed, pts);
     // Circle
-    for(int r = 0;r<25;++r) {
-        float rads = (float(r) / float(25)) * M_PI * 2.0f;
-        voronoi.Add(Vec2f(::cos(rads) * 0.75f, ::sin(rads) * 0.75f));
-    }
-    voronoi.Add(Vec2f(0,0));
+    if(dataset == kDatasetCocircular)
+        pts.push_back(Vec2f(0,0));
+    for(Vec2f const&pt : pts)
+        voronoi.Add(pt);
 }
 
 /* ARGSUSED1 */
@@ -73,6 +57,12 @@ Key(unsigned char key, int x, int y)
             Init();
             glutPostRedisplay();
             break;
+        case 'd':
+            dataset = DatasetKind((dataset + 1) % kNumDatasetKinds);
+            fprintf(stderr, "dataset %s\n", DatasetName(dataset));
+            Init();
+            glutPostRedisplay();
+            break;
     }
 }
 
@@ -119,25 +109,29 @@ Draw(void)
     glMatrixMode(GL_MODELVIEW);
     
     
-    // Brute force reference
-    static const int nBruteRows = 800;
-    static const int nBruteCols = 600;
+    // Reference, the same as BruteClosest() at every pixel
+    if(!ref_valid || ref_extents.mMin != extents_expanded.mMin || ref_extents.mMax != extents_expanded.mMax) {
+        ref_extents = extents_expanded;
+        voronoi.RasterizeCells(extents_expanded, nRefCols, nRefRows, ref_ids.data());
+        ref_valid = true;
+    }
+    const Vec2f ref_pixel = extents_expanded.GetSize() / Vec2f(nRefCols, nRefRows);
     glPointSize(1.5f);
     glBegin(GL_POINTS);
-    for(int row = 0;row<nBruteRows;++row) {
-        for(int col= 0;col<nBruteCols;++col) {
-            const Vec2f loc_r(float(col) / float(nBruteCols-1), float(row) / float(nBruteRows-1));
-            const Vec2f loc = extents_expanded.mMin + loc_r * extents_expanded.GetSize();
-            Vec2f closest = voronoi.BruteClosest(loc);
-            SetColorForPt(closest, 0);
+    for(int row = 0;row<nRefRows;++row) {
+        for(int col= 0;col<nRefCols;++col) {
+            const Vec2f loc = extents_expanded.mMin + (Vec2f(col, row) + Vec2f(0.5f, 0.5f)) * ref_pixel;
+            const Voronoi<>::SiteHandle closest = ref_ids[row * nRefCols + col];
+            if(closest == Voronoi<>::kNoSite)
+                continue;
+            SetColorForPt(voronoi.Position(closest), 0);
             glVertex2fv((float const*)&loc);
         }
     }
     glEnd();
 
 
-    vector<Vec2f> points;
-    voronoi.GetPoints(points);
+    const Voronoi<>::View<Vec2f> points = voronoi.PointView();
 
     glPointSize(5.0f);
     glBegin(GL_POINTS);
@@ -154,8 +148,7 @@ Draw(void)
     }
     glEnd();
     
-    vector<Voronoi::Edge> edges;
-    voronoi.GetEdges(edges);
+    const Voronoi<>::View<Voronoi<>::Edge> edges = voronoi.EdgeView();
     
     glBegin(GL_LINES);
     for(auto const&edge : edges) {
@@ -0,0 +1,215 @@
+#include "stats.h"
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+namespace {
+    const char *kCounterNames[kNumStatCounters] = {
+        "predicates",
+        "walk_steps",
+        "cavity_triangles",
+        "sites_visited",
+        "edges_touched",
+        "brute_distances",
+        "flips",
+        "flip_rebuilds",
+        "scratch_growths",
+        "scratch_bytes",
+    };
+    const char *kMaximumNames[kNumStatMaxima] = {
+        "affected_vertices",
+    };
+    const char *kTimerNames[kNumStatTimers] = {
+        "Add",
+        "AddBatch",
+        "Closest",
+        "EdgesAffectedByAdd",
+        "EdgesAffectedByAddBatch",
+        "BruteClosest",
+        "BruteIsBetweenNeighbors",
+        "Rasterize",
+        "PointCloudHalfSpace2D",
+        "CellsCrossingLine",
+        "CellsCrossingRay",
+        "CellsCrossingSegment",
+        "CellsInRegion",
+        "Relax",
+        "Move",
+        "Remove",
+        "Advance",
+    };
+
+    // Threads which have counted anything, and the totals of the ones which have exited
+    struct Registry {
+        std::mutex mutex;
+        std::vector<stats_internal::ThreadStats*> threads;
+        StatsSnapshot exited;
+        LatencyHistogram exited_latency[kNumStatTimers];
+    };
+
+    // Never destroyed, threads may exit after static destructors have run
+    Registry &GetRegistry() {
+        static Registry *registry = new Registry;
+        return *registry;
+    }
+
+    void AddTo(stats_internal::ThreadStats const&stats, StatsSnapshot &total) {
+        for(int i=0;i<kNumStatCounters;++i)
+            total.counters[i] += stats.counters[i].load(std::memory_order_relaxed);
+        for(int i=0;i<kNumStatMaxima;++i)
+            total.maxima[i] = std::max(total.maxima[i], uint64_t(stats.maxima[i].load(std::memory_order_relaxed)));
+        for(int i=0;i<kNumStatTimers;++i) {
+            total.calls[i] += stats.calls[i].load(std::memory_order_relaxed);
+            total.ns[i] += stats.ns[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    void AddTo(stats_internal::ThreadStats const&stats, StatTimer timer, LatencyHistogram &total) {
+        for(int b=0;b<LatencyHistogram::kNumBuckets;++b)
+            total.counts[b] += stats.latency[timer][b].load(std::memory_order_relaxed);
+    }
+
+    void Clear(stats_internal::ThreadStats &stats) {
+        for(auto &value : stats.counters)
+            value.store(0, std::memory_order_relaxed);
+        for(auto &value : stats.maxima)
+            value.store(0, std::memory_order_relaxed);
+        for(auto &value : stats.calls)
+            value.store(0, std::memory_order_relaxed);
+        for(auto &value : stats.ns)
+            value.store(0, std::memory_order_relaxed);
+        for(auto &histogram : stats.latency) {
+            for(auto &value : histogram)
+                value.store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+const char *StatCounterName(StatCounter counter) {
+    return kCounterNames[counter];
+}
+
+const char *StatMaximumName(StatMaximum maximum) {
+    return kMaximumNames[maximum];
+}
+
+const char *StatTimerName(StatTimer timer) {
+    return kTimerNames[timer];
+}
+
+StatsSnapshot::StatsSnapshot() {
+    std::fill(counters, counters + kNumStatCounters, 0);
+    std::fill(maxima, maxima + kNumStatMaxima, 0);
+    std::fill(calls, calls + kNumStatTimers, 0);
+    std::fill(ns, ns + kNumStatTimers, 0);
+}
+
+void StatsSnapshot::Print(FILE *out)const {
+    for(int i=0;i<kNumStatCounters;++i) {
+        if(counters[i])
+            fprintf(out, "%s %llu\n", kCounterNames[i], (unsigned long long)counters[i]);
+    }
+    for(int i=0;i<kNumStatMaxima;++i) {
+        if(maxima[i])
+            fprintf(out, "max %s %llu\n", kMaximumNames[i], (unsigned long long)maxima[i]);
+    }
+    for(int i=0;i<kNumStatTimers;++i) {
+        if(calls[i])
+            fprintf(out, "%s %llu calls, %.1f ns each\n", kTimerNames[i],
+                    (unsigned long long)calls[i], double(ns[i]) / double(calls[i]));
+    }
+}
+
+const int LatencyHistogram::kSubBuckets;
+const int LatencyHistogram::kNumBuckets;
+
+LatencyHistogram::LatencyHistogram() {
+    std::fill(counts, counts + kNumBuckets, 0);
+}
+
+uint64_t LatencyHistogram::BucketLow(int bucket) {
+    if(bucket < kSubBuckets)
+        return uint64_t(bucket);
+    const int group = bucket / kSubBuckets;
+    return uint64_t(kSubBuckets + bucket % kSubBuckets) << (group - 1);
+}
+
+uint64_t LatencyHistogram::BucketWidth(int bucket) {
+    if(bucket < kSubBuckets)
+        return 1;
+    return uint64_t(1) << (bucket / kSubBuckets - 1);
+}
+
+uint64_t LatencyHistogram::Count()const {
+    uint64_t count = 0;
+    for(uint64_t c : counts)
+        count += c;
+    return count;
+}
+
+uint64_t LatencyHistogram::Percentile(double p)const {
+    const uint64_t count = Count();
+    if(!count)
+        return 0;
+    // The 1-based rank of the value, at least the first
+    const uint64_t rank = std::max(uint64_t(1), uint64_t(std::ceil(std::min(std::max(p, 0.0), 1.0) * double(count))));
+    uint64_t seen = 0;
+    for(int b=0;b<kNumBuckets;++b) {
+        seen += counts[b];
+        if(seen >= rank)
+            return BucketLow(b) + BucketWidth(b) / 2;
+    }
+    return BucketLow(kNumBuckets - 1);
+}
+
+void LatencyHistogram::Merge(LatencyHistogram const&other) {
+    for(int b=0;b<kNumBuckets;++b)
+        counts[b] += other.counts[b];
+}
+
+StatsSnapshot GetStats() {
+    Registry &registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    StatsSnapshot total = registry.exited;
+    for(stats_internal::ThreadStats const*stats : registry.threads)
+        AddTo(*stats, total);
+    return total;
+}
+
+LatencyHistogram GetLatency(StatTimer timer) {
+    Registry &registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    LatencyHistogram total = registry.exited_latency[timer];
+    for(stats_internal::ThreadStats const*stats : registry.threads)
+        AddTo(*stats, timer, total);
+    return total;
+}
+
+void ResetStats() {
+    Registry &registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.exited = StatsSnapshot();
+    for(LatencyHistogram &histogram : registry.exited_latency)
+        histogram = LatencyHistogram();
+    for(stats_internal::ThreadStats *stats : registry.threads)
+        Clear(*stats);
+}
+
+stats_internal::ThreadStats::ThreadStats() {
+    Clear(*this);
+    Registry &registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.threads.push_back(this);
+}
+
+stats_internal::ThreadStats::~ThreadStats() {
+    Registry &registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    AddTo(*this, registry.exited);
+    for(int i=0;i<kNumStatTimers;++i)
+        AddTo(*this, StatTimer(i), registry.exited_latency[i]);
+    registry.threads.erase(std::find(registry.threads.begin(), registry.threads.end(), this));
+}
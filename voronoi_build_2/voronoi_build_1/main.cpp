@@ -11,66 +11,45 @@
 #include <stdio.h>
 #include <GLUT/glut.h>
 #include <cassert>
+#include <cmath>
 #include <cstdio>
 #include <vector>
 
 #include "Vec2f.h"
 #include "voronoi.h"
+#include "stats.h"
+#include "datasets.h"
 
 using namespace std;
 
-Voronoi voronoi;
+Voronoi<> voronoi;
 int random_seed = 234;
+// Starts empty, 'd' steps through the datasets
+DatasetKind dataset = kNumDatasetKinds;
+
+// The reference raster is kept between frames. Init() and a change of view redo all of it,
+// each Add only the pixels under the new site's cell, which are the only ones it changes.
+static const int nRefRows = 800;
+static const int nRefCols = 600;
+vector<uint32_t> ref_ids(nRefRows * nRefCols);
+Extrema2f ref_extents;
+bool ref_valid = false;
+// Added since the raster was last brought up to date
+vector<Voronoi<>::SiteHandle> ref_added;
 
 static void
 Init(void)
 {
-    voronoi = Voronoi();
-    /*
-    voronoi.Add(Vec2f(-0.6f, -0.5f));
-    voronoi.Add(Vec2f(0.3f, -0.3f));
-    voronoi.Add(Vec2f(-0.2f, 0.5f));
-    voronoi.Add(Vec2f(0,0));
-    voronoi.Add(Vec2f(0.65,-0.65));
-    voronoi.Add(Vec2f(-0.1, -0.1));
-
-    voronoi.Add(Vec2f(-1, -1));
-    voronoi.Add(Vec2f( 1, -1));
-    voronoi.Add(Vec2f( 1,  1));
-    voronoi.Add(Vec2f( 1, -1));
-     */
-    /*
-     // Random
-    srand(random_seed);
-    for(int pts = 0;pts<15;++pts)
-        voronoi.Add(Vec2f(float(rand()) / float(RAND_MAX), float(rand()) / float(RAND_MAX)));
-    */
-    /*
-    // Square
-    for(int row=0;row<5;++row) {
-        for(int col=0;col<5;++col) {
-            voronoi.Add(Vec2f(col, row) / Vec2f(4,4));
-        }
-    }
-    */
-/*
-    // Circle
-    // Hmm.. O(n) edges affected adding a point over and over..
-    for(int r = 0;r<25;++r) {
-        const float t = float(r) / float(25);
-        const float rads = t * M_PI * 2.0f;
-        voronoi.Add(Vec2f(::cos(rads) * 0.75f, ::sin(rads) * 0.75f));
-    }
-    voronoi.Add(Vec2f(0,0));
-*/
-    /*
-    // Spiral
-    for(int r = 0;r<25;++r) {
-        const float t = float(r) / float(25);
-        const float rads = t * M_PI * 2.0f;
-        voronoi.Add(Vec2f(::cos(rads) * 0.75f, ::sin(rads) * 0.75f) * (t+0.1));
-    }
-     */
+    voronoi = Voronoi<>();
+    ref_valid = false;
+    ref_added.clear();
+    if(dataset == kNumDatasetKinds)
+        return;
+    vector<Vec2f> pts;
+    // Hmm.. O(n) edges affected adding a point over and over, for cocircular
+    GenerateDataset(dataset, 25, random_seed, pts);
+    for(Vec2f const&pt : pts)
+        voronoi.Add(pt);
 }
 
 bool view_mode = false;
@@ -113,12 +92,18 @@ Key(unsigned char key, int x, int y)
             Init();
             glutPostRedisplay();
             break;
+        case 'd':
+            dataset = DatasetKind((dataset + 1) % (kNumDatasetKinds + 1));
+            fprintf(stderr, "dataset %s\n", (dataset == kNumDatasetKinds) ? "none" : DatasetName(dataset));
+            Init();
+            glutPostRedisplay();
+            break;
         case 's':
             selected_pt = pt_here;
             glutPostRedisplay();
             break;
         case 'a':
-            voronoi.Add(pt_here);
+            ref_added.push_back(voronoi.Add(pt_here));
             glutPostRedisplay();
             break;
     }
@@ -130,7 +115,33 @@ void SetColorForPt(Vec2f const&pt, float b) {
               b);
 }
 
-void GetSaneEdgeVerts(Voronoi::Edge const&edge,
+// Pixels whose centers are in the cell now go to site, where it is closer than what they had
+void UpdateRefForAdd(Voronoi<>::SiteHandle site) {
+    vector<Vec2f> cell;
+    if(!voronoi.Cell(site, ref_extents, cell) || cell.empty())
+        return;
+    Extrema2f box(cell.front(), cell.front());
+    for(Vec2f const&pt : cell)
+        box.DoEnclose(pt);
+    const Vec2f ref_pixel = ref_extents.GetSize() / Vec2f(nRefCols, nRefRows);
+    // One pixel of slack on either side, for round off
+    const Vec2f lo = (box.mMin - ref_extents.mMin) / ref_pixel - Vec2f(1, 1);
+    const Vec2f hi = (box.mMax - ref_extents.mMin) / ref_pixel + Vec2f(1, 1);
+    const int col_begin = std::max(0, int(std::floor(lo.x))), col_end = std::min(nRefCols, int(std::ceil(hi.x)));
+    const int row_begin = std::max(0, int(std::floor(lo.y))), row_end = std::min(nRefRows, int(std::ceil(hi.y)));
+    Vec2f const&site_pt = voronoi.Position(site);
+    for(int row = row_begin;row<row_end;++row) {
+        for(int col = col_begin;col<col_end;++col) {
+            const Vec2f loc = ref_extents.mMin + (Vec2f(col, row) + Vec2f(0.5f, 0.5f)) * ref_pixel;
+            uint32_t &id = ref_ids[row * nRefCols + col];
+            if(id == Voronoi<>::kNoSite ||
+               (loc - site_pt).SquaredLength() < (loc - voronoi.Position(id)).SquaredLength())
+                id = site;
+        }
+    }
+}
+
+void GetSaneEdgeVerts(Voronoi<>::Edge const&edge,
                       float const&max_dim,
                       Vec2f &min_pt,
                       Vec2f &max_pt) {
@@ -161,24 +172,32 @@ Draw(void)
     
     glMatrixMode(GL_MODELVIEW);
     
-    // Brute force reference
-    static const int nBruteRows = 800;
-    static const int nBruteCols = 600;
+    // Reference
+    if(!ref_valid || ref_extents.mMin != extents_expanded.mMin || ref_extents.mMax != extents_expanded.mMax) {
+        ref_extents = extents_expanded;
+        voronoi.RasterizeNearest(extents_expanded, nRefCols, nRefRows, ref_ids.data(), NULL);
+        ref_valid = true;
+    } else {
+        for(Voronoi<>::SiteHandle site : ref_added)
+            UpdateRefForAdd(site);
+    }
+    ref_added.clear();
+    const Vec2f ref_pixel = extents_expanded.GetSize() / Vec2f(nRefCols, nRefRows);
     glPointSize(1.5f);
     glBegin(GL_POINTS);
-    for(int row = 0;row<nBruteRows;++row) {
-        for(int col= 0;col<nBruteCols;++col) {
-            const Vec2f loc_r(float(col) / float(nBruteCols-1), float(row) / float(nBruteRows-1));
-            const Vec2f loc = extents_expanded.mMin + loc_r * extents_expanded.GetSize();
-            Vec2f closest = voronoi.BruteClosest(loc);
-            SetColorForPt(closest, 0);
+    for(int row = 0;row<nRefRows;++row) {
+        for(int col= 0;col<nRefCols;++col) {
+            const Vec2f loc = extents_expanded.mMin + (Vec2f(col, row) + Vec2f(0.5f, 0.5f)) * ref_pixel;
+            const Voronoi<>::SiteHandle closest = ref_ids[row * nRefCols + col];
+            if(closest == Voronoi<>::kNoSite)
+                continue;
+            SetColorForPt(voronoi.Position(closest), 0);
             glVertex2fv((float const*)&loc);
         }
     }
     glEnd();
 
-    vector<Vec2f> points;
-    voronoi.GetPoints(points);
+    const Voronoi<>::View<Vec2f> points = voronoi.PointView();
 
     glPointSize(5.0f);
     glBegin(GL_POINTS);
@@ -195,8 +214,7 @@ Draw(void)
     }
     glEnd();
     
-    vector<Voronoi::Edge> edges;
-    voronoi.GetEdges(edges);
+    const Voronoi<>::View<Voronoi<>::Edge> edges = voronoi.EdgeView();
     const float max_dim = std::max(extents_expanded.GetSize().x, extents_expanded.GetSize().y);
     glLineWidth(1.0f);
     glBegin(GL_LINES);
@@ -213,10 +231,10 @@ Draw(void)
     }
     glEnd();
     
-    vector<Vec2f> neighbor_pts;
-    vector<Voronoi::Edge> neighbor_edges;
+    vector<Voronoi<>::SiteHandle> neighbor_pts;
+    vector<Voronoi<>::Edge> neighbor_edges;
     
-    const Vec2f closest_selected = voronoi.Closest(selected_pt);
+    const Voronoi<>::SiteHandle closest_selected = voronoi.Closest(selected_pt);
     
     voronoi.NeighboringPoints(closest_selected, neighbor_pts);
     voronoi.NeighboringEdges(closest_selected, neighbor_edges);
@@ -224,10 +242,11 @@ Draw(void)
     glPointSize(6.0f);
     glBegin(GL_POINTS);
     glColor3f(1,1,1);
-    glVertex2fv((float const*)&closest_selected);
+    if(closest_selected != Voronoi<>::kNoSite)
+        glVertex2fv((float const*)&voronoi.Position(closest_selected));
     glColor3f(1,0,0);
-    for(Vec2f const&pt : neighbor_pts)
-        glVertex2fv((float const*)&pt);
+    for(Voronoi<>::SiteHandle neighbor : neighbor_pts)
+        glVertex2fv((float const*)&voronoi.Position(neighbor));
     glEnd();
     glLineWidth(2.0f);
     glBegin(GL_LINES);
@@ -241,7 +260,7 @@ Draw(void)
     glEnd();
     
     {
-        vector<Voronoi::Edge> affected_edges;
+        vector<Voronoi<>::Edge> affected_edges;
         voronoi.EdgesAffectedByAdd(selected_pt, affected_edges);
         glLineWidth(3.0f);
         glBegin(GL_LINES);
@@ -255,7 +274,7 @@ Draw(void)
         glEnd();
     }
     
-    fprintf(stderr, "--- drew\n");
+    TRACE_PRINTF("--- drew\n");
     
     glutSwapBuffers();
 }
@@ -0,0 +1,195 @@
+#ifndef voronoi_build_1_stats_h
+#define voronoi_build_1_stats_h
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+
+// Build with -DVORONOI_STATS=1 to count the work done on the hot paths, and with
+// -DVORONOI_TRACE=1 for the debugging printouts. Otherwise both compile to nothing.
+#ifndef VORONOI_STATS
+#define VORONOI_STATS 0
+#endif
+#ifndef VORONOI_TRACE
+#define VORONOI_TRACE 0
+#endif
+
+enum StatCounter {
+    // Orient() and InCircle() evaluations
+    kStatPredicates,
+    // Triangles stepped through by the point location walk
+    kStatWalkSteps,
+    // Triangles replaced by inserts
+    kStatCavityTriangles,
+    // Sites whose neighbors were scanned by Closest()
+    kStatSitesVisited,
+    // Edges found by EdgesAffectedByAdd()
+    kStatEdgesTouched,
+    // Distances computed by BruteClosest()
+    kStatBruteDistances,
+    // Edges flipped by Relax() and Move()
+    kStatFlips,
+    // Times the flips ran out of budget and the triangulation was built again
+    kStatFlipRebuilds,
+    // Calls after which the scratch buffers the diagram keeps had to grow, and by how much
+    kStatScratchGrowths,
+    kStatScratchBytes,
+    kNumStatCounters
+};
+
+enum StatMaximum {
+    // Most Voronoi vertices, triangles, searched by one EdgesAffectedByAdd()
+    kStatAffectedVertices,
+    kNumStatMaxima
+};
+
+// Wall time of the calls, including any of the others they make.
+// Add is timed per point, so AddRange() is counted once for each.
+enum StatTimer {
+    // Including the walk to a nearby start and the extents update
+    kStatTimeAdd,
+    // Per AddRange(), including the sort and the one extents update
+    kStatTimeAddBatch,
+    kStatTimeClosest,
+    kStatTimeEdgesAffected,
+    // Per call, however many candidates it has
+    kStatTimeEdgesAffectedBatch,
+    kStatTimeBruteClosest,
+    kStatTimeBruteBetween,
+    kStatTimeRaster,
+    kStatTimeHalfSpace,
+    kStatTimeCellsCrossingLine,
+    kStatTimeCellsCrossingRay,
+    kStatTimeCellsCrossingSegment,
+    kStatTimeCellsInRegion,
+    kStatTimeRelax,
+    kStatTimeMove,
+    // Per site, including the ones Advance() removes
+    kStatTimeRemove,
+    kStatTimeAdvance,
+    kNumStatTimers
+};
+
+const char *StatCounterName(StatCounter counter);
+const char *StatMaximumName(StatMaximum maximum);
+const char *StatTimerName(StatTimer timer);
+
+// Totals over all threads, including ones which have exited, since the last ResetStats()
+struct StatsSnapshot {
+    StatsSnapshot();
+
+    uint64_t counters[kNumStatCounters];
+    uint64_t maxima[kNumStatMaxima];
+    uint64_t calls[kNumStatTimers];
+    uint64_t ns[kNumStatTimers];
+
+    // The nonzero ones, one per line
+    void Print(FILE *out)const;
+};
+
+// Log-linear buckets of nanoseconds: exact below 16, then 16 per power of two, so any
+// value is within about 6% of its bucket. Up to 2^44 ns, longer is put in the last bucket.
+struct LatencyHistogram {
+    static const int kSubBuckets = 16;
+    static const int kNumBuckets = kSubBuckets * 41;
+
+    LatencyHistogram();
+
+    static inline int Bucket(uint64_t ns) {
+        if(ns < uint64_t(kSubBuckets))
+            return int(ns);
+        const int msb = 63 - __builtin_clzll(ns);
+        const int bucket = (msb - 3) * kSubBuckets + int((ns >> (msb - 4)) & (kSubBuckets - 1));
+        return std::min(bucket, kNumBuckets - 1);
+    }
+    // Smallest value in the bucket, and the number of values it holds
+    static uint64_t BucketLow(int bucket);
+    static uint64_t BucketWidth(int bucket);
+
+    uint64_t Count()const;
+    // Middle of the bucket holding the value at fraction p of the way through, 0 if empty
+    uint64_t Percentile(double p)const;
+    void Merge(LatencyHistogram const&other);
+
+    uint64_t counts[kNumBuckets];
+};
+
+// All zero unless built with VORONOI_STATS
+StatsSnapshot GetStats();
+// Of the calls to one timer, merged over all threads
+LatencyHistogram GetLatency(StatTimer timer);
+// Counts racing with a reset may be lost
+void ResetStats();
+
+namespace stats_internal {
+    // Only written by its own thread, the atomics are so others can read while it runs
+    struct ThreadStats {
+        ThreadStats();
+        // Folds the counts into the totals of exited threads
+        ~ThreadStats();
+
+        std::atomic<uint64_t> counters[kNumStatCounters];
+        std::atomic<uint64_t> maxima[kNumStatMaxima];
+        std::atomic<uint64_t> calls[kNumStatTimers];
+        std::atomic<uint64_t> ns[kNumStatTimers];
+        std::atomic<uint64_t> latency[kNumStatTimers][LatencyHistogram::kNumBuckets];
+    };
+
+    inline ThreadStats &Local() {
+        static thread_local ThreadStats local;
+        return local;
+    }
+
+    // No locked instruction, there is only one writer
+    inline void Bump(std::atomic<uint64_t> &value, uint64_t n) {
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    inline void Count(StatCounter counter, uint64_t n) {
+        Bump(Local().counters[counter], n);
+    }
+
+    inline void Max(StatMaximum maximum, uint64_t value) {
+        std::atomic<uint64_t> &current = Local().maxima[maximum];
+        if(value > current.load(std::memory_order_relaxed))
+            current.store(value, std::memory_order_relaxed);
+    }
+
+    class ScopedTimer {
+    public:
+        ScopedTimer(StatTimer timer) : timer_(timer), start_(std::chrono::steady_clock::now()) { }
+        ~ScopedTimer() {
+            const std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start_;
+            const uint64_t ns = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+            ThreadStats &local = Local();
+            Bump(local.calls[timer_], 1);
+            Bump(local.ns[timer_], ns);
+            Bump(local.latency[timer_][LatencyHistogram::Bucket(ns)], 1);
+        }
+
+    private:
+        StatTimer timer_;
+        std::chrono::steady_clock::time_point start_;
+    };
+}
+
+#if VORONOI_STATS
+#define STAT_COUNT(counter, n) stats_internal::Count(counter, n)
+#define STAT_MAX(maximum, value) stats_internal::Max(maximum, value)
+#define STAT_TIMER(timer) stats_internal::ScopedTimer stat_timer_(timer)
+#else
+#define STAT_COUNT(counter, n) do { } while(0)
+#define STAT_MAX(maximum, value) do { } while(0)
+#define STAT_TIMER(timer) do { } while(0)
+#endif
+
+#if VORONOI_TRACE
+#define TRACE_PRINTF(...) fprintf(stderr, __VA_ARGS__)
+#else
+// Still type checks the arguments, and keeps them used
+#define TRACE_PRINTF(...) do { if(0) fprintf(stderr, __VA_ARGS__); } while(0)
+#endif
+
+#endif
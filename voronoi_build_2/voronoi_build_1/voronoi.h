@@ -10,38 +10,290 @@
 #define voronoi_build_1_voronoi_h
 
 #include "Vec2f.h"
+#include "stats.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cfloat>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <tuple>
 #include <vector>
 #include <map>
 #include <set>
 
+
+inline bool line_intersection(Vec2f p1, Vec2f p2, Vec2f p3, Vec2f p4, Vec2f &out_pt) {
+    // Store the values for fast access and easy
+    // equations-to-code conversion
+    float x1 = p1.x, x2 = p2.x, x3 = p3.x, x4 = p4.x;
+    float y1 = p1.y, y2 = p2.y, y3 = p3.y, y4 = p4.y;
+
+    float d = (x1 - x2) * (y3 - y4) - (y1 - y2) * (x3 - x4);
+    // If d is zero, there is no intersection
+    if (::fabs(d) < 0.0001f) return false;
+
+    // Get the x and y
+    float pre = (x1*y2 - y1*x2), post = (x3*y4 - y3*x4);
+    float x = ( pre * (x3 - x4) - (x1 - x2) * post ) / d;
+    float y = ( pre * (y3 - y4) - (y1 - y2) * post ) / d;
+
+    out_pt.x = x;
+    out_pt.y = y;
+    return true;
+}
+
+// Bounded queue between one producer thread and one consumer thread, without locks.
+// The capacity is rounded up to a power of two.
+template<typename T>
+class SpscRing {
+public:
+    explicit SpscRing(size_t capacity)
+    : head_(0),
+      tail_(0)
+    {
+        size_t size = 1;
+        while(size < capacity)
+            size *= 2;
+        slots_.resize(size);
+        mask_ = size - 1;
+    }
+
+    // Producer side. Only grows while the producer waits, as the consumer pops.
+    inline size_t FreeSpace()const {
+        return mask_ + 1 - (head_.load(std::memory_order_relaxed) - tail_.load(std::memory_order_acquire));
+    }
+    inline bool TryPush(T const&value) {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        if(head - tail_.load(std::memory_order_acquire) > mask_)
+            return false;
+        slots_[head & mask_] = value;
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side
+    inline bool TryPop(T &value) {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        if(tail == head_.load(std::memory_order_acquire))
+            return false;
+        value = slots_[tail & mask_];
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::vector<T> slots_;
+    size_t mask_;
+    // Apart, so the two threads do not share a cache line
+    std::atomic<size_t> head_;
+    char padding_[64];
+    std::atomic<size_t> tail_;
+};
+
+// Quadtree fill of a width x height raster, out[row * width + col].
+// A block whose four corner pixels have the same value is filled with it without evaluating
+// the rest, otherwise it is split in four. Blocks up to min_block wide are evaluated in full.
+// With min_block = 1 this is exact if every value covers a convex region, like a Voronoi cell.
+template<typename T>
+class QuadtreeRaster {
+public:
+    QuadtreeRaster(uint32_t width, uint32_t height, uint32_t min_block, T *out)
+    : width_(width),
+      min_block_(std::max(1u, min_block)),
+      out_(out),
+      known_(size_t(width) * height, 0)
+    {
+
+    }
+
+    // eval(col, row) gives the value of one pixel.
+    // Can be called from several threads at once, on blocks which do not overlap.
+    template<typename Eval>
+    void Fill(uint32_t col_begin, uint32_t row_begin,
+              uint32_t col_end, uint32_t row_end,
+              Eval &eval) {
+        if(col_begin >= col_end || row_begin >= row_end)
+            return;
+        if(col_end - col_begin <= min_block_ && row_end - row_begin <= min_block_) {
+            for(uint32_t row=row_begin;row<row_end;++row)
+                for(uint32_t col=col_begin;col<col_end;++col)
+                    Get(col, row, eval);
+            return;
+        }
+        const T value = Get(col_begin, row_begin, eval);
+        if(Get(col_end - 1, row_begin, eval) == value &&
+           Get(col_begin, row_end - 1, eval) == value &&
+           Get(col_end - 1, row_end - 1, eval) == value) {
+            for(uint32_t row=row_begin;row<row_end;++row)
+                std::fill(out_ + size_t(row) * width_ + col_begin, out_ + size_t(row) * width_ + col_end, value);
+            return;
+        }
+        const uint32_t col_mid = (col_begin + col_end + 1) / 2;
+        const uint32_t row_mid = (row_begin + row_end + 1) / 2;
+        Fill(col_begin, row_begin, col_mid, row_mid, eval);
+        Fill(col_mid, row_begin, col_end, row_mid, eval);
+        Fill(col_begin, row_mid, col_mid, row_end, eval);
+        Fill(col_mid, row_mid, col_end, row_end, eval);
+    }
+    // For values which, in every column, change at most once going away from split_row on
+    // either side of it, like a band along a line which is wider in some places. A block on one
+    // side is filled with a value if its rows nearest to and farthest from split_row are all
+    // that value, otherwise it is split in four. Exact for such values, whatever their shape,
+    // and min_block is not used.
+    template<typename Eval>
+    void FillFromRow(uint32_t col_begin, uint32_t row_begin,
+                     uint32_t col_end, uint32_t row_end,
+                     uint32_t split_row, Eval &eval) {
+        if(col_begin >= col_end || row_begin >= row_end)
+            return;
+        if(row_begin < split_row && split_row < row_end) {
+            FillFromRow(col_begin, row_begin, col_end, split_row, split_row, eval);
+            FillFromRow(col_begin, split_row, col_end, row_end, split_row, eval);
+            return;
+        }
+        const uint32_t near_row = (row_begin >= split_row) ? row_begin : row_end - 1;
+        const uint32_t far_row = (row_begin >= split_row) ? row_end - 1 : row_begin;
+        const T value = Get(col_begin, near_row, eval);
+        bool uniform = true;
+        for(uint32_t col=col_begin;col<col_end && uniform;++col)
+            uniform = Get(col, near_row, eval) == value && Get(col, far_row, eval) == value;
+        if(uniform) {
+            for(uint32_t row=row_begin;row<row_end;++row)
+                std::fill(out_ + size_t(row) * width_ + col_begin, out_ + size_t(row) * width_ + col_end, value);
+            return;
+        }
+        if(row_end - row_begin <= 2) {
+            for(uint32_t row=row_begin;row<row_end;++row)
+                for(uint32_t col=col_begin;col<col_end;++col)
+                    Get(col, row, eval);
+            return;
+        }
+        const uint32_t col_mid = (col_begin + col_end + 1) / 2;
+        const uint32_t row_mid = (row_begin + row_end + 1) / 2;
+        FillFromRow(col_begin, row_begin, col_mid, row_mid, split_row, eval);
+        FillFromRow(col_mid, row_begin, col_end, row_mid, split_row, eval);
+        FillFromRow(col_begin, row_mid, col_mid, row_end, split_row, eval);
+        FillFromRow(col_mid, row_mid, col_end, row_end, split_row, eval);
+    }
+
+private:
+    template<typename Eval>
+    inline T const&Get(uint32_t col, uint32_t row, Eval &eval) {
+        const size_t i = size_t(row) * width_ + col;
+        if(!known_[i]) {
+            out_[i] = eval(col, row);
+            known_[i] = 1;
+        }
+        return out_[i];
+    }
+
+    uint32_t width_;
+    uint32_t min_block_;
+    T *out_;
+    // Pixels which have been evaluated
+    std::vector<uint8_t> known_;
+};
+
+
+// The geometry of the diagram. Use Voronoi<Payload> below, which also stores per-site data.
 // TODO: Shared structure / persistence, so 2nd, 3rd, etc, closest can be found
-class Voronoi {
+class VoronoiBase {
 public:
-    Voronoi();
-    
-    // Will not add duplicate points
-    void Add(Vec2f const&pt);
-    void Remove(Vec2f const&pt);
+    // Stable index of a site. Once a site is removed, its handle goes to a later add.
+    typedef uint32_t SiteHandle;
+    static const SiteHandle kNoSite = 0xFFFFFFFF;
+
+    VoronoiBase();
+
+    // Will not add duplicate points, returns the existing handle instead
+    SiteHandle Add(Vec2f const&pt);
+    // Adds a batch in biased randomized insertion order, Hilbert sorted within each round,
+    // so that every insert starts walking from a nearby site.
+    template<typename It>
+    void AddRange(It begin, It end) {
+        std::vector<Vec2f> pts(begin, end);
+        std::vector<SiteHandle> handles;
+        AddBatch(pts, handles);
+    }
+    // The hole is filled from the site's neighbors, so the cost is in their number.
+    // False if site was already removed.
+    bool Remove(SiteHandle site);
+    // Streaming: the site goes at the first Advance() whose now is at least expires.
+    // For a point which is already a site, the later expiry is kept.
+    SiteHandle AddUntil(Vec2f const&pt, double expires);
+    // Removes the sites which have expired by now, as one batch. Returns how many.
+    size_t Advance(double now);
+    // Room for this many sites in all, so that adding up to it does not allocate
+    void Reserve(size_t num_sites);
+
+    SiteHandle Closest(Vec2f const&pt)const;
+
+    // Read-only view straight over internal storage, valid until the diagram changes
+    template<typename T>
+    class View {
+    public:
+        View() : begin_(NULL), end_(NULL) { }
+        View(T const*begin, T const*end) : begin_(begin), end_(end) { }
 
-    Vec2f Closest(Vec2f const&pt)const;
+        inline T const*begin()const { return begin_; }
+        inline T const*end()const { return end_; }
+        inline size_t size()const { return end_ - begin_; }
+        inline bool empty()const { return begin_ == end_; }
+        inline T const&operator[](size_t i)const { return begin_[i]; }
+    private:
+        T const*begin_, *end_;
+    };
+
+    // Changes whenever a site is added, moved or removed, so callers can tell a view is stale
+    inline uint64_t Generation()const {
+        return generation_;
+    }
+
+    inline Vec2f const&Position(SiteHandle site)const {
+        return sites_[site];
+    }
+    // Handles in use or free, the length of everything indexed by handle
+    inline size_t NumSites()const {
+        return sites_.size();
+    }
+    inline size_t NumLiveSites()const {
+        return sites_.size() - free_sites_.size();
+    }
+    // A removed site keeps its last position until the handle is used again
+    inline bool IsRemoved(SiteHandle site)const {
+        return removed_[site] != 0;
+    }
 
     struct Edge {
         Edge(Vec2f const&a, Vec2f const&b);
         Edge(Vec2f const&a, Vec2f const&b, Extrema1f const&extents);
-        
+        Edge(SiteHandle site_a, Vec2f const&a,
+             SiteHandle site_b, Vec2f const&b,
+             Extrema1f const&extents);
+
+        // Sites are kNoSite for edges which are not part of a diagram
+        SiteHandle site_a, site_b;
         Vec2f pt_a, pt_b;
         // min may be -FLT_MAX, max may be FLT_MAX, if the edge is a ray or a line
         Extrema1f extents;
-        
+
         inline Vec2f closest_pt_on_edge(Vec2f const&pt) const {
             const float closest_t_on_line = (pt - mid()).Dot(dir());
             const float closest_t_on_edge = std::max(extents.mMin[0],
                                               std::min(extents.mMax[0], closest_t_on_line));
             return mid() + dir() * closest_t_on_edge;
         }
-        
+
+        inline bool intersects_line(Vec2f const&o, Vec2f const&d) const {
+            Vec2f ipt;
+            if(!line_intersection(mid(), mid() + dir(), o, o + d, ipt))
+                return false;
+            const float int_t = (ipt - mid()).Dot(dir());
+            return (int_t >= extents.mMin[0]) && (int_t <= extents.mMax[0]);
+        }
+
         inline float distance_to_point(Vec2f const&pt) const {
             const Vec2f closest_pt = closest_pt_on_edge(pt);
             return (closest_pt - pt).Length();
@@ -50,12 +302,12 @@ public:
         inline Vec2f mid() const {
             return (pt_a + pt_b) / 2.0f;
         }
-        
+
         inline Vec2f dir() const {
             Vec2f a_to_b = (pt_a - pt_b).Normalized();
             return Vec2f(-a_to_b.y, a_to_b.x);
         }
-        
+
         inline Vec2f min_pt(const float max_dim) const {
             const float t = (extents.mMin[0] != -FLT_MAX) ? extents.mMin[0] : -max_dim;
             return mid() + dir() * t;
@@ -66,29 +318,179 @@ public:
             return mid() + dir() * t;
         }
     };
-    
-    bool NeighboringPoints(Vec2f const&pt, std::vector<Vec2f> &output)const;
-    bool NeighboringEdges(Vec2f const&pt, std::vector<Edge> &output)const;
-    
+
+    // One entry of the change feed. Each update to the diagram is written as the edges it
+    // removed, then the edges it added, then the sites whose neighbors changed, then kEndUpdate.
+    // An edge whose geometry changed is both removed and added. Edges are the ones GetEdges()
+    // gives, but removed ones are named only by their sites, the lesser handle first.
+    struct Change {
+        enum Kind {
+            kEdgeRemoved,
+            kEdgeAdded,
+            kNeighborsChanged,
+            kEndUpdate,
+            // Updates were dropped, or changed everything, so read the whole diagram again
+            kReset
+        };
+
+        Change() : kind(kEndUpdate), edge(Vec2f(0, 0), Vec2f(0, 0), MakeEdgeExtents(0, 0)), site(kNoSite), generation(0) { }
+
+        Kind kind;
+        Edge edge;
+        // Of kNeighborsChanged
+        SiteHandle site;
+        // Generation() after the update, on each entry
+        uint64_t generation;
+    };
+    typedef SpscRing<Change> ChangeRing;
+    // Opt in to the change feed. Every later update is written to ring on the thread making
+    // it, for one other thread to read, so deltas can be applied in the size of the change.
+    // When the ring is too full for an update, it is dropped, and the next one which fits
+    // starts with kReset. Relax() is always a kReset. NULL turns the feed off.
+    void SetChangeFeed(ChangeRing *ring);
+
+    bool NeighboringPoints(SiteHandle site, std::vector<SiteHandle> &output)const;
+    bool NeighboringEdges(SiteHandle site, std::vector<Edge> &output)const;
+
     // anywhere is a point in space which does not necessarily have to have been added via Add()
-    // Returns a list of the edges which would be affected if a point were added here
+    // Returns a list of the edges which would be affected if a point were added here.
+    // Uses scratch in the diagram, so not safe to call concurrently with itself.
     void EdgesAffectedByAdd(Vec2f const&anywhere,
                             std::vector<Edge> &edges)const;
-    // Remove?
+    // Compressed rows: the edges for candidate c are edges[offsets[c]] up to edges[offsets[c+1]],
+    // as sorted indices into EdgeView()
+    struct AffectedEdges {
+        std::vector<uint32_t> offsets;
+        std::vector<uint32_t> edges;
+    };
+    // EdgesAffectedByAdd() for many points. They are Hilbert sorted, so each point location
+    // starts from the one before, and split across threads.
+    // Safe to call from several threads at once, and alongside EdgeView() and GetEdges().
+    void EdgesAffectedByAddBatch(std::vector<Vec2f> const&candidates, AffectedEdges &output)const;
+
+    // Sites whose cells the line through o along d crosses, in order along d. The cell at o
+    // is located, then the walk goes from cell to cell through the edges the line crosses,
+    // so the cost is in the number of cells crossed. Where the line passes exactly through
+    // a vertex, a cell which it only touches there may be left out.
+    void CellsCrossingLine(Vec2f const&o, Vec2f const&d, std::vector<SiteHandle> &output)const;
+    // The same, only from o on
+    void CellsCrossingRay(Vec2f const&o, Vec2f const&d, std::vector<SiteHandle> &output)const;
+    // From the cell holding a to the one holding b
+    void CellsCrossingSegment(Vec2f const&a, Vec2f const&b, std::vector<SiteHandle> &output)const;
+
+    // Sites whose cells touch the convex polygon, in no particular order. The cell at the first
+    // corner is located, then the fill spreads to neighboring cells, clipping only those whose
+    // sites are outside the polygon, so the cost is in the number of cells found. Cells which
+    // only touch it at a point may be left out.
+    // Uses scratch in the diagram, so not safe to call concurrently with itself.
+    void CellsInRegion(std::vector<Vec2f> const&polygon, std::vector<SiteHandle> &output)const;
+    void CellsInRegion(Extrema2f const&box, std::vector<SiteHandle> &output)const;
+
+    // The cell of site clipped to clip_box, counter clockwise, empty if it misses the box.
+    // Uses scratch in the diagram, so not safe to call concurrently with itself.
+    bool Cell(SiteHandle site, Extrema2f const&clip_box, std::vector<Vec2f> &output)const;
+    struct CellStats {
+        CellStats() : area(0), perimeter(0) { }
+
+        double area;
+        // The site, if the area is 0
+        Vec2f centroid;
+        double perimeter;
+    };
+    // Of Cell(site, clip_box). Cached per site until an insert changes that cell, or until a
+    // call with some other clip_box. Not safe to call concurrently with itself.
+    CellStats GetCellStats(SiteHandle site, Extrema2f const&clip_box)const;
+
+    // Lloyd relaxation. Each iteration moves every site to the centroid of its cell clipped to
+    // clip_box, with the centroids found in parallel. The triangulation is then repaired by
+    // flipping edges rather than built again, since most cells keep their neighbors.
+    // A site whose move would fold a triangle over waits for the next iteration, and one whose
+    // cell misses the box stays where it is. Stops early once no site would move further than
+    // tolerance. Handles and payloads are kept. Returns the number of iterations done.
+    // Does nothing while the sites are all on one line.
+    unsigned Relax(unsigned iterations, Extrema2f const&clip_box, float tolerance = 0);
+    // Moves site to pt, keeping its handle and payload. While the site stays inside the polygon
+    // of its neighbors the triangles around it are kept, and only the edges which are no longer
+    // Delaunay are flipped, so the cost is in the number of neighbors. A longer jump takes the
+    // site out and inserts it again. False, and nothing moves, if pt is already another site.
+    bool Move(SiteHandle site, Vec2f const&pt);
 
     void GetEdges(std::vector<Edge> &output)const;
+    // Indexed by handle. Removed handles keep their last position, skip them with IsRemoved().
     void GetPoints(std::vector<Vec2f> &output)const;
-    
+    // Edges are built on the first call after a change, then cached. Safe to call from
+    // several threads at once, the view stays good until the next change.
+    View<Edge> EdgeView()const;
+    // Indexed by handle, with the removed ones in it as for GetPoints()
+    inline View<Vec2f> PointView()const {
+        return View<Vec2f>(sites_.data(), sites_.data() + sites_.size());
+    }
+
+    // The Delaunay dual, as flat arrays which can be written out as they are.
+    // Only finite triangles are included, numbered densely.
+    struct Triangulation {
+        static const uint32_t kNoNeighbor = 0xFFFFFFFF;
+
+        // Three site handles per triangle, counter clockwise
+        std::vector<uint32_t> triangles;
+        // neighbors[3*t+i] is the triangle across from triangles[3*t+i], kNoNeighbor on the hull
+        std::vector<uint32_t> neighbors;
+        // The triangles touching site s are incident[incident_offsets[s]] up to
+        // incident[incident_offsets[s+1]], NumSites()+1 offsets
+        std::vector<uint32_t> incident_offsets;
+        std::vector<uint32_t> incident;
+
+        inline size_t NumTriangles()const {
+            return triangles.size() / 3;
+        }
+    };
+    // Copies out of the diagram as it is stored, nothing is triangulated again
+    void ExportTriangulation(Triangulation &output)const;
+
+    // Closest site to the center of each pixel, row major, width*height each.
+    // Pixel (col, row) covers bounds.mMin + (col, row) * bounds.GetSize() / (width, height).
+    // dist may be NULL, otherwise it gets the distance to the closest site.
+    // Ties go to either site. Rows and columns are split across threads.
+    // A column pass and a row pass of parabola envelopes, O(pixels + sites) only while no pixel
+    // column holds two sites, counting the sites left and right of bounds as in the first and
+    // last column. Otherwise every pixel also walks the Delaunay graph from the envelope's pick,
+    // so with many more sites than columns it costs about a short walk per pixel.
+    void RasterizeNearest(Extrema2f const&bounds,
+                          uint32_t width, uint32_t height,
+                          uint32_t *ids, float *dist)const;
+    // Same pixels as RasterizeNearest(), and the same sites BruteClosest() would give, ties included.
+    // Each cell is clipped to bounds and scan filled, only pixels close to a cell edge are tested.
+    // Bands of rows are split across threads.
+    void RasterizeCells(Extrema2f const&bounds,
+                        uint32_t width, uint32_t height,
+                        uint32_t *ids)const;
+    // Same pixels as RasterizeNearest(), filled with QuadtreeRaster, so the cost follows the
+    // number of cells on screen rather than the number of pixels. Ties go to either site.
+    // Tiles are split across threads.
+    void RasterizeQuadtree(Extrema2f const&bounds,
+                           uint32_t width, uint32_t height,
+                           uint32_t *ids)const;
+
     // The diagram is actually infinite, but this gets the extents of graph nodes (vertices)
     // If no vertices exist, it will at least be the bounding box of the points provided.
     Extrema2f GetDiagramDetailExtents()const;
-    
+
     // Temp
     static bool EdgesIntersect(Edge const&a,
                                Edge const&b,
                                float &t_a);
     // O(n) closest pt
-    Vec2f BruteClosest(Vec2f const&pt)const;
+    SiteHandle BruteClosest(Vec2f const&pt)const;
+
+protected:
+    // Sets added to false for duplicates
+    SiteHandle Add(Vec2f const&pt, bool &added);
+    // handles[i] is set to the handle of pts[i]. added may be NULL, otherwise added[i]
+    // is set to whether pts[i] made a new site.
+    void AddBatch(std::vector<Vec2f> const&pts, std::vector<SiteHandle> &handles,
+                  std::vector<uint8_t> *added = NULL);
+    // Only ever makes the expiry of site later
+    void ExtendExpiry(SiteHandle site, double expires);
 
 private:
     inline static bool pt_less(Vec2f const&a, Vec2f const&b) {
@@ -97,32 +499,340 @@ private:
         return a.x < b.x;
     }
 
-    
-    typedef std::multimap<Vec2f, Vec2f> Neighbors;
-    // Lesser ID must be first, according to pt_less()
-    typedef std::tuple<Vec2f, Vec2f> NeighborId;
-    typedef std::map<NeighborId, Extrema1f> Edges;
-    inline static NeighborId MakeNeighborId(Vec2f const&a, Vec2f const&b) {
-        return pt_less(a, b) ? NeighborId(a,b) : NeighborId(b,a);
+    // Lesser ID must be first
+    typedef std::tuple<SiteHandle, SiteHandle> NeighborId;
+    inline static NeighborId MakeNeighborId(SiteHandle a, SiteHandle b) {
+        return (a < b) ? NeighborId(a,b) : NeighborId(b,a);
     }
     inline static Extrema1f MakeEdgeExtents(float min_t, float max_t) {
         return Extrema1f(Vec1f(min_t), Vec1f(max_t));
     }
     bool BruteIsBetweenNeighbors(Vec2f const&test_pt, NeighborId const&neighbors)const;
 
-    // Recursive search
-    void EdgesAffectedByAddInternal(const Vec2f const&new_pt,
-                                    const Vec2f const&existing_pt,
-                                    const float max_dim,
-                                    std::set<NeighborId> &edges,
-                                    std::set<Vec2f> &points_visited)const;
-
-    
-    std::set<Vec2f> points_;
-    Neighbors neighbors_;
-    Edges edges_;
+    // Whether some point of edge is closer to new_pt than to the edge's sites
+    bool IsAffectedByAdd(Edge const&edge, Vec2f const&new_pt)const;
+    // A search stamps what it has reached, triangles or sites, with its own number
+    struct SearchScratch {
+        SearchScratch() : stamp(0) { }
+
+        std::vector<uint32_t> stamps;
+        uint32_t stamp;
+        std::vector<uint32_t> stack;
+    };
+    // found(t, i) once for each edge which a site at pt would take points from, the dual of the
+    // edge opposite v[i] in triangle t. Before there are triangles t is kNoTriangle and i is
+    // the edge's place in the chain. The walk to pt starts at hint, which is left next to pt.
+    // False if pt is already a site.
+    template<typename F>
+    bool ForEachAffectedEdge(Vec2f const&pt, SiteHandle &hint, SearchScratch &scratch, F found)const;
+
+    // The diagram is stored as its Delaunay dual. Voronoi edges are Delaunay edges,
+    // and Voronoi vertices are triangle circumcenters.
+    // kInfinite is a virtual vertex which closes the convex hull, so every Delaunay edge
+    // has a triangle on both sides. Hull edges are the Voronoi rays.
+    static const uint32_t kInfinite = 0xFFFFFFFF;
+    static const uint32_t kDead = 0xFFFFFFFE;
+    static const uint32_t kNoTriangle = 0xFFFFFFFF;
+    static const uint32_t kNoEdge = 0xFFFFFFFF;
+
+    struct Triangle {
+        // Counter clockwise. n[i] is the triangle across the edge opposite v[i].
+        uint32_t v[3];
+        uint32_t n[3];
+    };
+
+    inline static unsigned Next(unsigned i) {
+        return (i == 2) ? 0 : (i + 1);
+    }
+    inline static unsigned Prev(unsigned i) {
+        return (i == 0) ? 2 : (i - 1);
+    }
+    inline int InfiniteIndex(uint32_t t)const {
+        Triangle const&tri = tris_[t];
+        for(unsigned i=0;i<3;++i)
+            if(tri.v[i] == kInfinite)
+                return i;
+        return -1;
+    }
+    inline bool Triangulated()const {
+        return !tris_.empty();
+    }
+
+    // Sets added to false for duplicates
+    SiteHandle AddInternal(Vec2f const&pt, bool &added);
+    // Remove() without updating the extents
+    bool RemoveInternal(SiteHandle site);
+    // The change feed's record of the update being made. Edges of triangles which die are
+    // removed, unless the triangle was born in the same update, and the edges of the born
+    // ones which are still alive at the end are added.
+    inline void FeedKill(uint32_t t) {
+        if(feed_)
+            FeedKillTriangle(t);
+    }
+    inline void FeedBorn(uint32_t t) {
+        if(feed_)
+            FeedBornTriangle(t);
+    }
+    // Between consecutive sites of the chain
+    inline void FeedChainEdge(SiteHandle a, SiteHandle b, bool added) {
+        if(feed_)
+            FeedChainEdgeChanged(a, b, added);
+    }
+    void FeedKillTriangle(uint32_t t);
+    void FeedBornTriangle(uint32_t t);
+    void FeedChainEdgeChanged(SiteHandle a, SiteHandle b, bool added);
+    // Writes the update out, or kReset alone
+    void FeedEnd(bool reset = false);
+    // Whichever of start and the site hint_grid_ has near pt is closer to pt
+    SiteHandle WalkStart(Vec2f const&pt, SiteHandle start);
+    uint32_t HintCell(Vec2f const&pt)const;
+    void NoteHint(SiteHandle site);
+    void RebuildHints();
+    void InsertCollinear(SiteHandle site);
+    void Triangulate(SiteHandle apex);
+    void InsertTriangulated(SiteHandle site);
+    uint32_t Locate(Vec2f const&pt, SiteHandle hint)const;
+    bool InConflict(uint32_t t, Vec2f const&pt)const;
+    uint32_t NewTriangle(uint32_t a, uint32_t b, uint32_t c);
+    void LinkTriangles(std::vector<uint32_t> const&new_tris);
+    SiteHandle ClosestSite(Vec2f const&pt, SiteHandle hint)const;
+    // Whether some of the polygon is in the cell of site
+    bool CellTouchesPolygon(SiteHandle site, std::vector<Vec2f> const&polygon)const;
+    typedef std::vector<std::pair<double, double> > ClipPolygon;
+    // The part of poly in the cell of site, by clipping it to each bisector
+    void ClipToCell(SiteHandle site, ClipPolygon &poly, ClipPolygon &scratch)const;
+    void ClipBoxToCell(SiteHandle site, Extrema2f const&box, ClipPolygon &poly, ClipPolygon &scratch)const;
+    // Of the clipped cell of site
+    CellStats MeasureCell(SiteHandle site, ClipPolygon const&poly)const;
+    // Whether a finite triangle is no longer counter clockwise, or the hull no longer turns
+    // the right way at the end of an infinite one's edge. corners gets the sites tested.
+    bool IsFolded(uint32_t t, uint32_t (&corners)[3])const;
+    // Lawson's flips until every edge is Delaunay again
+    void RestoreDelaunay();
+    // The same, only starting from the edges in flip_stack_. If the flips do not settle,
+    // builds the triangulation again instead.
+    void FlipUntilDelaunay();
+    // Inserts the sites in the triangulation into an empty one, keeping their handles
+    void Retriangulate();
+    // Flips the edge opposite v[i] in t if the site across it is in t's circumcircle
+    bool FlipIfIllegal(uint32_t t, unsigned i);
+    void ReplaceNeighbor(uint32_t t, uint32_t from, uint32_t to);
+    // Move() without changing which triangles site is in. False, with nothing changed,
+    // if one of them would fold over.
+    bool MoveWithinStar(SiteHandle site, Vec2f const&pt);
+    // Takes site out of the triangulation and fills the hole, the handle stays
+    void Detach(SiteHandle site);
+    // Fills the hole with the triangle hole_[k].a, hole_[k].b, hole_[k+1].b
+    void ClipEar(size_t k);
+    bool IsEar(size_t k)const;
+    inline void InvalidateCell(SiteHandle site) {
+        if(site < cell_stats_valid_.size())
+            cell_stats_valid_[site] = 0;
+    }
+    // Appends the cells after site along o + t * d, up to t_end
+    void WalkCells(Vec2f const&o, Vec2f const&d, double t_end, SiteHandle site,
+                   std::vector<SiteHandle> &output)const;
+    // Edge between two sites, oriented by pt_less()
+    Edge MakeSiteEdge(SiteHandle a, SiteHandle b, Extrema1f const&extents)const;
+    template<typename F>
+    void ForEachNeighbor(SiteHandle site, F f)const;
+    // f(neighbor, t, i) for each Voronoi edge of site, the dual of the edge opposite v[i] in
+    // triangle t. Before there are triangles t is kNoTriangle, and the edges are lines.
+    template<typename F>
+    void ForEachEdgeOfSite(SiteHandle site, F f)const;
+    // Voronoi edge dual to the Delaunay edge opposite v[i] in triangle t
+    Edge MakeEdge(uint32_t t, unsigned i)const;
+    bool IsDegenerateEdge(uint32_t t, unsigned i)const;
+    // The extents are kept in four heaps, greatest first: extent_heaps_[h] holds
+    // (coordinate, key) pairs for axis h % 2, negated for h < 2 so those give the minimum.
+    // A key is a triangle, whose coordinate is of its circumcenter, or a site or'd with kSiteKey.
+    // Entries of triangles which have died are only dropped once they come to the top.
+    typedef std::pair<float, uint32_t> ExtentEntry;
+    static const uint32_t kSiteKey = 0x80000000;
+    void PushExtents(uint32_t key, Vec2f const&pt);
+    bool IsCurrentExtent(unsigned h, ExtentEntry const&entry)const;
+    // Pops the stale tops and sets extents_, O(log n) amortized per change
+    void UpdateExtents();
+    // From scratch, when the heaps are mostly stale
+    void RebuildExtents();
+    // ids[3*t+i] is the index in output of the edge opposite v[i] in triangle t, or kNoEdge
+    void BuildEdges(std::vector<Edge> &output, std::vector<uint32_t> &ids)const;
+    // Delaunay neighbors of site s are neighbors[offsets[s]] up to neighbors[offsets[s+1]]
+    void BuildNeighborLists(std::vector<uint32_t> &offsets, std::vector<SiteHandle> &neighbors)const;
+    // BruteClosest(), by walking the neighbor lists from start. visited is scratch.
+    SiteHandle WalkBruteClosest(Vec2f const&pt, SiteHandle start,
+                                std::vector<uint32_t> const&offsets,
+                                std::vector<SiteHandle> const&neighbors,
+                                std::vector<SiteHandle> &visited)const;
+
+    // Indexed by handle
+    std::vector<Vec2f> sites_;
+    std::vector<uint8_t> removed_;
+    // Handles of removed sites, for the next adds
+    std::vector<SiteHandle> free_sites_;
+    // -HUGE_VAL for sites which do not expire. Entries in the heap, soonest first, are stale
+    // once the site is removed or its expiry changes, and are dropped when they come up.
+    std::vector<double> expiries_;
+    std::vector<std::pair<double, SiteHandle> > expiry_heap_;
+    // Some triangle touching each site
+    std::vector<uint32_t> site_tris_;
+    std::vector<Triangle> tris_;
+    std::vector<uint32_t> free_tris_;
+    // Until three sites are not collinear, there are no triangles,
+    // only a chain of parallel edges. Sorted along the line.
+    std::vector<SiteHandle> collinear_;
+    // Every insert starts its walk here
+    SiteHandle last_site_;
     Extrema2f extents_;
-    
+    std::vector<ExtentEntry> extent_heaps_[4];
+    uint64_t generation_;
+    // Coarse grid over the sites, each cell holding the last site added in it, so that
+    // unrelated adds and long moves start their walks nearby. Cells of sites which have
+    // since been removed are skipped.
+    std::vector<SiteHandle> hint_grid_;
+    Extrema2f hint_bounds_;
+    uint32_t hint_side_;
+    // Sites noted since the build which fell outside of hint_bounds_
+    size_t hint_outside_;
+    mutable std::vector<Edge> edge_cache_;
+    mutable std::vector<uint32_t> edge_ids_;
+    mutable uint64_t edge_cache_generation_;
+    // A copy of the diagram gets a mutex of its own
+    struct CopyableMutex {
+        CopyableMutex() { }
+        CopyableMutex(CopyableMutex const&) { }
+        CopyableMutex &operator=(CopyableMutex const&) {
+            return *this;
+        }
+        std::mutex mutex;
+    };
+    mutable CopyableMutex edge_cache_mutex_;
+
+    // Counts the growth of the scratch below over its scope, see STAT_SCRATCH()
+    class ScratchGrowth {
+    public:
+        ScratchGrowth(VoronoiBase const&owner);
+        ~ScratchGrowth();
+    private:
+        size_t Bytes()const;
+        VoronoiBase const&owner_;
+        size_t start_;
+    };
+
+    // Scratch for InsertTriangulated()
+    struct BoundaryEdge {
+        uint32_t a, b, outside;
+        unsigned outside_i;
+    };
+    std::vector<uint32_t> tri_stamps_;
+    uint32_t stamp_;
+    std::vector<uint32_t> cavity_;
+    std::vector<BoundaryEdge> boundary_;
+    std::vector<uint32_t> link_;
+
+    // The change feed, NULL when off
+    ChangeRing *feed_;
+    bool feed_dropped_;
+    // Triangles born in the update being made have its stamp
+    std::vector<uint32_t> feed_born_;
+    uint32_t feed_stamp_;
+    std::vector<uint32_t> feed_born_tris_;
+    std::vector<NeighborId> feed_removed_, feed_chain_added_, feed_created_;
+    std::vector<SiteHandle> feed_changed_;
+    std::vector<Change> feed_out_;
+
+    // Scratch for Move()
+    std::vector<std::pair<uint32_t, unsigned> > flip_stack_;
+    std::vector<uint32_t> star_;
+    // Edges around the site being taken out, counter clockwise, the infinite vertex first
+    std::vector<BoundaryEdge> hole_;
+
+    // Scratch for EdgesAffectedByAdd(), kept so repeated queries do not allocate
+    mutable SearchScratch affected_;
+    mutable std::vector<std::pair<NeighborId, Edge> > affected_found_;
+    // Scratch for CellsInRegion() and Cell()
+    mutable SearchScratch region_;
+    mutable ClipPolygon clip_poly_, clip_scratch_;
+    mutable std::vector<Vec2f> region_box_;
+
+    // Filled in by GetCellStats(), cleared by the inserts which change each cell
+    mutable std::vector<CellStats> cell_stats_;
+    mutable std::vector<uint8_t> cell_stats_valid_;
+    mutable Extrema2f cell_stats_box_;
+};
+
+// Payload is stored per site, in an array parallel to the coordinates
+template<typename Payload=void>
+class Voronoi : public VoronoiBase {
+public:
+    // Will not add duplicate points, the existing site keeps its payload
+    SiteHandle Add(Vec2f const&pt, Payload const&payload) {
+        bool added;
+        const SiteHandle site = VoronoiBase::Add(pt, added);
+        if(added) {
+            payloads_.resize(NumSites());
+            payloads_[site] = payload;
+        }
+        return site;
+    }
+    // As VoronoiBase::AddUntil()
+    SiteHandle AddUntil(Vec2f const&pt, Payload const&payload, double expires) {
+        const SiteHandle site = Add(pt, payload);
+        ExtendExpiry(site, expires);
+        return site;
+    }
+    // payload_begin must have as many elements as [begin, end)
+    // For duplicates, the first payload wins
+    template<typename It, typename PayloadIt>
+    void AddRange(It begin, It end, PayloadIt payload_begin) {
+        std::vector<Vec2f> pts(begin, end);
+        std::vector<SiteHandle> handles;
+        std::vector<uint8_t> added;
+        AddBatch(pts, handles, &added);
+        std::vector<Payload> payloads;
+        payloads.reserve(pts.size());
+        for(size_t i=0;i<pts.size();++i)
+            payloads.push_back(*(payload_begin++));
+        payloads_.resize(NumSites());
+        for(size_t i=0;i<handles.size();++i) {
+            if(added[i])
+                payloads_[handles[i]] = payloads[i];
+        }
+    }
+
+    void Reserve(size_t num_sites) {
+        VoronoiBase::Reserve(num_sites);
+        payloads_.reserve(num_sites);
+    }
+
+    inline Payload const&GetPayload(SiteHandle site)const {
+        return payloads_[site];
+    }
+    inline Payload &GetPayload(SiteHandle site) {
+        return payloads_[site];
+    }
+    // Indexed by handle, NumSites() long
+    inline Payload const*Payloads()const {
+        return payloads_.data();
+    }
+
+    // NULL if there are no sites
+    Payload const*ClosestPayload(Vec2f const&pt)const {
+        const SiteHandle site = Closest(pt);
+        return (site == kNoSite) ? NULL : &payloads_[site];
+    }
+
+private:
+    // Sites can only be added with a payload
+    using VoronoiBase::Add;
+    using VoronoiBase::AddRange;
+    using VoronoiBase::AddUntil;
+
+    std::vector<Payload> payloads_;
+};
+
+template<>
+class Voronoi<void> : public VoronoiBase {
 };
 
 #endif